@@ -39,6 +39,15 @@ extern SemaphoreHandle_t xNetworkMutex;
 extern SemaphoreHandle_t xConsoleMutex;
 extern EventGroupHandle_t xSystemEvents;
 void safe_printf(const char *format, ...);
+void net_log(const char *format, ...);
+BaseType_t network_enqueue(const message_t *msg, TickType_t timeout);
+BaseType_t network_publish_buffer(const char *topic, uint8_t *payload, uint32_t len, TickType_t timeout);
+
+/* Called on the network task for every message matching the filter; it
+ * must not block. payload is NUL terminated. */
+typedef void (*network_command_handler_t)(const char *topic, const uint8_t *payload, uint32_t len, void *ctx);
+BaseType_t network_subscribe(const char *filter, uint8_t qos, network_command_handler_t handler, void *ctx);
 uint32_t get_system_time_ms(void);
+uint64_t get_time_us(void);
 
 #endif 
\ No newline at end of file
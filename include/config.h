@@ -15,11 +15,71 @@
 #define MQTT_BROKER_PORT            8883
 #define MQTT_CLIENT_ID              "stick_gateway"
 #define MQTT_TOPIC_BASE             "iot/gateway/"
+#define MQTT_PROTOCOL_VERSION       5
+#define MQTT_TOPIC_ALIAS_ENABLE     1
+#define MQTT_MESSAGE_EXPIRY_SEC     300
+#define MQTT_PERSISTENT_SESSION     1
+#define MQTT_SESSION_EXPIRY_SEC     3600
+#define MQTT_INFLIGHT_WINDOW        16
+#define MQTT_INFLIGHT_MIN_WINDOW    2
+#define MQTT_INFLIGHT_INITIAL_WINDOW 4
+#define MQTT_RETRY_TIMEOUT_MS       10000
+#define MQTT_PINGRESP_TIMEOUT_MS    10000
+#define MQTT_RTT_LIMIT_MS           1000
+#define MQTT_RTT_QUEUE_DELAY_MS     100
+#define MQTT_COALESCE_ENABLE        1
+#define MQTT_COALESCE_BUFFER_SIZE   4096
+#define MQTT_COALESCE_DEADLINE_MS   20
+#define MQTT_TX_DIRECT_MIN          512
+#define NET_TX_RING_SIZE            64
+#define NET_EVENT_RING_SIZE         16
+#define NET_BULK_RING_SIZE          4
+#define NET_BULK_QUEUE_LENGTH       4
+#define DNS_CACHE_MAX_ADDRS         8
+#define DNS_CACHE_TTL_SEC           300
+#ifndef DNS_CACHE_RETRY_SEC
+#define DNS_CACHE_RETRY_SEC         10
+#endif
+#define DNS_STUB_ENV                "IOT_GATEWAY_DNS_STUB"
+#define NET_RACE_DELAY_MS           250
+#define NET_CONNECT_TIMEOUT_MS      10000
+#define NET_HANDSHAKE_TIMEOUT_MS    5000
+#define NET_BACKOFF_BASE_MS         500
+#define NET_BACKOFF_CAP_MS          30000
+#define NET_STANDBY_ENABLE          1
+#define NET_STANDBY_RETRY_MS        5000
+#define NET_STANDBY_CHECK_MS        1000
+#define NET_STRIPE_COUNT            1
+#define NET_MAX_SUBSCRIPTIONS       8
+#define NET_COMMAND_RING_SIZE       8
+#define NET_COMMAND_MAX_PAYLOAD     256
+#define MQTT_COMMAND_FILTER         MQTT_TOPIC_BASE "cmd/#"
+#define MQTT_COMMAND_QOS            1
 #define NUM_TEMP_SENSORS            3
 #define NUM_HUMIDITY_SENSORS        2
 #define NUM_MOTION_SENSORS          1
 #define SENSOR_READ_INTERVAL_MS     1000
 #define TLS_VERIFY_REQUIRED         1
+#define TLS_CA_CERT_PATH            "mosquitto.org.crt"
+#define TLS_CLIENT_CERT_PATH        ""
+#define TLS_CLIENT_KEY_PATH         ""
+#define TLS_PSK_FILE                ""
+#define TLS_PSK_EPHEMERAL           1
+#define TLS_RESUME_EPHEMERAL        1
+#define TLS_KTLS_ENABLE             0
+#ifndef TLS_MAX_FRAGMENT_LEN
+#define TLS_MAX_FRAGMENT_LEN        0
+#endif
+#ifndef TLS_IN_CONTENT_LEN
+#define TLS_IN_CONTENT_LEN          16384
+#endif
+#ifndef TLS_OUT_CONTENT_LEN
+#define TLS_OUT_CONTENT_LEN         4096
+#endif
+#define TLS_ARENA_SIZE              ((64 + NET_STRIPE_COUNT * 96) * 1024)
+#ifndef TLS_CA_EMBEDDED
+#define TLS_CA_EMBEDDED             0
+#endif
 #define MAX_CERT_SIZE               4096
 #define DATA_PROCESSOR_BATCH_SIZE        10
 #define DATA_PROCESSOR_BATCH_TIMEOUT_MS  5000
@@ -0,0 +1,24 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Broker address with its measured TCP connect latency. connect_us is a
+ * smoothed average, 0 until the address has been tried. */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint32_t connect_us;
+    uint16_t failures;
+} dns_addr_t;
+
+int dns_cache_init(const char *host, uint16_t port);
+void dns_cache_shutdown(void);
+int dns_cache_get(dns_addr_t *addrs, int max, uint32_t timeout_ms);
+void dns_cache_refresh(void);
+void dns_cache_report(const dns_addr_t *addr, uint32_t connect_us, bool ok);
+const char *dns_addr_str(const dns_addr_t *addr, char *buf, size_t len);
+
+#endif
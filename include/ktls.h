@@ -0,0 +1,37 @@
+#ifndef KTLS_H
+#define KTLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mbedtls/ssl.h"
+
+/* Kernel TLS transmit offload. mbedTLS runs the handshake and keeps the
+ * receive side; once it is done the client write key moves into the socket
+ * and the engine sends plaintext with send(), which the kernel frames and
+ * encrypts. Only AES-GCM and ChaCha20-Poly1305 suites can be offloaded. */
+
+/* The kernel fills records up to the TLS maximum, whatever the record
+ * limits mbedTLS was built or negotiated with. */
+#define KTLS_MAX_RECORD 16384
+
+/* What the key export callback captured during the handshake: the TLS 1.2
+ * master secret with both randoms, or the TLS 1.3 client application
+ * traffic secret. */
+typedef struct {
+    unsigned char secret[48];
+    unsigned char randoms[64];
+    size_t secret_len;
+    mbedtls_tls_prf_types prf;
+} ktls_secrets_t;
+
+void ktls_capture(mbedtls_ssl_context *ssl, ktls_secrets_t *secrets);
+/* Client write key and IV (only the fixed part for TLS 1.2 AES-GCM) from
+ * the captured secrets. */
+int ktls_derive_client_keys(const ktls_secrets_t *secrets, bool tls13, size_t key_len, size_t fixed_iv_len,
+                            unsigned char *key, unsigned char *iv);
+int ktls_enable_tx(int fd, const mbedtls_ssl_context *ssl, ktls_secrets_t *secrets, uint8_t *record_overhead);
+int ktls_send(int fd, const uint8_t *buf, size_t len, bool more);
+void ktls_close_notify(int fd);
+
+#endif
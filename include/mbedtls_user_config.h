@@ -0,0 +1,46 @@
+#ifndef MBEDTLS_USER_CONFIG_H
+#define MBEDTLS_USER_CONFIG_H
+
+/* Applied on top of the vendored default configuration through
+ * MBEDTLS_USER_CONFIG_FILE, for both the library and the gateway. */
+
+#include "config.h"
+
+/* TLS 1.3 with TLS 1.2 as fallback for brokers that lack it */
+#define MBEDTLS_SSL_PROTO_TLS1_3
+#define MBEDTLS_SSL_TLS1_3_COMPATIBILITY_MODE
+
+/* Key exchanges without forward secrecy or with finite-field DH. PSK and
+ * ECDHE-PSK stay for pre-shared key deployments. */
+#undef MBEDTLS_KEY_EXCHANGE_RSA_ENABLED
+#undef MBEDTLS_KEY_EXCHANGE_DHE_RSA_ENABLED
+#undef MBEDTLS_KEY_EXCHANGE_RSA_PSK_ENABLED
+#undef MBEDTLS_KEY_EXCHANGE_DHE_PSK_ENABLED
+#undef MBEDTLS_KEY_EXCHANGE_ECDH_RSA_ENABLED
+#undef MBEDTLS_KEY_EXCHANGE_ECDH_ECDSA_ENABLED
+
+/* Lets the gateway route allocations to its TLS arena */
+#define MBEDTLS_PLATFORM_MEMORY
+
+/* Record plaintext limits, which size the two buffers every connection
+ * holds for its lifetime. Input has to fit the largest record the broker
+ * sends, handshake messages included, since mbedTLS does not reassemble
+ * those; 16384 is the protocol maximum and a TLS 1.2 broker can be held to
+ * less with TLS_MAX_FRAGMENT_LEN. Output only has to fit our own handshake
+ * messages, as longer writes are split into several records. */
+#define MBEDTLS_SSL_IN_CONTENT_LEN          TLS_IN_CONTENT_LEN
+#define MBEDTLS_SSL_OUT_CONTENT_LEN         TLS_OUT_CONTENT_LEN
+
+#if TLS_MAX_FRAGMENT_LEN > 0
+#if TLS_IN_CONTENT_LEN < TLS_MAX_FRAGMENT_LEN
+#error "TLS_IN_CONTENT_LEN cannot hold a TLS_MAX_FRAGMENT_LEN record"
+#endif
+/* Shrinks both buffers to the negotiated fragment length once the
+ * handshake is over, and grows them back on reconnect */
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+#endif
+
+/* Legacy ciphers no offered suite uses */
+#undef MBEDTLS_DES_C
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MQTT_RX_RING_SIZE       2048
+#define MQTT_MAX_LENGTH_BYTES   4
+#define MQTT_MAX_REMAINING_LEN  268435455U
+#define MQTT_PROTOCOL_LEVEL     4
+#define MQTT_PROTOCOL_LEVEL_5   5
+
+#define MQTT_CONNECT            0x10
+#define MQTT_CONNACK            0x20
+#define MQTT_PUBLISH            0x30
+#define MQTT_PUBACK             0x40
+#define MQTT_PUBREC             0x50
+#define MQTT_PUBREL             0x60
+#define MQTT_PUBCOMP            0x70
+#define MQTT_SUBSCRIBE          0x80
+#define MQTT_SUBACK             0x90
+#define MQTT_UNSUBSCRIBE        0xA0
+#define MQTT_UNSUBACK           0xB0
+#define MQTT_PINGREQ            0xC0
+#define MQTT_PINGRESP           0xD0
+#define MQTT_DISCONNECT         0xE0
+
+#define MQTT_QOS0               0
+#define MQTT_QOS1               1
+#define MQTT_QOS2               2
+#define MQTT_PUBLISH_DUP        0x08
+#define MQTT_PUBLISH_RETAIN     0x01
+#define MQTT_SUBACK_FAILURE     0x80
+
+/* MQTT 5 reason codes used by the client. Anything >= 0x80 is a failure. */
+#define MQTT_RC_SUCCESS                 0x00
+#define MQTT_RC_NO_MATCHING_SUBSCRIBERS 0x10
+#define MQTT_RC_UNSPECIFIED_ERROR       0x80
+#define MQTT_RC_UNSUPPORTED_VERSION     0x84
+#define MQTT_RC_TOPIC_ALIAS_INVALID     0x94
+#define MQTT_RC_RECEIVE_MAX_EXCEEDED    0x93
+#define MQTT_RC_QUOTA_EXCEEDED          0x97
+
+/* MQTT 5 property identifiers. */
+#define MQTT_PROP_PAYLOAD_FORMAT        0x01
+#define MQTT_PROP_MESSAGE_EXPIRY        0x02
+#define MQTT_PROP_CONTENT_TYPE          0x03
+#define MQTT_PROP_RESPONSE_TOPIC        0x08
+#define MQTT_PROP_CORRELATION_DATA      0x09
+#define MQTT_PROP_SUBSCRIPTION_ID       0x0B
+#define MQTT_PROP_SESSION_EXPIRY        0x11
+#define MQTT_PROP_ASSIGNED_CLIENT_ID    0x12
+#define MQTT_PROP_SERVER_KEEPALIVE      0x13
+#define MQTT_PROP_AUTH_METHOD           0x15
+#define MQTT_PROP_AUTH_DATA             0x16
+#define MQTT_PROP_REQUEST_PROBLEM_INFO  0x17
+#define MQTT_PROP_WILL_DELAY            0x18
+#define MQTT_PROP_REQUEST_RESPONSE_INFO 0x19
+#define MQTT_PROP_RESPONSE_INFO         0x1A
+#define MQTT_PROP_SERVER_REFERENCE      0x1C
+#define MQTT_PROP_REASON_STRING         0x1F
+#define MQTT_PROP_RECEIVE_MAXIMUM       0x21
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM   0x22
+#define MQTT_PROP_TOPIC_ALIAS           0x23
+#define MQTT_PROP_MAXIMUM_QOS           0x24
+#define MQTT_PROP_RETAIN_AVAILABLE      0x25
+#define MQTT_PROP_USER_PROPERTY         0x26
+#define MQTT_PROP_MAXIMUM_PACKET_SIZE   0x27
+#define MQTT_PROP_WILDCARD_SUB_AVAIL    0x28
+#define MQTT_PROP_SUB_ID_AVAIL          0x29
+#define MQTT_PROP_SHARED_SUB_AVAIL      0x2A
+
+/* Bits in mqtt_properties_t.present, one per supported property. */
+#define MQTT_HAS_PAYLOAD_FORMAT         (1u << 0)
+#define MQTT_HAS_MESSAGE_EXPIRY         (1u << 1)
+#define MQTT_HAS_CONTENT_TYPE           (1u << 2)
+#define MQTT_HAS_SESSION_EXPIRY         (1u << 3)
+#define MQTT_HAS_ASSIGNED_CLIENT_ID     (1u << 4)
+#define MQTT_HAS_SERVER_KEEPALIVE       (1u << 5)
+#define MQTT_HAS_REASON_STRING          (1u << 6)
+#define MQTT_HAS_RECEIVE_MAXIMUM        (1u << 7)
+#define MQTT_HAS_TOPIC_ALIAS_MAXIMUM    (1u << 8)
+#define MQTT_HAS_TOPIC_ALIAS            (1u << 9)
+#define MQTT_HAS_MAXIMUM_QOS            (1u << 10)
+#define MQTT_HAS_RETAIN_AVAILABLE       (1u << 11)
+#define MQTT_HAS_MAXIMUM_PACKET_SIZE    (1u << 12)
+
+/* Length-prefixed MQTT string or binary field; data is not NUL terminated. */
+typedef struct {
+    const uint8_t *data;
+    uint16_t len;
+} mqtt_str_t;
+
+typedef struct {
+    mqtt_str_t key;
+    mqtt_str_t value;
+} mqtt_user_property_t;
+
+/* The MQTT 5 properties the codec understands. Encoders write the ones
+ * flagged in `present` followed by all user_properties in one block.
+ * Decoders fill `present` and the values, count user properties without
+ * returning them, and skip the other valid properties. */
+typedef struct {
+    uint32_t present;
+    uint8_t payload_format;
+    uint32_t message_expiry;
+    mqtt_str_t content_type;
+    uint32_t session_expiry;
+    mqtt_str_t assigned_client_id;
+    uint16_t server_keepalive;
+    mqtt_str_t reason_string;
+    uint16_t receive_maximum;
+    uint16_t topic_alias_maximum;
+    uint16_t topic_alias;
+    uint8_t maximum_qos;
+    uint8_t retain_available;
+    uint32_t maximum_packet_size;
+    const mqtt_user_property_t *user_properties;
+    size_t user_property_count;
+} mqtt_properties_t;
+
+/* protocol_level 0 means MQTT_PROTOCOL_LEVEL. properties is only sent (and
+ * may be NULL) at MQTT_PROTOCOL_LEVEL_5. */
+typedef struct {
+    uint8_t protocol_level;
+    const mqtt_properties_t *properties;
+    mqtt_str_t client_id;
+    mqtt_str_t username;
+    mqtt_str_t password;
+    mqtt_str_t will_topic;
+    mqtt_str_t will_payload;
+    uint8_t will_qos;
+    bool will_retain;
+    bool has_will;
+    bool has_username;
+    bool has_password;
+    bool clean_session;
+    uint16_t keepalive_sec;
+} mqtt_connect_t;
+
+/* A non-NULL properties pointer encodes the packet in MQTT 5 form. With a
+ * topic alias the topic may be empty. */
+typedef struct {
+    mqtt_str_t topic;
+    const mqtt_properties_t *properties;
+    const uint8_t *payload;
+    uint32_t payload_len;
+    uint8_t qos;
+    bool retain;
+    bool dup;
+    uint16_t packet_id;
+} mqtt_publish_t;
+
+typedef struct {
+    mqtt_str_t filter;
+    uint8_t qos;
+} mqtt_subscription_t;
+
+/* One element of a gather list handed to a vectored write. */
+typedef struct {
+    const void *base;
+    size_t len;
+} mqtt_iovec_t;
+
+/* A complete packet in the receive ring. body points at the variable header
+ * and stays valid until the next mqtt_rx_write_ptr() call. */
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    const uint8_t *body;
+    uint32_t body_len;
+} mqtt_packet_view_t;
+
+/* A packet too large for the ring is skipped as its bytes arrive: discard
+ * counts what is still to come and oversized how many were skipped. */
+typedef struct {
+    uint8_t buf[MQTT_RX_RING_SIZE];
+    uint8_t linear[MQTT_RX_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t discard;
+    uint32_t oversized;
+} mqtt_rx_ring_t;
+
+void mqtt_rx_init(mqtt_rx_ring_t *ring);
+uint8_t *mqtt_rx_write_ptr(mqtt_rx_ring_t *ring, size_t *avail);
+void mqtt_rx_commit(mqtt_rx_ring_t *ring, size_t len);
+int mqtt_rx_next(mqtt_rx_ring_t *ring, mqtt_packet_view_t *view);
+int mqtt_decode_length(const uint8_t *buf, size_t avail, uint32_t *length);
+int mqtt_decode_packet(const uint8_t *buf, size_t avail, mqtt_packet_view_t *view);
+
+/* Encoders write into the caller's buffer and return the number of bytes
+ * written, or -1 if the packet is invalid or does not fit in `size`. */
+int mqtt_encode_length(uint8_t *buf, size_t size, uint32_t length);
+int mqtt_encode_connect(uint8_t *buf, size_t size, const mqtt_connect_t *connect);
+int mqtt_encode_connack(uint8_t *buf, size_t size, bool session_present, uint8_t return_code);
+int mqtt_encode_publish(uint8_t *buf, size_t size, const mqtt_publish_t *publish);
+int mqtt_encode_publish_header(uint8_t *buf, size_t size, const mqtt_publish_t *publish);
+int mqtt_publish_iov(uint8_t *header, size_t size, const mqtt_publish_t *publish, mqtt_iovec_t iov[2]);
+int mqtt_encode_ack(uint8_t *buf, size_t size, uint8_t type, uint16_t packet_id);
+int mqtt_encode_subscribe(uint8_t *buf, size_t size, uint16_t packet_id,
+                          const mqtt_subscription_t *subs, size_t count);
+int mqtt_encode_suback(uint8_t *buf, size_t size, uint16_t packet_id,
+                       const uint8_t *return_codes, size_t count);
+int mqtt_encode_unsubscribe(uint8_t *buf, size_t size, uint16_t packet_id,
+                            const mqtt_str_t *filters, size_t count);
+int mqtt_encode_empty(uint8_t *buf, size_t size, uint8_t type);
+int mqtt_encode_connack_v5(uint8_t *buf, size_t size, bool session_present, uint8_t reason_code,
+                           const mqtt_properties_t *properties);
+int mqtt_encode_ack_v5(uint8_t *buf, size_t size, uint8_t type, uint16_t packet_id, uint8_t reason_code);
+int mqtt_encode_disconnect_v5(uint8_t *buf, size_t size, uint8_t reason_code);
+int mqtt_encode_subscribe_v5(uint8_t *buf, size_t size, uint16_t packet_id,
+                             const mqtt_subscription_t *subs, size_t count,
+                             const mqtt_properties_t *properties);
+
+/* Decoders read a packet view; strings and payloads point into its body.
+ * They return 0 on success or -1 if the packet is malformed. */
+int mqtt_decode_connect(const mqtt_packet_view_t *view, mqtt_connect_t *connect);
+int mqtt_decode_connack(const mqtt_packet_view_t *view, bool *session_present, uint8_t *return_code);
+int mqtt_decode_publish(const mqtt_packet_view_t *view, mqtt_publish_t *publish);
+int mqtt_decode_ack(const mqtt_packet_view_t *view, uint16_t *packet_id);
+int mqtt_decode_subscribe(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                          mqtt_subscription_t *subs, size_t max, size_t *count);
+int mqtt_decode_suback(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                       const uint8_t **return_codes, size_t *count);
+int mqtt_decode_unsubscribe(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                            mqtt_str_t *filters, size_t max, size_t *count);
+int mqtt_decode_connack_v5(const mqtt_packet_view_t *view, bool *session_present,
+                           uint8_t *reason_code, mqtt_properties_t *properties);
+int mqtt_decode_publish_v5(const mqtt_packet_view_t *view, mqtt_publish_t *publish,
+                           mqtt_properties_t *properties);
+int mqtt_decode_ack_v5(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                       uint8_t *reason_code, mqtt_properties_t *properties);
+int mqtt_decode_suback_v5(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                          const uint8_t **return_codes, size_t *count,
+                          mqtt_properties_t *properties);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef NET_METRICS_H
+#define NET_METRICS_H
+
+#include <stdint.h>
+
+#define LATENCY_HIST_BUCKETS    124
+
+/* Log-linear latency histogram: four buckets per power of two, so any
+ * percentile is reported within 25% of the true value. */
+typedef struct {
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+} latency_hist_t;
+
+typedef struct {
+    uint32_t window;
+    uint32_t inflight;
+    uint32_t rtt_samples;
+    uint32_t rtt_min_us;
+    uint32_t rtt_srtt_us;
+    uint32_t rtt_p50_us;
+    uint32_t rtt_p90_us;
+    uint32_t rtt_p99_us;
+    uint32_t retransmits;
+    uint32_t window_decreases;
+    uint32_t tx_messages;
+    uint32_t tx_records;
+    uint32_t tx_aliased;
+    uint32_t tx_rejected;
+    uint32_t tx_expired;
+    uint32_t tx_syscalls;
+    uint32_t rx_oversized;
+    uint32_t rx_dropped;
+    uint64_t tx_wire_bytes;
+    uint32_t tls_full;
+    uint32_t tls_full_p50_us;
+    uint32_t tls_full_p99_us;
+    uint32_t tls_full_cpu_us;
+    uint32_t tls_resumed;
+    uint32_t tls_resumed_p50_us;
+    uint32_t tls_resumed_p99_us;
+    uint32_t tls_resumed_cpu_us;
+    uint32_t tls_full_allocs;
+    uint32_t tls_resumed_allocs;
+    uint32_t tls_arena_size;
+    uint32_t tls_arena_used;
+    uint32_t tls_arena_peak;
+    uint32_t tls_arena_largest_free;
+    uint32_t tls_arena_failures;
+    uint32_t tls_conn_memory;
+    uint8_t tls_conns;
+    uint8_t protocol_level;
+    uint8_t sessions;
+    uint8_t sessions_up;
+} network_stats_t;
+
+void latency_hist_reset(latency_hist_t *hist);
+void latency_hist_record(latency_hist_t *hist, uint32_t us);
+void latency_hist_merge(latency_hist_t *dst, const latency_hist_t *src);
+uint32_t latency_hist_percentile(const latency_hist_t *hist, uint32_t percent);
+
+void network_get_stats(network_stats_t *stats);
+
+#endif
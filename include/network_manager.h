@@ -0,0 +1,78 @@
+#ifndef NETWORK_MANAGER_H
+#define NETWORK_MANAGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+#include "dns_cache.h"
+#include "net_metrics.h"
+#include "ktls.h"
+#include "mbedtls/ssl.h"
+
+typedef enum {
+    TLS_CONN_IDLE,
+    TLS_CONN_RESOLVING,
+    TLS_CONN_CONNECTING,
+    TLS_CONN_HANDSHAKE,
+    TLS_CONN_READY,
+    TLS_CONN_FAILED
+} tls_conn_state_t;
+
+/* One broker connection. The TCP connect races the resolved addresses and
+ * the TLS handshake is stepped from the engine loop, so neither blocks. The
+ * ssl context is set up on first use and only reset between connections. */
+typedef struct {
+    tls_conn_state_t state;
+    int fd;
+    dns_addr_t peer;
+    dns_addr_t race_addrs[DNS_CACHE_MAX_ADDRS];
+    int race_fds[DNS_CACHE_MAX_ADDRS];
+    uint64_t race_started_us[DNS_CACHE_MAX_ADDRS];
+    int race_count;
+    int race_launched;
+    uint64_t next_launch_us;
+    uint64_t deadline_us;
+    uint64_t started_us;
+    uint64_t handshake_started_us;
+    uint64_t handshake_cpu_us;
+    uint32_t handshake_allocs;
+    size_t memory;
+    uint64_t checked_us;
+    int lane;
+    bool resume_offered;
+    bool cert_received;
+    uint32_t events;
+    bool tls_initialized;
+    const mbedtls_ssl_config *tls_conf;
+    bool tls_used;
+    bool ktls_tx;
+    uint8_t ktls_overhead;
+    ktls_secrets_t ktls_secrets;
+    mbedtls_ssl_context ssl;
+} tls_conn_t;
+
+/* Completed handshakes, split by whether the broker resumed a session.
+ * Allocation counts stay zero while the TLS arena is disabled. */
+typedef struct {
+    latency_hist_t full;
+    latency_hist_t resumed;
+    uint64_t full_cpu_us;
+    uint64_t resumed_cpu_us;
+    uint64_t full_allocs;
+    uint64_t resumed_allocs;
+} netmgr_handshakes_t;
+
+int netmgr_init(int epoll_fd);
+void netmgr_shutdown(void);
+tls_conn_t *netmgr_poll(int lane, uint64_t now_us);
+void netmgr_session_up(int lane);
+void netmgr_session_ticket(tls_conn_t *conn);
+int netmgr_read(tls_conn_t *conn, uint8_t *buf, size_t len);
+int netmgr_write(tls_conn_t *conn, const uint8_t *buf, size_t len, bool more);
+void netmgr_release(int lane, tls_conn_t *conn, bool failed);
+int netmgr_timeout_ms(uint64_t now_us, int max_ms);
+void netmgr_get_io(uint32_t *syscalls, uint64_t *wire_bytes);
+const netmgr_handshakes_t *netmgr_get_handshakes(void);
+size_t netmgr_tls_memory(int *conns);
+
+#endif
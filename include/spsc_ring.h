@@ -0,0 +1,27 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SPSC_CACHE_LINE         64
+
+/* Lock-free single-producer/single-consumer ring of fixed-size elements.
+ * head is only written by the producer and tail only by the consumer, so
+ * the two sides can run on different threads without a lock. capacity must
+ * be a power of two. */
+typedef struct {
+    uint32_t head __attribute__((aligned(SPSC_CACHE_LINE)));
+    uint32_t tail __attribute__((aligned(SPSC_CACHE_LINE)));
+    uint8_t *slots __attribute__((aligned(SPSC_CACHE_LINE)));
+    uint32_t elem_size;
+    uint32_t mask;
+} spsc_ring_t;
+
+void spsc_ring_init(spsc_ring_t *ring, void *storage, uint32_t elem_size, uint32_t capacity);
+bool spsc_ring_push(spsc_ring_t *ring, const void *elem);
+bool spsc_ring_pop(spsc_ring_t *ring, void *elem);
+const void *spsc_ring_peek(const spsc_ring_t *ring);
+uint32_t spsc_ring_free(const spsc_ring_t *ring);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mbedtls/ssl.h"
+#include "tls_arena.h"
+
+/* TLS state shared by every broker connection: the DRBG, the parsed CA
+ * chain, the optional client certificate and the ssl config built on them.
+ * Set up once at startup; connections only own an mbedtls_ssl_context.
+ * With a pre-shared key provisioned, the config offers PSK suites only and
+ * no certificates are loaded. */
+int tls_init(void);
+void tls_free(void);
+const mbedtls_ssl_config *tls_config(void);
+/* The config for connections that offer a saved session. It is tls_config()
+ * unless TLS 1.3 resumption is limited to psk_ke (TLS_RESUME_EPHEMERAL). */
+const mbedtls_ssl_config *tls_resume_config(void);
+bool tls_psk_enabled(void);
+/* Certificates the broker has sent so far, over every connection. */
+uint32_t tls_cert_count(void);
+
+/* With TLS_ARENA_SIZE set, every mbedTLS allocation comes from one static
+ * arena. tls_memory_stats() returns false and the counters stay at 0 when it
+ * is disabled. tls_memory_charge() adds what is allocated from then on to
+ * *owner, which the blocks credit again when freed; NULL stops charging. */
+size_t tls_memory_used(void);
+void tls_memory_charge(size_t *owner);
+uint32_t tls_alloc_count(void);
+bool tls_memory_stats(tls_arena_stats_t *stats);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef TLS_ARENA_H
+#define TLS_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* First-fit allocator over one caller-provided buffer. Free blocks are kept
+ * in address order and merged with their neighbours when freed, so the
+ * arena only fragments while allocations of different lifetimes interleave.
+ * Each block is charged to the counter `owner` pointed at when it was
+ * allocated, and freeing it credits the same counter whatever owner is set
+ * by then. Not thread safe. */
+typedef struct tls_arena_block tls_arena_block_t;
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    tls_arena_block_t *free_list;
+    size_t *owner;
+    size_t used;
+    size_t peak;
+    uint32_t blocks;
+    uint32_t allocs;
+    uint32_t failures;
+} tls_arena_t;
+
+/* used and peak include block headers. largest_free is the biggest single
+ * allocation that would currently succeed, plus its header. */
+typedef struct {
+    size_t size;
+    size_t used;
+    size_t peak;
+    size_t largest_free;
+    uint32_t blocks;
+    uint32_t free_blocks;
+    uint32_t allocs;
+    uint32_t failures;
+} tls_arena_stats_t;
+
+void tls_arena_init(tls_arena_t *arena, void *buf, size_t len);
+void *tls_arena_calloc(tls_arena_t *arena, size_t n, size_t size);
+void tls_arena_free(tls_arena_t *arena, void *ptr);
+void tls_arena_stats(const tls_arena_t *arena, tls_arena_stats_t *stats);
+
+#endif
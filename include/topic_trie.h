@@ -0,0 +1,48 @@
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TOPIC_TRIE_MAX_FILTERS  32
+#define TOPIC_TRIE_MAX_NODES    128
+#define TOPIC_TRIE_EDGE_SLOTS   256
+#define TOPIC_TRIE_TEXT_SIZE    1024
+#define TOPIC_TRIE_MAX_LEVELS   16
+
+/* A node is one topic level. match has a bit for every filter that ends
+ * here; multi has one for every filter that ends in "#" right below it,
+ * which also matches this level itself. */
+typedef struct {
+    uint32_t match;
+    uint32_t multi;
+    int16_t plus;
+} topic_trie_node_t;
+
+/* Literal children live in one open-addressed table keyed by parent node
+ * and level text, so each level of a topic is a single hash probe. With
+ * twice as many slots as nodes the table is never more than half full. */
+typedef struct {
+    uint32_t hash;
+    int16_t parent;
+    int16_t child;
+    uint16_t text_off;
+    uint16_t text_len;
+} topic_trie_edge_t;
+
+typedef struct {
+    topic_trie_node_t nodes[TOPIC_TRIE_MAX_NODES];
+    topic_trie_edge_t edges[TOPIC_TRIE_EDGE_SLOTS];
+    char text[TOPIC_TRIE_TEXT_SIZE];
+    uint16_t node_count;
+    uint16_t text_len;
+    uint8_t filter_count;
+} topic_trie_t;
+
+void topic_trie_init(topic_trie_t *trie);
+bool topic_filter_valid(const char *filter, size_t len);
+int topic_trie_add(topic_trie_t *trie, const char *filter, size_t len);
+uint32_t topic_trie_match(const topic_trie_t *trie, const char *topic, size_t len);
+
+#endif
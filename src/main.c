@@ -12,6 +12,7 @@
 #include "common.h"
 #include "tsk_priority.h"
 #include "FreeRTOSConfig.h"
+#include "net_metrics.h"
 
 QueueHandle_t xSensorQueue = NULL;
 QueueHandle_t xNetworkQueue = NULL;
@@ -25,8 +26,10 @@ extern void vNetworkTask(void *pvParameters);
 extern void vSecurityTask(void *pvParameters);
 void vDataProcessorTask(void *pvParameters);
 void vSystemMonitorTask(void *pvParameters);
+static void vCommandHandler(const char *topic, const uint8_t *payload, uint32_t len, void *ctx);
 void safe_printf(const char *format, ...);
 uint32_t get_system_time_ms(void);
+uint64_t get_time_us(void);
 
 
 int main(void) {
@@ -110,6 +113,9 @@ int main(void) {
     } else {
     printf("Network task created successfully\n");  
     }
+    if (network_subscribe(MQTT_COMMAND_FILTER, MQTT_COMMAND_QOS, vCommandHandler, NULL) != pdPASS) {
+        printf("Error: Failed to subscribe to %s\n", MQTT_COMMAND_FILTER);
+    }
     
 
     /* Security Task */
@@ -229,7 +235,7 @@ void vDataProcessorTask(void *pvParameters) {
             network_msg.priority = (sensor_data.type == SENSOR_TYPE_MOTION) ? 2 : 1;
             network_msg.encrypted = false;
 
-            if (xQueueSend(xNetworkQueue, &network_msg, pdMS_TO_TICKS(100)) != pdPASS) {
+            if (network_enqueue(&network_msg, pdMS_TO_TICKS(100)) != pdPASS) {
                 safe_printf("Failed to send to network queue\n");
             }
             vTaskDelay(pdMS_TO_TICKS(100));
@@ -238,16 +244,71 @@ void vDataProcessorTask(void *pvParameters) {
 }
 
 void vSystemMonitorTask(void *pvParameters) {
+    network_stats_t net_stats;
     safe_printf("[SystemMonitor] Started\n");
     for (;;) {
         UBaseType_t uxSensorQueueMessages = uxQueueMessagesWaiting(xSensorQueue);
         safe_printf("[SystemMonitor] Sensor queue has %lu messages\n", 
                    (unsigned long)uxSensorQueueMessages);
+
+        network_get_stats(&net_stats);
+        if (net_stats.sessions > 1) {
+            safe_printf("[SystemMonitor] MQTT sessions up: %u of %u\n",
+                       (unsigned int)net_stats.sessions_up, (unsigned int)net_stats.sessions);
+        }
+        safe_printf("[SystemMonitor] MQTT window %u (%u in flight), PUBACK RTT p50/p90/p99 %.1f/%.1f/%.1f ms over %u samples\n",
+                   (unsigned int)net_stats.window, (unsigned int)net_stats.inflight,
+                   net_stats.rtt_p50_us / 1000.0, net_stats.rtt_p90_us / 1000.0,
+                   net_stats.rtt_p99_us / 1000.0, (unsigned int)net_stats.rtt_samples);
+        if (net_stats.tx_messages > 0) {
+            safe_printf("[SystemMonitor] MQTT tx per message: %.2f records, %.2f syscalls, %.1f wire bytes (%u messages)\n",
+                       (double)net_stats.tx_records / net_stats.tx_messages,
+                       (double)net_stats.tx_syscalls / net_stats.tx_messages,
+                       (double)net_stats.tx_wire_bytes / net_stats.tx_messages,
+                       (unsigned int)net_stats.tx_messages);
+        }
+        if (net_stats.tls_full + net_stats.tls_resumed > 0) {
+            safe_printf("[SystemMonitor] TLS handshakes: %u full (p50/p99 %.1f/%.1f ms, %.1f ms CPU), %u resumed (p50/p99 %.1f/%.1f ms, %.1f ms CPU)\n",
+                       (unsigned int)net_stats.tls_full, net_stats.tls_full_p50_us / 1000.0,
+                       net_stats.tls_full_p99_us / 1000.0, net_stats.tls_full_cpu_us / 1000.0,
+                       (unsigned int)net_stats.tls_resumed, net_stats.tls_resumed_p50_us / 1000.0,
+                       net_stats.tls_resumed_p99_us / 1000.0, net_stats.tls_resumed_cpu_us / 1000.0);
+        }
+        if (net_stats.tls_arena_size > 0) {
+            uint32_t free_bytes = net_stats.tls_arena_size - net_stats.tls_arena_used;
+            safe_printf("[SystemMonitor] TLS memory: %u/%u KB used, peak %u KB, largest free %u KB (%u%% fragmented), %u failed; %u allocs per full handshake, %u per resumed\n",
+                       (unsigned int)(net_stats.tls_arena_used / 1024), (unsigned int)(net_stats.tls_arena_size / 1024),
+                       (unsigned int)(net_stats.tls_arena_peak / 1024),
+                       (unsigned int)(net_stats.tls_arena_largest_free / 1024),
+                       free_bytes > 0 ? (unsigned int)(100 - 100ULL * net_stats.tls_arena_largest_free / free_bytes) : 0,
+                       (unsigned int)net_stats.tls_arena_failures,
+                       (unsigned int)net_stats.tls_full_allocs, (unsigned int)net_stats.tls_resumed_allocs);
+        }
+        if (net_stats.tls_conn_memory > 0) {
+            safe_printf("[SystemMonitor] TLS memory per connection: %u bytes (%u connections)\n",
+                       (unsigned int)(net_stats.tls_conn_memory / net_stats.tls_conns),
+                       (unsigned int)net_stats.tls_conns);
+        }
+        if (net_stats.rx_oversized > 0 || net_stats.rx_dropped > 0) {
+            safe_printf("[SystemMonitor] Inbound: %u oversized packets skipped, %u commands dropped\n",
+                       (unsigned int)net_stats.rx_oversized, (unsigned int)net_stats.rx_dropped);
+        }
+        if (net_stats.protocol_level == 5 && net_stats.tx_messages > 0) {
+            safe_printf("[SystemMonitor] MQTT 5: %u%% of publishes by topic alias, %u rejected, %u expired\n",
+                       (unsigned int)(100ULL * net_stats.tx_aliased / net_stats.tx_messages),
+                       (unsigned int)net_stats.tx_rejected, (unsigned int)net_stats.tx_expired);
+        }
         
         vTaskDelay(pdMS_TO_TICKS(5000));
     }
 }
 
+/* Runs on the network task; must not block. */
+static void vCommandHandler(const char *topic, const uint8_t *payload, uint32_t len, void *ctx) {
+    (void)ctx;
+    safe_printf("[Command] %s: %.*s\n", topic, (int)len, (const char *)payload);
+}
+
 void safe_printf(const char *format, ...) {
     va_list args;
     va_start(args, format);
@@ -259,10 +320,28 @@ void safe_printf(const char *format, ...) {
     va_end(args);
 }
 
+/* For native threads outside the scheduler, which must not take FreeRTOS
+ * mutexes. stdout's own lock keeps lines from interleaving. */
+void net_log(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    flockfile(stdout);
+    vprintf(format, args);
+    fflush(stdout);
+    funlockfile(stdout);
+    va_end(args);
+}
+
 uint32_t get_system_time_ms(void) {
     return xTaskGetTickCount() * portTICK_PERIOD_MS;
 }
 
+uint64_t get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 void vApplicationMallocFailedHook(void) {
     printf("Malloc failed!\n");
     configASSERT(0);
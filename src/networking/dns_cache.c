@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "config.h"
+#include "common.h"
+#include "dns_cache.h"
+
+/* Broker addresses resolved in the background by a resolver thread, so a
+ * reconnect only waits for DNS on the very first attempt. Entries are served
+ * past their TTL while a refresh is in flight, and kept ordered so the
+ * fastest address that last connected is tried first. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t updated;
+    pthread_t thread;
+    bool running;
+    bool refresh_requested;
+    bool resolving;
+    const char *stub;
+    char host[256];
+    uint16_t port;
+    dns_addr_t addrs[DNS_CACHE_MAX_ADDRS];
+    int count;
+    uint32_t generation;
+    uint64_t expires_us;
+    uint64_t next_refresh_us;
+} dns_cache_t;
+
+static dns_cache_t cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void deadline_to_timespec(uint64_t deadline_us, struct timespec *ts) {
+    ts->tv_sec = (time_t)(deadline_us / 1000000ULL);
+    ts->tv_nsec = (long)(deadline_us % 1000000ULL) * 1000L;
+}
+
+static bool same_addr(const dns_addr_t *a, const dns_addr_t *b) {
+    return a->addr_len == b->addr_len && memcmp(&a->addr, &b->addr, a->addr_len) == 0;
+}
+
+/* Addresses that connected sort by latency, untried ones keep resolver
+ * order after them, and failing ones go last. */
+static int addr_rank(const dns_addr_t *a) {
+    if (a->failures > 0) {
+        return 2;
+    }
+    return a->connect_us == 0 ? 1 : 0;
+}
+
+static bool addr_before(const dns_addr_t *a, const dns_addr_t *b) {
+    int ra = addr_rank(a);
+    int rb = addr_rank(b);
+    if (ra != rb) {
+        return ra < rb;
+    }
+    if (ra == 0) {
+        return a->connect_us < b->connect_us;
+    }
+    return ra == 2 && a->failures < b->failures;
+}
+
+static void sort_addrs(void) {
+    for (int i = 1; i < cache.count; i++) {
+        dns_addr_t key = cache.addrs[i];
+        int j = i - 1;
+        while (j >= 0 && addr_before(&key, &cache.addrs[j])) {
+            cache.addrs[j + 1] = cache.addrs[j];
+            j--;
+        }
+        cache.addrs[j + 1] = key;
+    }
+}
+
+static bool make_addr(const char *text, uint16_t port, dns_addr_t *out) {
+    struct sockaddr_in *in4 = (struct sockaddr_in *)&out->addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&out->addr;
+
+    memset(out, 0, sizeof(*out));
+    if (inet_pton(AF_INET, text, &in4->sin_addr) == 1) {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(port);
+        out->addr_len = sizeof(*in4);
+        return true;
+    }
+    if (inet_pton(AF_INET6, text, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        out->addr_len = sizeof(*in6);
+        return true;
+    }
+    return false;
+}
+
+/* Offline stand-in for the system resolver: a comma separated list of
+ * literal addresses, e.g. IOT_GATEWAY_DNS_STUB=127.0.0.1,::1 */
+static int resolve_stub(const char *list, uint16_t port, dns_addr_t *out, int max) {
+    char buf[256];
+    char *save = NULL;
+    int count = 0;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok_r(buf, ", ", &save); tok != NULL && count < max;
+         tok = strtok_r(NULL, ", ", &save)) {
+        if (make_addr(tok, port, &out[count])) {
+            count++;
+        } else {
+            net_log("DNS Ignoring invalid stub address '%s'\n", tok);
+        }
+    }
+    return count;
+}
+
+static int resolve_system(const char *host, uint16_t port, dns_addr_t *out, int max) {
+    struct addrinfo hints, *res, *ai;
+    int count = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    int ret = getaddrinfo(host, NULL, &hints, &res);
+    if (ret != 0) {
+        net_log("DNS Failed to resolve %s: %s\n", host, gai_strerror(ret));
+        return 0;
+    }
+    for (ai = res; ai != NULL && count < max; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(out[count].addr)) {
+            continue;
+        }
+        memset(&out[count], 0, sizeof(out[count]));
+        memcpy(&out[count].addr, ai->ai_addr, ai->ai_addrlen);
+        out[count].addr_len = ai->ai_addrlen;
+        if (ai->ai_family == AF_INET) {
+            ((struct sockaddr_in *)&out[count].addr)->sin_port = htons(port);
+        } else if (ai->ai_family == AF_INET6) {
+            ((struct sockaddr_in6 *)&out[count].addr)->sin6_port = htons(port);
+        } else {
+            continue;
+        }
+        count++;
+    }
+    freeaddrinfo(res);
+    return count;
+}
+
+/* Called with the lock held. Latency history carries over for addresses
+ * that are still in the answer. */
+static void merge_results(dns_addr_t *fresh, int count) {
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < cache.count; j++) {
+            if (same_addr(&fresh[i], &cache.addrs[j])) {
+                fresh[i].connect_us = cache.addrs[j].connect_us;
+                fresh[i].failures = cache.addrs[j].failures;
+                break;
+            }
+        }
+    }
+    memcpy(cache.addrs, fresh, count * sizeof(fresh[0]));
+    cache.count = count;
+    sort_addrs();
+}
+
+static void *resolver_thread(void *arg) {
+    (void)arg;
+    dns_addr_t fresh[DNS_CACHE_MAX_ADDRS];
+
+    pthread_mutex_lock(&cache.lock);
+    while (cache.running) {
+        if (!cache.refresh_requested && get_time_us() < cache.next_refresh_us) {
+            struct timespec ts;
+            deadline_to_timespec(cache.next_refresh_us, &ts);
+            pthread_cond_timedwait(&cache.wake, &cache.lock, &ts);
+            continue;
+        }
+        cache.refresh_requested = false;
+        cache.resolving = true;
+        pthread_mutex_unlock(&cache.lock);
+
+        uint64_t start_us = get_time_us();
+        int count = cache.stub != NULL ?
+                    resolve_stub(cache.stub, cache.port, fresh, DNS_CACHE_MAX_ADDRS) :
+                    resolve_system(cache.host, cache.port, fresh, DNS_CACHE_MAX_ADDRS);
+        uint64_t now_us = get_time_us();
+
+        pthread_mutex_lock(&cache.lock);
+        cache.resolving = false;
+        if (count > 0) {
+            merge_results(fresh, count);
+            cache.expires_us = now_us + DNS_CACHE_TTL_SEC * 1000000ULL;
+            cache.next_refresh_us = now_us + DNS_CACHE_TTL_SEC * 800000ULL;
+            net_log("DNS Resolved %s to %d address(es) in %u ms%s\n", cache.host, count,
+                    (unsigned int)((now_us - start_us) / 1000), cache.stub != NULL ? " (stub)" : "");
+        } else {
+            cache.next_refresh_us = now_us + DNS_CACHE_RETRY_SEC * 1000000ULL;
+            if (cache.count > 0) {
+                net_log("DNS Refresh failed, keeping %d cached address(es)\n", cache.count);
+            }
+        }
+        cache.generation++;
+        pthread_cond_broadcast(&cache.updated);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return NULL;
+}
+
+int dns_cache_init(const char *host, uint16_t port) {
+    pthread_condattr_t attr;
+
+    snprintf(cache.host, sizeof(cache.host), "%s", host);
+    cache.port = port;
+    cache.count = 0;
+    cache.expires_us = 0;
+    cache.next_refresh_us = 0;
+    cache.refresh_requested = true;
+    cache.resolving = false;
+    cache.stub = getenv(DNS_STUB_ENV);
+    if (cache.stub != NULL && cache.stub[0] == '\0') {
+        cache.stub = NULL;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cache.wake, &attr);
+    pthread_cond_init(&cache.updated, &attr);
+    pthread_condattr_destroy(&attr);
+
+    cache.running = true;
+    if (pthread_create(&cache.thread, NULL, resolver_thread, NULL) != 0) {
+        net_log("DNS Failed to start resolver thread\n");
+        cache.running = false;
+        return -1;
+    }
+    return 0;
+}
+
+void dns_cache_shutdown(void) {
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.running) {
+        pthread_mutex_unlock(&cache.lock);
+        return;
+    }
+    cache.running = false;
+    pthread_cond_signal(&cache.wake);
+    pthread_mutex_unlock(&cache.lock);
+    pthread_join(cache.thread, NULL);
+}
+
+/* Copies the ordered address list. Stale entries are still returned; only
+ * an empty cache waits, up to timeout_ms, for the resolver to answer. A
+ * refresh is kicked off only once the resolver's own schedule is due, so
+ * callers polling through an outage still retry once per
+ * DNS_CACHE_RETRY_SEC. */
+int dns_cache_get(dns_addr_t *addrs, int max, uint32_t timeout_ms) {
+    uint64_t deadline_us = get_time_us() + timeout_ms * 1000ULL;
+    struct timespec ts;
+    int count;
+
+    pthread_mutex_lock(&cache.lock);
+    if ((cache.count == 0 || get_time_us() >= cache.expires_us) &&
+        !cache.refresh_requested && !cache.resolving && get_time_us() >= cache.next_refresh_us) {
+        cache.refresh_requested = true;
+        pthread_cond_signal(&cache.wake);
+    }
+    uint32_t generation = cache.generation;
+    deadline_to_timespec(deadline_us, &ts);
+    while (cache.count == 0 && cache.running && cache.generation == generation) {
+        if (pthread_cond_timedwait(&cache.updated, &cache.lock, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    count = cache.count < max ? cache.count : max;
+    memcpy(addrs, cache.addrs, count * sizeof(addrs[0]));
+    pthread_mutex_unlock(&cache.lock);
+    return count;
+}
+
+void dns_cache_refresh(void) {
+    pthread_mutex_lock(&cache.lock);
+    cache.refresh_requested = true;
+    pthread_cond_signal(&cache.wake);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void dns_cache_report(const dns_addr_t *addr, uint32_t connect_us, bool ok) {
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < cache.count; i++) {
+        dns_addr_t *entry = &cache.addrs[i];
+        if (!same_addr(entry, addr)) {
+            continue;
+        }
+        if (ok) {
+            if (connect_us == 0) {
+                connect_us = 1;
+            }
+            entry->connect_us = entry->connect_us == 0 ? connect_us :
+                                (3 * entry->connect_us + connect_us) / 4;
+            entry->failures = 0;
+        } else if (entry->failures < UINT16_MAX) {
+            entry->failures++;
+        }
+        sort_addrs();
+        break;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+const char *dns_addr_str(const dns_addr_t *addr, char *buf, size_t len) {
+    char host[INET6_ADDRSTRLEN];
+
+    if (addr->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&addr->addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(buf, len, "[%s]:%u", host, ntohs(in6->sin6_port));
+    } else {
+        const struct sockaddr_in *in4 = (const struct sockaddr_in *)&addr->addr;
+        inet_ntop(AF_INET, &in4->sin_addr, host, sizeof(host));
+        snprintf(buf, len, "%s:%u", host, ntohs(in4->sin_port));
+    }
+    return buf;
+}
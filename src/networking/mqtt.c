@@ -0,0 +1,1048 @@
+#include <string.h>
+#include <stddef.h>
+#include "mqtt.h"
+
+#define RING_MASK   (MQTT_RX_RING_SIZE - 1)
+
+#if (MQTT_RX_RING_SIZE & RING_MASK) != 0
+#error "MQTT_RX_RING_SIZE must be a power of two"
+#endif
+
+void mqtt_rx_init(mqtt_rx_ring_t *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->discard = 0;
+    ring->oversized = 0;
+}
+
+uint8_t *mqtt_rx_write_ptr(mqtt_rx_ring_t *ring, size_t *avail) {
+    if (ring->head == ring->tail) {
+        ring->head = 0;
+        ring->tail = 0;
+    }
+    uint32_t used = ring->head - ring->tail;
+    uint32_t offset = ring->head & RING_MASK;
+    uint32_t contiguous = MQTT_RX_RING_SIZE - offset;
+    uint32_t free_space = MQTT_RX_RING_SIZE - used;
+    *avail = contiguous < free_space ? contiguous : free_space;
+    return &ring->buf[offset];
+}
+
+void mqtt_rx_commit(mqtt_rx_ring_t *ring, size_t len) {
+    ring->head += (uint32_t)len;
+}
+
+int mqtt_decode_length(const uint8_t *buf, size_t avail, uint32_t *length) {
+    uint32_t value = 0;
+    uint32_t multiplier = 1;
+    for (size_t i = 0; i < MQTT_MAX_LENGTH_BYTES; i++) {
+        if (i >= avail) {
+            return 0;
+        }
+        value += (buf[i] & 0x7F) * multiplier;
+        if ((buf[i] & 0x80) == 0) {
+            *length = value;
+            return (int)i + 1;
+        }
+        multiplier *= 128;
+    }
+    return -1;
+}
+
+int mqtt_rx_next(mqtt_rx_ring_t *ring, mqtt_packet_view_t *view) {
+    for (;;) {
+        uint32_t used = ring->head - ring->tail;
+        uint8_t header[1 + MQTT_MAX_LENGTH_BYTES];
+
+        if (ring->discard > 0) {
+            uint32_t skip = used < ring->discard ? used : ring->discard;
+            ring->tail += skip;
+            ring->discard -= skip;
+            used -= skip;
+            if (ring->discard > 0) {
+                return 0;
+            }
+        }
+        if (used < 2) {
+            return 0;
+        }
+        size_t header_avail = used < sizeof(header) ? used : sizeof(header);
+        for (size_t i = 0; i < header_avail; i++) {
+            header[i] = ring->buf[(ring->tail + i) & RING_MASK];
+        }
+
+        uint32_t body_len;
+        int len_bytes = mqtt_decode_length(header + 1, header_avail - 1, &body_len);
+        if (len_bytes <= 0) {
+            return len_bytes;
+        }
+
+        uint32_t header_len = 1 + (uint32_t)len_bytes;
+        if (header_len + body_len > MQTT_RX_RING_SIZE) {
+            ring->discard = header_len + body_len;
+            ring->oversized++;
+            continue;
+        }
+        if (used < header_len + body_len) {
+            return 0;
+        }
+
+        uint32_t body_start = (ring->tail + header_len) & RING_MASK;
+        view->type = header[0] & 0xF0;
+        view->flags = header[0] & 0x0F;
+        view->body_len = body_len;
+        if (body_start + body_len <= MQTT_RX_RING_SIZE) {
+            view->body = &ring->buf[body_start];
+        } else {
+            uint32_t first = MQTT_RX_RING_SIZE - body_start;
+            memcpy(ring->linear, &ring->buf[body_start], first);
+            memcpy(ring->linear + first, ring->buf, body_len - first);
+            view->body = ring->linear;
+        }
+
+        ring->tail += header_len + body_len;
+        return 1;
+    }
+}
+
+/* Flat-buffer counterpart of mqtt_rx_next(): returns the total packet size,
+ * 0 if more bytes are needed, or -1 if the fixed header is malformed. */
+int mqtt_decode_packet(const uint8_t *buf, size_t avail, mqtt_packet_view_t *view) {
+    uint32_t body_len;
+    if (avail < 2) {
+        return 0;
+    }
+    int len_bytes = mqtt_decode_length(buf + 1, avail - 1, &body_len);
+    if (len_bytes <= 0) {
+        return len_bytes;
+    }
+    size_t total = 1 + (size_t)len_bytes + body_len;
+    if (avail < total) {
+        return 0;
+    }
+    view->type = buf[0] & 0xF0;
+    view->flags = buf[0] & 0x0F;
+    view->body = buf + 1 + len_bytes;
+    view->body_len = body_len;
+    return (int)total;
+}
+
+typedef struct {
+    uint8_t *pos;
+    uint8_t *end;
+} mqtt_writer_t;
+
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool error;
+} mqtt_reader_t;
+
+static void put_u8(mqtt_writer_t *w, uint8_t value) {
+    *w->pos++ = value;
+}
+
+static void put_u16(mqtt_writer_t *w, uint16_t value) {
+    *w->pos++ = (uint8_t)(value >> 8);
+    *w->pos++ = (uint8_t)value;
+}
+
+static void put_u32(mqtt_writer_t *w, uint32_t value) {
+    put_u16(w, (uint16_t)(value >> 16));
+    put_u16(w, (uint16_t)value);
+}
+
+static void put_bytes(mqtt_writer_t *w, const void *data, size_t len) {
+    if (len > 0) {
+        memcpy(w->pos, data, len);
+        w->pos += len;
+    }
+}
+
+static void put_str(mqtt_writer_t *w, const mqtt_str_t *str) {
+    put_u16(w, str->len);
+    put_bytes(w, str->data, str->len);
+}
+
+/* Writes the fixed header after checking that the whole packet fits, so
+ * the put_* helpers never need their own bounds checks. */
+static int put_fixed_header(mqtt_writer_t *w, uint8_t first, uint32_t remaining, size_t body_in_buf) {
+    uint8_t len_buf[MQTT_MAX_LENGTH_BYTES];
+    int len_bytes = mqtt_encode_length(len_buf, sizeof(len_buf), remaining);
+    if (len_bytes < 0 || (size_t)(w->end - w->pos) < 1 + (size_t)len_bytes + body_in_buf) {
+        return -1;
+    }
+    put_u8(w, first);
+    put_bytes(w, len_buf, len_bytes);
+    return 1 + len_bytes;
+}
+
+static void put_varint(mqtt_writer_t *w, uint32_t value) {
+    w->pos += mqtt_encode_length(w->pos, (size_t)(w->end - w->pos), value);
+}
+
+static uint8_t get_u8(mqtt_reader_t *r) {
+    if (r->end - r->pos < 1) {
+        r->error = true;
+        return 0;
+    }
+    return *r->pos++;
+}
+
+static uint16_t get_u16(mqtt_reader_t *r) {
+    if (r->end - r->pos < 2) {
+        r->error = true;
+        r->pos = r->end;
+        return 0;
+    }
+    uint16_t value = (uint16_t)((r->pos[0] << 8) | r->pos[1]);
+    r->pos += 2;
+    return value;
+}
+
+static uint32_t get_u32(mqtt_reader_t *r) {
+    uint32_t high = get_u16(r);
+    return (high << 16) | get_u16(r);
+}
+
+static uint32_t get_varint(mqtt_reader_t *r) {
+    uint32_t value = 0;
+    int len = mqtt_decode_length(r->pos, (size_t)(r->end - r->pos), &value);
+    if (len <= 0) {
+        r->error = true;
+        r->pos = r->end;
+        return 0;
+    }
+    r->pos += len;
+    return value;
+}
+
+static void get_str(mqtt_reader_t *r, mqtt_str_t *str) {
+    str->len = get_u16(r);
+    if (r->error || (size_t)(r->end - r->pos) < str->len) {
+        r->error = true;
+        str->data = NULL;
+        str->len = 0;
+        return;
+    }
+    str->data = r->pos;
+    r->pos += str->len;
+}
+
+static void reader_init(mqtt_reader_t *r, const mqtt_packet_view_t *view) {
+    r->pos = view->body;
+    r->end = view->body + view->body_len;
+    r->error = false;
+}
+
+static int reader_done(const mqtt_reader_t *r) {
+    return r->error || r->pos != r->end ? -1 : 0;
+}
+
+static bool is_ack_type(uint8_t type) {
+    return type == MQTT_PUBACK || type == MQTT_PUBREC || type == MQTT_PUBREL ||
+           type == MQTT_PUBCOMP || type == MQTT_UNSUBACK;
+}
+
+static uint32_t varint_size(uint32_t value) {
+    return value < 128 ? 1 : value < 16384 ? 2 : value < 2097152 ? 3 : 4;
+}
+
+typedef enum {
+    PROP_NONE,
+    PROP_BYTE,
+    PROP_U16,
+    PROP_U32,
+    PROP_VARINT,
+    PROP_STR,
+    PROP_PAIR
+} prop_kind_t;
+
+/* Indexed by property id and listing every MQTT 5 property, so the ones
+ * mqtt_properties_t does not store (flag 0) can still be skipped. */
+typedef struct {
+    prop_kind_t kind;
+    uint32_t flag;
+    size_t offset;
+} prop_desc_t;
+
+#define PROP_ID_LIMIT   (MQTT_PROP_SHARED_SUB_AVAIL + 1)
+#define STORED(kind, flag, field) { kind, flag, offsetof(mqtt_properties_t, field) }
+
+static const prop_desc_t prop_table[PROP_ID_LIMIT] = {
+    [MQTT_PROP_PAYLOAD_FORMAT] = STORED(PROP_BYTE, MQTT_HAS_PAYLOAD_FORMAT, payload_format),
+    [MQTT_PROP_MESSAGE_EXPIRY] = STORED(PROP_U32, MQTT_HAS_MESSAGE_EXPIRY, message_expiry),
+    [MQTT_PROP_CONTENT_TYPE] = STORED(PROP_STR, MQTT_HAS_CONTENT_TYPE, content_type),
+    [MQTT_PROP_RESPONSE_TOPIC] = { PROP_STR, 0, 0 },
+    [MQTT_PROP_CORRELATION_DATA] = { PROP_STR, 0, 0 },
+    [MQTT_PROP_SUBSCRIPTION_ID] = { PROP_VARINT, 0, 0 },
+    [MQTT_PROP_SESSION_EXPIRY] = STORED(PROP_U32, MQTT_HAS_SESSION_EXPIRY, session_expiry),
+    [MQTT_PROP_ASSIGNED_CLIENT_ID] = STORED(PROP_STR, MQTT_HAS_ASSIGNED_CLIENT_ID, assigned_client_id),
+    [MQTT_PROP_SERVER_KEEPALIVE] = STORED(PROP_U16, MQTT_HAS_SERVER_KEEPALIVE, server_keepalive),
+    [MQTT_PROP_AUTH_METHOD] = { PROP_STR, 0, 0 },
+    [MQTT_PROP_AUTH_DATA] = { PROP_STR, 0, 0 },
+    [MQTT_PROP_REQUEST_PROBLEM_INFO] = { PROP_BYTE, 0, 0 },
+    [MQTT_PROP_WILL_DELAY] = { PROP_U32, 0, 0 },
+    [MQTT_PROP_REQUEST_RESPONSE_INFO] = { PROP_BYTE, 0, 0 },
+    [MQTT_PROP_RESPONSE_INFO] = { PROP_STR, 0, 0 },
+    [MQTT_PROP_SERVER_REFERENCE] = { PROP_STR, 0, 0 },
+    [MQTT_PROP_REASON_STRING] = STORED(PROP_STR, MQTT_HAS_REASON_STRING, reason_string),
+    [MQTT_PROP_RECEIVE_MAXIMUM] = STORED(PROP_U16, MQTT_HAS_RECEIVE_MAXIMUM, receive_maximum),
+    [MQTT_PROP_TOPIC_ALIAS_MAXIMUM] = STORED(PROP_U16, MQTT_HAS_TOPIC_ALIAS_MAXIMUM, topic_alias_maximum),
+    [MQTT_PROP_TOPIC_ALIAS] = STORED(PROP_U16, MQTT_HAS_TOPIC_ALIAS, topic_alias),
+    [MQTT_PROP_MAXIMUM_QOS] = STORED(PROP_BYTE, MQTT_HAS_MAXIMUM_QOS, maximum_qos),
+    [MQTT_PROP_RETAIN_AVAILABLE] = STORED(PROP_BYTE, MQTT_HAS_RETAIN_AVAILABLE, retain_available),
+    [MQTT_PROP_USER_PROPERTY] = { PROP_PAIR, 0, 0 },
+    [MQTT_PROP_MAXIMUM_PACKET_SIZE] = STORED(PROP_U32, MQTT_HAS_MAXIMUM_PACKET_SIZE, maximum_packet_size),
+    [MQTT_PROP_WILDCARD_SUB_AVAIL] = { PROP_BYTE, 0, 0 },
+    [MQTT_PROP_SUB_ID_AVAIL] = { PROP_BYTE, 0, 0 },
+    [MQTT_PROP_SHARED_SUB_AVAIL] = { PROP_BYTE, 0, 0 },
+};
+
+/* Property id for each MQTT_HAS_* bit, in bit order. */
+static const uint8_t flag_prop[] = {
+    MQTT_PROP_PAYLOAD_FORMAT,
+    MQTT_PROP_MESSAGE_EXPIRY,
+    MQTT_PROP_CONTENT_TYPE,
+    MQTT_PROP_SESSION_EXPIRY,
+    MQTT_PROP_ASSIGNED_CLIENT_ID,
+    MQTT_PROP_SERVER_KEEPALIVE,
+    MQTT_PROP_REASON_STRING,
+    MQTT_PROP_RECEIVE_MAXIMUM,
+    MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+    MQTT_PROP_TOPIC_ALIAS,
+    MQTT_PROP_MAXIMUM_QOS,
+    MQTT_PROP_RETAIN_AVAILABLE,
+    MQTT_PROP_MAXIMUM_PACKET_SIZE
+};
+
+#define FLAG_COUNT  (sizeof(flag_prop) / sizeof(flag_prop[0]))
+
+static const prop_desc_t *find_prop(uint8_t id) {
+    if (id >= PROP_ID_LIMIT || prop_table[id].kind == PROP_NONE) {
+        return NULL;
+    }
+    return &prop_table[id];
+}
+
+/* Length of the property block body, without its length prefix. */
+static uint64_t properties_body_size(const mqtt_properties_t *props) {
+    uint64_t size = 0;
+    if (props == NULL) {
+        return 0;
+    }
+    for (size_t bit = 0; bit < FLAG_COUNT; bit++) {
+        if ((props->present & (1u << bit)) == 0) {
+            continue;
+        }
+        const prop_desc_t *desc = &prop_table[flag_prop[bit]];
+        const uint8_t *field = (const uint8_t *)props + desc->offset;
+        switch (desc->kind) {
+            case PROP_BYTE:
+                size += 2;
+                break;
+            case PROP_U16:
+                size += 3;
+                break;
+            case PROP_U32:
+                size += 5;
+                break;
+            default:
+                size += 3 + (uint64_t)((const mqtt_str_t *)field)->len;
+                break;
+        }
+    }
+    for (size_t i = 0; i < props->user_property_count; i++) {
+        size += 5 + (uint64_t)props->user_properties[i].key.len + props->user_properties[i].value.len;
+    }
+    return size;
+}
+
+/* Full encoded size of the block including its length prefix, or 0 if it
+ * does not fit in a variable byte integer. */
+static uint32_t properties_size(const mqtt_properties_t *props, uint32_t *body) {
+    uint64_t size = properties_body_size(props);
+    if (size > MQTT_MAX_REMAINING_LEN) {
+        return 0;
+    }
+    *body = (uint32_t)size;
+    return varint_size(*body) + *body;
+}
+
+static void put_properties(mqtt_writer_t *w, const mqtt_properties_t *props, uint32_t body) {
+    put_varint(w, body);
+    if (props == NULL) {
+        return;
+    }
+    for (size_t bit = 0; bit < FLAG_COUNT; bit++) {
+        if ((props->present & (1u << bit)) == 0) {
+            continue;
+        }
+        const prop_desc_t *desc = &prop_table[flag_prop[bit]];
+        const uint8_t *field = (const uint8_t *)props + desc->offset;
+        put_u8(w, flag_prop[bit]);
+        switch (desc->kind) {
+            case PROP_BYTE:
+                put_u8(w, *field);
+                break;
+            case PROP_U16:
+                put_u16(w, *(const uint16_t *)field);
+                break;
+            case PROP_U32:
+                put_u32(w, *(const uint32_t *)field);
+                break;
+            default:
+                put_str(w, (const mqtt_str_t *)field);
+                break;
+        }
+    }
+    for (size_t i = 0; i < props->user_property_count; i++) {
+        put_u8(w, MQTT_PROP_USER_PROPERTY);
+        put_str(w, &props->user_properties[i].key);
+        put_str(w, &props->user_properties[i].value);
+    }
+}
+
+/* Reads a property block. props may be NULL to validate and skip it. A
+ * property other than a user property may appear at most once. */
+static void get_properties(mqtt_reader_t *r, mqtt_properties_t *props) {
+    mqtt_properties_t scratch;
+    uint32_t len = get_varint(r);
+
+    if (props == NULL) {
+        props = &scratch;
+    }
+    memset(props, 0, sizeof(*props));
+    if (r->error || (size_t)(r->end - r->pos) < len) {
+        r->error = true;
+        return;
+    }
+    const uint8_t *end = r->pos + len;
+    const uint8_t *outer_end = r->end;
+    r->end = end;
+    while (!r->error && r->pos < end) {
+        const prop_desc_t *desc = find_prop(get_u8(r));
+        if (desc == NULL || (desc->flag != 0 && (props->present & desc->flag) != 0)) {
+            r->error = true;
+            break;
+        }
+        uint8_t *field = (uint8_t *)props + desc->offset;
+        mqtt_str_t str;
+        switch (desc->kind) {
+            case PROP_BYTE: {
+                uint8_t value = get_u8(r);
+                if (desc->flag != 0) {
+                    *field = value;
+                }
+                break;
+            }
+            case PROP_U16: {
+                uint16_t value = get_u16(r);
+                if (desc->flag != 0) {
+                    *(uint16_t *)field = value;
+                }
+                break;
+            }
+            case PROP_U32: {
+                uint32_t value = get_u32(r);
+                if (desc->flag != 0) {
+                    *(uint32_t *)field = value;
+                }
+                break;
+            }
+            case PROP_VARINT:
+                get_varint(r);
+                break;
+            case PROP_NONE:
+                break;
+            case PROP_STR:
+                get_str(r, &str);
+                if (desc->flag != 0) {
+                    *(mqtt_str_t *)field = str;
+                }
+                break;
+            case PROP_PAIR:
+                get_str(r, &str);
+                get_str(r, &str);
+                props->user_property_count++;
+                break;
+        }
+        props->present |= desc->flag;
+    }
+    r->end = outer_end;
+}
+
+int mqtt_encode_length(uint8_t *buf, size_t size, uint32_t length) {
+    size_t n = 0;
+    if (length > MQTT_MAX_REMAINING_LEN) {
+        return -1;
+    }
+    do {
+        if (n >= size) {
+            return -1;
+        }
+        uint8_t byte = length % 128;
+        length /= 128;
+        buf[n++] = length > 0 ? (byte | 0x80) : byte;
+    } while (length > 0);
+    return (int)n;
+}
+
+int mqtt_encode_connect(uint8_t *buf, size_t size, const mqtt_connect_t *connect) {
+    mqtt_writer_t w = { buf, buf + size };
+    uint8_t level = connect->protocol_level ? connect->protocol_level : MQTT_PROTOCOL_LEVEL;
+    uint32_t remaining = 10 + 2 + connect->client_id.len;
+    uint32_t props_body = 0;
+    uint8_t flags = connect->clean_session ? 0x02 : 0x00;
+
+    if (level != MQTT_PROTOCOL_LEVEL && level != MQTT_PROTOCOL_LEVEL_5) {
+        return -1;
+    }
+    if (connect->has_password && !connect->has_username) {
+        return -1;
+    }
+    if (level == MQTT_PROTOCOL_LEVEL_5) {
+        uint32_t props_len = properties_size(connect->properties, &props_body);
+        if (props_len == 0 || props_len > 65535) {
+            return -1;
+        }
+        remaining += props_len + (connect->has_will ? 1 : 0);
+    }
+    if (connect->has_will) {
+        if (connect->will_qos > MQTT_QOS2) {
+            return -1;
+        }
+        remaining += 2 + connect->will_topic.len + 2 + connect->will_payload.len;
+        flags |= 0x04 | (uint8_t)(connect->will_qos << 3) | (connect->will_retain ? 0x20 : 0x00);
+    }
+    if (connect->has_username) {
+        remaining += 2 + connect->username.len;
+        flags |= 0x80;
+    }
+    if (connect->has_password) {
+        remaining += 2 + connect->password.len;
+        flags |= 0x40;
+    }
+    if (put_fixed_header(&w, MQTT_CONNECT, remaining, remaining) < 0) {
+        return -1;
+    }
+    put_u16(&w, 4);
+    put_bytes(&w, "MQTT", 4);
+    put_u8(&w, level);
+    put_u8(&w, flags);
+    put_u16(&w, connect->keepalive_sec);
+    if (level == MQTT_PROTOCOL_LEVEL_5) {
+        put_properties(&w, connect->properties, props_body);
+    }
+    put_str(&w, &connect->client_id);
+    if (connect->has_will) {
+        if (level == MQTT_PROTOCOL_LEVEL_5) {
+            put_varint(&w, 0);
+        }
+        put_str(&w, &connect->will_topic);
+        put_str(&w, &connect->will_payload);
+    }
+    if (connect->has_username) {
+        put_str(&w, &connect->username);
+    }
+    if (connect->has_password) {
+        put_str(&w, &connect->password);
+    }
+    return (int)(w.pos - buf);
+}
+
+int mqtt_encode_connack(uint8_t *buf, size_t size, bool session_present, uint8_t return_code) {
+    mqtt_writer_t w = { buf, buf + size };
+    if (put_fixed_header(&w, MQTT_CONNACK, 2, 2) < 0) {
+        return -1;
+    }
+    put_u8(&w, session_present ? 0x01 : 0x00);
+    put_u8(&w, return_code);
+    return 4;
+}
+
+int mqtt_encode_connack_v5(uint8_t *buf, size_t size, bool session_present, uint8_t reason_code,
+                           const mqtt_properties_t *properties) {
+    mqtt_writer_t w = { buf, buf + size };
+    uint32_t props_body;
+    uint32_t props_len = properties_size(properties, &props_body);
+    if (props_len == 0 || props_len > MQTT_MAX_REMAINING_LEN - 2 ||
+        put_fixed_header(&w, MQTT_CONNACK, 2 + props_len, 2 + props_len) < 0) {
+        return -1;
+    }
+    put_u8(&w, session_present ? 0x01 : 0x00);
+    put_u8(&w, reason_code);
+    put_properties(&w, properties, props_body);
+    return (int)(w.pos - buf);
+}
+
+static bool publish_valid(const mqtt_publish_t *publish, uint32_t *remaining, uint32_t *props_body) {
+    uint64_t total = 2 + (uint64_t)publish->topic.len + publish->payload_len;
+    if (publish->qos > MQTT_QOS2) {
+        return false;
+    }
+    if (publish->topic.len == 0 &&
+        (publish->properties == NULL || (publish->properties->present & MQTT_HAS_TOPIC_ALIAS) == 0)) {
+        return false;
+    }
+    if (publish->properties != NULL) {
+        uint32_t props_len = properties_size(publish->properties, props_body);
+        if (props_len == 0) {
+            return false;
+        }
+        total += props_len;
+    }
+    if (publish->qos == MQTT_QOS0 && publish->dup) {
+        return false;
+    }
+    if (publish->qos > MQTT_QOS0) {
+        if (publish->packet_id == 0) {
+            return false;
+        }
+        total += 2;
+    }
+    if (total > MQTT_MAX_REMAINING_LEN) {
+        return false;
+    }
+    *remaining = (uint32_t)total;
+    return true;
+}
+
+static int put_publish_header(mqtt_writer_t *w, const mqtt_publish_t *publish, size_t payload_in_buf) {
+    uint32_t remaining;
+    uint32_t props_body = 0;
+    if (!publish_valid(publish, &remaining, &props_body)) {
+        return -1;
+    }
+    uint8_t first = MQTT_PUBLISH | (uint8_t)(publish->qos << 1) |
+                    (publish->dup ? MQTT_PUBLISH_DUP : 0) |
+                    (publish->retain ? MQTT_PUBLISH_RETAIN : 0);
+    size_t in_buf = remaining - publish->payload_len + payload_in_buf;
+    if (put_fixed_header(w, first, remaining, in_buf) < 0) {
+        return -1;
+    }
+    put_str(w, &publish->topic);
+    if (publish->qos > MQTT_QOS0) {
+        put_u16(w, publish->packet_id);
+    }
+    if (publish->properties != NULL) {
+        put_properties(w, publish->properties, props_body);
+    }
+    return 0;
+}
+
+int mqtt_encode_publish(uint8_t *buf, size_t size, const mqtt_publish_t *publish) {
+    mqtt_writer_t w = { buf, buf + size };
+    if (put_publish_header(&w, publish, publish->payload_len) < 0) {
+        return -1;
+    }
+    put_bytes(&w, publish->payload, publish->payload_len);
+    return (int)(w.pos - buf);
+}
+
+/* Everything up to the payload: fixed header, topic and packet id. */
+int mqtt_encode_publish_header(uint8_t *buf, size_t size, const mqtt_publish_t *publish) {
+    mqtt_writer_t w = { buf, buf + size };
+    if (put_publish_header(&w, publish, 0) < 0) {
+        return -1;
+    }
+    return (int)(w.pos - buf);
+}
+
+/* Encodes the header into `header` and returns a two-element gather list
+ * that sends the payload from the caller's buffer without copying it. */
+int mqtt_publish_iov(uint8_t *header, size_t size, const mqtt_publish_t *publish, mqtt_iovec_t iov[2]) {
+    int len = mqtt_encode_publish_header(header, size, publish);
+    if (len < 0) {
+        return -1;
+    }
+    iov[0].base = header;
+    iov[0].len = (size_t)len;
+    iov[1].base = publish->payload;
+    iov[1].len = publish->payload_len;
+    return publish->payload_len > 0 ? 2 : 1;
+}
+
+int mqtt_encode_ack(uint8_t *buf, size_t size, uint8_t type, uint16_t packet_id) {
+    mqtt_writer_t w = { buf, buf + size };
+    if (!is_ack_type(type) || put_fixed_header(&w, type | (type == MQTT_PUBREL ? 0x02 : 0x00), 2, 2) < 0) {
+        return -1;
+    }
+    put_u16(&w, packet_id);
+    return 4;
+}
+
+/* A success code is sent in the short two byte form. */
+int mqtt_encode_ack_v5(uint8_t *buf, size_t size, uint8_t type, uint16_t packet_id, uint8_t reason_code) {
+    mqtt_writer_t w = { buf, buf + size };
+    uint32_t remaining = reason_code == MQTT_RC_SUCCESS ? 2 : 3;
+    if (!is_ack_type(type) || type == MQTT_UNSUBACK ||
+        put_fixed_header(&w, type | (type == MQTT_PUBREL ? 0x02 : 0x00), remaining, remaining) < 0) {
+        return -1;
+    }
+    put_u16(&w, packet_id);
+    if (remaining == 3) {
+        put_u8(&w, reason_code);
+    }
+    return (int)(w.pos - buf);
+}
+
+int mqtt_encode_disconnect_v5(uint8_t *buf, size_t size, uint8_t reason_code) {
+    mqtt_writer_t w = { buf, buf + size };
+    uint32_t remaining = reason_code == MQTT_RC_SUCCESS ? 0 : 1;
+    if (put_fixed_header(&w, MQTT_DISCONNECT, remaining, remaining) < 0) {
+        return -1;
+    }
+    if (remaining == 1) {
+        put_u8(&w, reason_code);
+    }
+    return (int)(w.pos - buf);
+}
+
+static int encode_subscribe(uint8_t *buf, size_t size, uint16_t packet_id,
+                            const mqtt_subscription_t *subs, size_t count,
+                            const mqtt_properties_t *properties, bool v5) {
+    mqtt_writer_t w = { buf, buf + size };
+    uint64_t remaining = 2;
+    uint32_t props_body = 0;
+
+    if (count == 0 || packet_id == 0) {
+        return -1;
+    }
+    if (v5) {
+        uint32_t props_len = properties_size(properties, &props_body);
+        if (props_len == 0) {
+            return -1;
+        }
+        remaining += props_len;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (subs[i].qos > MQTT_QOS2 || subs[i].filter.len == 0) {
+            return -1;
+        }
+        remaining += 2 + (uint64_t)subs[i].filter.len + 1;
+    }
+    if (remaining > MQTT_MAX_REMAINING_LEN ||
+        put_fixed_header(&w, MQTT_SUBSCRIBE | 0x02, (uint32_t)remaining, (size_t)remaining) < 0) {
+        return -1;
+    }
+    put_u16(&w, packet_id);
+    if (v5) {
+        put_properties(&w, properties, props_body);
+    }
+    for (size_t i = 0; i < count; i++) {
+        put_str(&w, &subs[i].filter);
+        put_u8(&w, subs[i].qos);
+    }
+    return (int)(w.pos - buf);
+}
+
+int mqtt_encode_subscribe(uint8_t *buf, size_t size, uint16_t packet_id,
+                          const mqtt_subscription_t *subs, size_t count) {
+    return encode_subscribe(buf, size, packet_id, subs, count, NULL, false);
+}
+
+int mqtt_encode_subscribe_v5(uint8_t *buf, size_t size, uint16_t packet_id,
+                             const mqtt_subscription_t *subs, size_t count,
+                             const mqtt_properties_t *properties) {
+    return encode_subscribe(buf, size, packet_id, subs, count, properties, true);
+}
+
+int mqtt_encode_suback(uint8_t *buf, size_t size, uint16_t packet_id,
+                       const uint8_t *return_codes, size_t count) {
+    mqtt_writer_t w = { buf, buf + size };
+    if (count == 0 || count > MQTT_MAX_REMAINING_LEN - 2 ||
+        put_fixed_header(&w, MQTT_SUBACK, (uint32_t)(2 + count), 2 + count) < 0) {
+        return -1;
+    }
+    put_u16(&w, packet_id);
+    put_bytes(&w, return_codes, count);
+    return (int)(w.pos - buf);
+}
+
+int mqtt_encode_unsubscribe(uint8_t *buf, size_t size, uint16_t packet_id,
+                            const mqtt_str_t *filters, size_t count) {
+    mqtt_writer_t w = { buf, buf + size };
+    uint64_t remaining = 2;
+
+    if (count == 0 || packet_id == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (filters[i].len == 0) {
+            return -1;
+        }
+        remaining += 2 + (uint64_t)filters[i].len;
+    }
+    if (remaining > MQTT_MAX_REMAINING_LEN ||
+        put_fixed_header(&w, MQTT_UNSUBSCRIBE | 0x02, (uint32_t)remaining, (size_t)remaining) < 0) {
+        return -1;
+    }
+    put_u16(&w, packet_id);
+    for (size_t i = 0; i < count; i++) {
+        put_str(&w, &filters[i]);
+    }
+    return (int)(w.pos - buf);
+}
+
+/* PINGREQ, PINGRESP and DISCONNECT: a fixed header with no body. */
+int mqtt_encode_empty(uint8_t *buf, size_t size, uint8_t type) {
+    if ((type != MQTT_PINGREQ && type != MQTT_PINGRESP && type != MQTT_DISCONNECT) || size < 2) {
+        return -1;
+    }
+    buf[0] = type;
+    buf[1] = 0x00;
+    return 2;
+}
+
+int mqtt_decode_connect(const mqtt_packet_view_t *view, mqtt_connect_t *connect) {
+    mqtt_reader_t r;
+    mqtt_str_t protocol;
+
+    if (view->type != MQTT_CONNECT || view->flags != 0) {
+        return -1;
+    }
+    reader_init(&r, view);
+    get_str(&r, &protocol);
+    uint8_t level = get_u8(&r);
+    uint8_t flags = get_u8(&r);
+    if (r.error || protocol.len != 4 || memcmp(protocol.data, "MQTT", 4) != 0 ||
+        (level != MQTT_PROTOCOL_LEVEL && level != MQTT_PROTOCOL_LEVEL_5) || (flags & 0x01) != 0) {
+        return -1;
+    }
+
+    memset(connect, 0, sizeof(*connect));
+    connect->protocol_level = level;
+    connect->clean_session = (flags & 0x02) != 0;
+    connect->has_will = (flags & 0x04) != 0;
+    connect->will_qos = (flags >> 3) & 0x03;
+    connect->will_retain = (flags & 0x20) != 0;
+    connect->has_password = (flags & 0x40) != 0;
+    connect->has_username = (flags & 0x80) != 0;
+    if (connect->will_qos > MQTT_QOS2 ||
+        (!connect->has_will && (connect->will_qos != 0 || connect->will_retain)) ||
+        (connect->has_password && !connect->has_username)) {
+        return -1;
+    }
+
+    connect->keepalive_sec = get_u16(&r);
+    if (level == MQTT_PROTOCOL_LEVEL_5) {
+        get_properties(&r, NULL);
+    }
+    get_str(&r, &connect->client_id);
+    if (connect->has_will) {
+        if (level == MQTT_PROTOCOL_LEVEL_5) {
+            get_properties(&r, NULL);
+        }
+        get_str(&r, &connect->will_topic);
+        get_str(&r, &connect->will_payload);
+    }
+    if (connect->has_username) {
+        get_str(&r, &connect->username);
+    }
+    if (connect->has_password) {
+        get_str(&r, &connect->password);
+    }
+    return reader_done(&r);
+}
+
+int mqtt_decode_connack(const mqtt_packet_view_t *view, bool *session_present, uint8_t *return_code) {
+    if (view->type != MQTT_CONNACK || view->flags != 0 || view->body_len != 2 ||
+        (view->body[0] & 0xFE) != 0) {
+        return -1;
+    }
+    *session_present = (view->body[0] & 0x01) != 0;
+    *return_code = view->body[1];
+    return 0;
+}
+
+static int decode_publish(const mqtt_packet_view_t *view, mqtt_publish_t *publish,
+                          mqtt_properties_t *properties, bool v5) {
+    mqtt_reader_t r;
+
+    if (view->type != MQTT_PUBLISH) {
+        return -1;
+    }
+    publish->qos = (view->flags >> 1) & 0x03;
+    publish->dup = (view->flags & MQTT_PUBLISH_DUP) != 0;
+    publish->retain = (view->flags & MQTT_PUBLISH_RETAIN) != 0;
+    if (publish->qos > MQTT_QOS2 || (publish->qos == MQTT_QOS0 && publish->dup)) {
+        return -1;
+    }
+
+    reader_init(&r, view);
+    get_str(&r, &publish->topic);
+    publish->packet_id = publish->qos > MQTT_QOS0 ? get_u16(&r) : 0;
+    publish->properties = NULL;
+    if (v5) {
+        get_properties(&r, properties);
+        publish->properties = properties;
+    }
+    if (r.error || (publish->qos > MQTT_QOS0 && publish->packet_id == 0)) {
+        return -1;
+    }
+    if (publish->topic.len == 0 && (!v5 || (properties->present & MQTT_HAS_TOPIC_ALIAS) == 0)) {
+        return -1;
+    }
+    publish->payload = r.pos;
+    publish->payload_len = (uint32_t)(r.end - r.pos);
+    return 0;
+}
+
+int mqtt_decode_publish(const mqtt_packet_view_t *view, mqtt_publish_t *publish) {
+    return decode_publish(view, publish, NULL, false);
+}
+
+int mqtt_decode_publish_v5(const mqtt_packet_view_t *view, mqtt_publish_t *publish,
+                           mqtt_properties_t *properties) {
+    return decode_publish(view, publish, properties, true);
+}
+
+int mqtt_decode_ack(const mqtt_packet_view_t *view, uint16_t *packet_id) {
+    uint8_t expected_flags = view->type == MQTT_PUBREL ? 0x02 : 0x00;
+    if (!is_ack_type(view->type) || view->flags != expected_flags || view->body_len != 2) {
+        return -1;
+    }
+    *packet_id = (uint16_t)((view->body[0] << 8) | view->body[1]);
+    return 0;
+}
+
+int mqtt_decode_subscribe(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                          mqtt_subscription_t *subs, size_t max, size_t *count) {
+    mqtt_reader_t r;
+    size_t n = 0;
+
+    if (view->type != MQTT_SUBSCRIBE || view->flags != 0x02) {
+        return -1;
+    }
+    reader_init(&r, view);
+    *packet_id = get_u16(&r);
+    while (!r.error && r.pos < r.end) {
+        if (n >= max) {
+            return -1;
+        }
+        get_str(&r, &subs[n].filter);
+        subs[n].qos = get_u8(&r);
+        if (subs[n].qos > MQTT_QOS2 || subs[n].filter.len == 0) {
+            return -1;
+        }
+        n++;
+    }
+    if (n == 0 || *packet_id == 0) {
+        return -1;
+    }
+    *count = n;
+    return reader_done(&r);
+}
+
+int mqtt_decode_suback(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                       const uint8_t **return_codes, size_t *count) {
+    if (view->type != MQTT_SUBACK || view->flags != 0 || view->body_len < 3) {
+        return -1;
+    }
+    for (uint32_t i = 2; i < view->body_len; i++) {
+        uint8_t code = view->body[i];
+        if (code > MQTT_QOS2 && code != MQTT_SUBACK_FAILURE) {
+            return -1;
+        }
+    }
+    *packet_id = (uint16_t)((view->body[0] << 8) | view->body[1]);
+    *return_codes = view->body + 2;
+    *count = view->body_len - 2;
+    return 0;
+}
+
+/* Granted QoS 0-2 or a reason code of 0x80 and above per filter. */
+int mqtt_decode_suback_v5(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                          const uint8_t **return_codes, size_t *count,
+                          mqtt_properties_t *properties) {
+    mqtt_reader_t r;
+
+    if (view->type != MQTT_SUBACK || view->flags != 0) {
+        return -1;
+    }
+    reader_init(&r, view);
+    *packet_id = get_u16(&r);
+    get_properties(&r, properties);
+    if (r.error || r.pos >= r.end) {
+        return -1;
+    }
+    for (const uint8_t *code = r.pos; code < r.end; code++) {
+        if (*code > MQTT_QOS2 && *code < MQTT_SUBACK_FAILURE) {
+            return -1;
+        }
+    }
+    *return_codes = r.pos;
+    *count = (size_t)(r.end - r.pos);
+    return 0;
+}
+
+int mqtt_decode_unsubscribe(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                            mqtt_str_t *filters, size_t max, size_t *count) {
+    mqtt_reader_t r;
+    size_t n = 0;
+
+    if (view->type != MQTT_UNSUBSCRIBE || view->flags != 0x02) {
+        return -1;
+    }
+    reader_init(&r, view);
+    *packet_id = get_u16(&r);
+    while (!r.error && r.pos < r.end) {
+        if (n >= max) {
+            return -1;
+        }
+        get_str(&r, &filters[n]);
+        if (filters[n].len == 0) {
+            return -1;
+        }
+        n++;
+    }
+    if (n == 0 || *packet_id == 0) {
+        return -1;
+    }
+    *count = n;
+    return reader_done(&r);
+}
+
+/* Also accepts the two byte 3.1.1 form, which is how a broker that does
+ * not speak MQTT 5 rejects the protocol level. */
+int mqtt_decode_connack_v5(const mqtt_packet_view_t *view, bool *session_present,
+                           uint8_t *reason_code, mqtt_properties_t *properties) {
+    mqtt_reader_t r;
+
+    if (view->type != MQTT_CONNACK || view->flags != 0) {
+        return -1;
+    }
+    reader_init(&r, view);
+    uint8_t flags = get_u8(&r);
+    *reason_code = get_u8(&r);
+    if (r.error || (flags & 0xFE) != 0) {
+        return -1;
+    }
+    *session_present = (flags & 0x01) != 0;
+    if (r.pos == r.end) {
+        memset(properties, 0, sizeof(*properties));
+        return 0;
+    }
+    get_properties(&r, properties);
+    return reader_done(&r);
+}
+
+int mqtt_decode_ack_v5(const mqtt_packet_view_t *view, uint16_t *packet_id,
+                       uint8_t *reason_code, mqtt_properties_t *properties) {
+    uint8_t expected_flags = view->type == MQTT_PUBREL ? 0x02 : 0x00;
+    mqtt_reader_t r;
+
+    if (!is_ack_type(view->type) || view->type == MQTT_UNSUBACK || view->flags != expected_flags) {
+        return -1;
+    }
+    reader_init(&r, view);
+    *packet_id = get_u16(&r);
+    *reason_code = r.pos < r.end ? get_u8(&r) : MQTT_RC_SUCCESS;
+    if (r.pos < r.end) {
+        get_properties(&r, properties);
+    } else {
+        memset(properties, 0, sizeof(*properties));
+    }
+    return reader_done(&r);
+}
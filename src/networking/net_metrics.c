@@ -0,0 +1,60 @@
+#include <string.h>
+#include "net_metrics.h"
+
+static uint32_t bucket_index(uint32_t us) {
+    if (us < 4) {
+        return us;
+    }
+    uint32_t msb = 31 - __builtin_clz(us);
+    uint32_t sub = (us >> (msb - 2)) & 3;
+    return 4 + (msb - 2) * 4 + sub;
+}
+
+static uint32_t bucket_upper(uint32_t index) {
+    if (index < 4) {
+        return index;
+    }
+    uint32_t msb = (index - 4) / 4 + 2;
+    uint32_t sub = (index - 4) % 4;
+    return (uint32_t)((((uint64_t)5 + sub) << (msb - 2)) - 1);
+}
+
+void latency_hist_reset(latency_hist_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+}
+
+void latency_hist_record(latency_hist_t *hist, uint32_t us) {
+    hist->buckets[bucket_index(us)]++;
+    hist->count++;
+    hist->sum_us += us;
+    if (us > hist->max_us) {
+        hist->max_us = us;
+    }
+}
+
+void latency_hist_merge(latency_hist_t *dst, const latency_hist_t *src) {
+    for (uint32_t i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum_us += src->sum_us;
+    if (src->max_us > dst->max_us) {
+        dst->max_us = src->max_us;
+    }
+}
+
+uint32_t latency_hist_percentile(const latency_hist_t *hist, uint32_t percent) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    uint64_t rank = ((uint64_t)hist->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank && seen > 0) {
+            uint32_t upper = bucket_upper(i);
+            return upper < hist->max_us ? upper : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
@@ -0,0 +1,743 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include "config.h"
+#include "common.h"
+#include "network_manager.h"
+#include "tls.h"
+#include "mbedtls/x509.h"
+#include "mbedtls/error.h"
+
+/* Owns connect and reconnect for the engine thread. Each of the
+ * NET_STRIPE_COUNT lanes has a primary connection carrying one MQTT session;
+ * once that session is up a standby connection is brought up to a different
+ * address (when there is one) and kept idle after its handshake, so losing
+ * the primary costs an MQTT CONNECT rather than a full TCP + TLS setup. */
+typedef struct {
+    tls_conn_t conns[2];
+    tls_conn_t *primary;
+    tls_conn_t *standby;
+    bool claimed;
+    bool session_up;
+    uint32_t backoff_ms;
+    uint64_t retry_at_us;
+    uint64_t standby_retry_at_us;
+    mbedtls_ssl_session session;
+    bool session_saved;
+    bool psk_ke_refused;
+} netmgr_lane_t;
+
+typedef struct {
+    netmgr_lane_t lanes[NET_STRIPE_COUNT];
+    uint64_t rng;
+    int epoll_fd;
+    uint32_t io_syscalls;
+    uint64_t io_wire_bytes;
+    netmgr_handshakes_t handshakes;
+} netmgr_t;
+
+static netmgr_t nm;
+
+static void debug_certificate_verification(const mbedtls_ssl_context *ssl) {
+    uint32_t flags = mbedtls_ssl_get_verify_result(ssl);
+
+    if (flags != 0) {
+        char vrfy_buf[512];
+        net_log("Network Certificate verification flags: 0x%08x\n", flags);
+
+        if (flags & MBEDTLS_X509_BADCERT_EXPIRED)
+            net_log("Network   - Certificate expired\n");
+        if (flags & MBEDTLS_X509_BADCERT_REVOKED)
+            net_log("Network   - Certificate revoked\n");
+        if (flags & MBEDTLS_X509_BADCERT_CN_MISMATCH)
+            net_log("Network   - CN mismatch (expected: %s)\n", MQTT_BROKER_ADDRESS);
+        if (flags & MBEDTLS_X509_BADCERT_NOT_TRUSTED)
+            net_log("Network   - Certificate not trusted\n");
+        if (flags & MBEDTLS_X509_BADCRL_NOT_TRUSTED)
+            net_log("Network   - CRL not trusted\n");
+        if (flags & MBEDTLS_X509_BADCRL_EXPIRED)
+            net_log("Network   - CRL expired\n");
+        if (flags & MBEDTLS_X509_BADCERT_OTHER)
+            net_log("Network   - Other certificate issue\n");
+        if (flags & MBEDTLS_X509_BADCERT_FUTURE)
+            net_log("Network   - Certificate validity starts in the future\n");
+        if (flags & MBEDTLS_X509_BADCRL_FUTURE)
+            net_log("Network   - CRL validity starts in the future\n");
+        if (flags & MBEDTLS_X509_BADCERT_KEY_USAGE)
+            net_log("Network   - Key usage violation\n");
+        if (flags & MBEDTLS_X509_BADCERT_EXT_KEY_USAGE)
+            net_log("Network   - Extended key usage violation\n");
+        if (flags & MBEDTLS_X509_BADCERT_NS_CERT_TYPE)
+            net_log("Network   - NS certificate type violation\n");
+        if (flags & MBEDTLS_X509_BADCERT_BAD_MD)
+            net_log("Network   - Bad message digest\n");
+        if (flags & MBEDTLS_X509_BADCERT_BAD_PK)
+            net_log("Network   - Bad public key\n");
+        if (flags & MBEDTLS_X509_BADCERT_BAD_KEY)
+            net_log("Network   - Bad key\n");
+        if (flags & MBEDTLS_X509_BADCRL_BAD_MD)
+            net_log("Network   - Bad CRL message digest\n");
+        if (flags & MBEDTLS_X509_BADCRL_BAD_PK)
+            net_log("Network   - Bad CRL public key\n");
+        if (flags & MBEDTLS_X509_BADCRL_BAD_KEY)
+            net_log("Network   - Bad CRL key\n");
+
+        mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "  ! ", flags);
+        net_log("Network Full verification info:\n%s\n", vrfy_buf);
+    }
+
+    const mbedtls_x509_crt *peer_cert = mbedtls_ssl_get_peer_cert(ssl);
+    if (peer_cert != NULL) {
+        char cert_buf[2048];
+        mbedtls_x509_crt_info(cert_buf, sizeof(cert_buf), "  ", peer_cert);
+        //net_log("Network Peer certificate:\n%s\n", cert_buf);
+    }
+}
+
+static int my_mbedtls_send(void *ctx, const unsigned char *buf, size_t len) {
+    int fd = ((tls_conn_t *)ctx)->fd;
+    int ret = send(fd, buf, len, 0);
+    nm.io_syscalls++;
+    if (ret > 0) {
+        nm.io_wire_bytes += ret;
+    }
+    if (ret < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return MBEDTLS_ERR_SSL_WANT_WRITE;
+        }
+        return -1;
+    }
+    return ret;
+}
+
+static int my_mbedtls_recv(void *ctx, unsigned char *buf, size_t len) {
+    int fd = ((tls_conn_t *)ctx)->fd;
+    int ret = recv(fd, buf, len, 0);
+    if (ret < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return MBEDTLS_ERR_SSL_WANT_READ;
+        }
+        return -1;
+    }
+    return ret;
+}
+
+static int tls_setup(tls_conn_t *conn) {
+    netmgr_lane_t *lane = &nm.lanes[conn->lane];
+    int ret;
+
+    if (tls_init() != 0) {
+        return -1;
+    }
+    /* The ssl context is bound to its config, so switching between the
+     * full and the resumption config sets it up again. */
+    bool resume = !tls_psk_enabled() && lane->session_saved;
+    const mbedtls_ssl_config *conf = resume && !lane->psk_ke_refused ? tls_resume_config() : tls_config();
+    tls_memory_charge(&conn->memory);
+    if (conn->tls_initialized && conn->tls_conf != conf) {
+        mbedtls_ssl_free(&conn->ssl);
+        conn->tls_initialized = false;
+    }
+    if (!conn->tls_initialized) {
+        mbedtls_ssl_init(&conn->ssl);
+        if ((ret = mbedtls_ssl_setup(&conn->ssl, conf)) != 0) {
+            net_log("Network Failed to set up SSL context: -0x%x\n", -ret);
+            mbedtls_ssl_free(&conn->ssl);
+            tls_memory_charge(NULL);
+            return -1;
+        }
+        if ((ret = mbedtls_ssl_set_hostname(&conn->ssl, MQTT_BROKER_ADDRESS)) != 0) {
+            net_log("Network Failed to set hostname: -0x%x\n", -ret);
+            mbedtls_ssl_free(&conn->ssl);
+            tls_memory_charge(NULL);
+            return -1;
+        }
+        mbedtls_ssl_set_bio(&conn->ssl, conn, my_mbedtls_send, my_mbedtls_recv, NULL);
+        conn->tls_conf = conf;
+        conn->tls_initialized = true;
+    }
+    conn->tls_used = true;
+
+    /* Offer the lane's last session; a broker that still knows it (by
+     * ticket or session ID) skips the certificate chain. TLS 1.2 also skips
+     * the key exchange, TLS 1.3 only under psk_ke. A PSK handshake has no
+     * certificate to skip. */
+    conn->cert_received = false;
+    if (TLS_KTLS_ENABLE) {
+        ktls_capture(&conn->ssl, &conn->ktls_secrets);
+    }
+    conn->resume_offered = resume && mbedtls_ssl_set_session(&conn->ssl, &lane->session) == 0;
+    tls_memory_charge(NULL);
+    return 0;
+}
+
+static uint64_t thread_cpu_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Keeps the connection's session for the lane's next connect. A TLS 1.3
+ * session only becomes resumable with the ticket the broker sends after
+ * the handshake, so this runs again for every ticket received. */
+static void save_session(tls_conn_t *conn) {
+    netmgr_lane_t *lane = &nm.lanes[conn->lane];
+    mbedtls_ssl_session session;
+
+    if (tls_psk_enabled()) {
+        return;
+    }
+    mbedtls_ssl_session_init(&session);
+    if (mbedtls_ssl_get_session(&conn->ssl, &session) != 0) {
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+    mbedtls_ssl_session_free(&lane->session);
+    lane->session = session;
+    lane->session_saved = true;
+}
+
+void netmgr_session_ticket(tls_conn_t *conn) {
+    save_session(conn);
+}
+
+/* Same contract as mbedtls_ssl_read(). What mbedTLS allocates meanwhile,
+ * such as a TLS 1.3 session ticket, is charged to the connection. */
+int netmgr_read(tls_conn_t *conn, uint8_t *buf, size_t len) {
+    tls_memory_charge(&conn->memory);
+    int ret = mbedtls_ssl_read(&conn->ssl, buf, len);
+    tls_memory_charge(NULL);
+    return ret;
+}
+
+/* Same contract as mbedtls_ssl_write(). With kTLS the kernel frames the
+ * records, so their overhead is estimated for the wire byte count. */
+int netmgr_write(tls_conn_t *conn, const uint8_t *buf, size_t len, bool more) {
+    if (!conn->ktls_tx) {
+        tls_memory_charge(&conn->memory);
+        int ret = mbedtls_ssl_write(&conn->ssl, buf, len);
+        tls_memory_charge(NULL);
+        return ret;
+    }
+    int ret = ktls_send(conn->fd, buf, len, more);
+    nm.io_syscalls++;
+    if (ret > 0) {
+        nm.io_wire_bytes += ret;
+        if (!more) {
+            nm.io_wire_bytes += conn->ktls_overhead * ((ret + KTLS_MAX_RECORD - 1) / KTLS_MAX_RECORD);
+        }
+    }
+    return ret;
+}
+
+static void conn_watch(tls_conn_t *conn, int fd, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    int op = conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (events == conn->events) {
+        return;
+    }
+    if (epoll_ctl(nm.epoll_fd, op, fd, &ev) == 0) {
+        conn->events = events;
+    }
+}
+
+static void conn_close(tls_conn_t *conn, bool notify) {
+    for (int i = 0; i < conn->race_launched; i++) {
+        if (conn->race_fds[i] >= 0) {
+            close(conn->race_fds[i]);
+            conn->race_fds[i] = -1;
+        }
+    }
+    conn->race_launched = 0;
+    conn->race_count = 0;
+    if (conn->tls_used) {
+        tls_memory_charge(&conn->memory);
+        if (notify && conn->state == TLS_CONN_READY) {
+            if (conn->ktls_tx) {
+                ktls_close_notify(conn->fd);
+            } else {
+                mbedtls_ssl_close_notify(&conn->ssl);
+            }
+        }
+        mbedtls_ssl_session_reset(&conn->ssl);
+        tls_memory_charge(NULL);
+        conn->tls_used = false;
+        conn->ktls_tx = false;
+    }
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->events = 0;
+    conn->state = TLS_CONN_IDLE;
+}
+
+/* Decorrelated jitter: each delay is drawn from [base, 3 * previous],
+ * capped, so reconnecting clients spread out instead of retrying in step. */
+static uint32_t backoff_next(netmgr_lane_t *lane) {
+    uint32_t upper = lane->backoff_ms > NET_BACKOFF_CAP_MS / 3 ? NET_BACKOFF_CAP_MS : lane->backoff_ms * 3;
+    nm.rng ^= nm.rng << 13;
+    nm.rng ^= nm.rng >> 7;
+    nm.rng ^= nm.rng << 17;
+    lane->backoff_ms = NET_BACKOFF_BASE_MS + (uint32_t)(nm.rng % (upper - NET_BACKOFF_BASE_MS + 1));
+    return lane->backoff_ms;
+}
+
+static void conn_handshake(tls_conn_t *conn, uint64_t now_us) {
+    char addr_buf[64];
+    uint64_t cpu_us = thread_cpu_us();
+    uint32_t allocs = tls_alloc_count();
+    uint32_t certs = tls_cert_count();
+    tls_memory_charge(&conn->memory);
+    int ret = mbedtls_ssl_handshake(&conn->ssl);
+    tls_memory_charge(NULL);
+    conn->handshake_cpu_us += thread_cpu_us() - cpu_us;
+    conn->handshake_allocs += tls_alloc_count() - allocs;
+    /* A handshake that verified no certificate resumed a session, under
+     * TLS 1.2 and 1.3 alike. */
+    conn->cert_received |= tls_cert_count() != certs;
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        if (now_us >= conn->deadline_us) {
+            net_log("Network SSL handshake timeout\n");
+            conn->state = TLS_CONN_FAILED;
+            return;
+        }
+        conn_watch(conn, conn->fd, ret == MBEDTLS_ERR_SSL_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+        return;
+    }
+    if (ret != 0) {
+        char error_buf[100];
+        mbedtls_strerror(ret, error_buf, sizeof(error_buf));
+        net_log("Network SSL handshake failed: -0x%x (%s)\n", -ret, error_buf);
+        /* Without a key share the broker cannot fall back to a full
+         * handshake, so the lane goes back to psk_dhe_ke for good. */
+        netmgr_lane_t *lane = &nm.lanes[conn->lane];
+        if (conn->resume_offered && conn->tls_conf != tls_config() && !lane->psk_ke_refused) {
+            net_log("Network Broker refused psk_ke resumption, resuming with ECDHE from now on\n");
+            lane->psk_ke_refused = true;
+        }
+        conn->state = TLS_CONN_FAILED;
+        return;
+    }
+
+    debug_certificate_verification(&conn->ssl);
+
+    /* For a resumed session this is the result saved from its full
+     * handshake. */
+    uint32_t verify_flags;
+    if ((verify_flags = mbedtls_ssl_get_verify_result(&conn->ssl)) != 0) {
+        char vrfy_buf[512];
+        mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "  ! ", verify_flags);
+        net_log("Network Certificate verification failed:\n%s\n", vrfy_buf);
+
+        if (TLS_VERIFY_REQUIRED) {
+            conn->state = TLS_CONN_FAILED;
+            return;
+        }
+    }
+
+    bool resumed = conn->resume_offered && !conn->cert_received;
+    uint32_t handshake_us = (uint32_t)(get_time_us() - conn->handshake_started_us);
+    netmgr_handshakes_t *hs = &nm.handshakes;
+    save_session(conn);
+    if (resumed) {
+        latency_hist_record(&hs->resumed, handshake_us);
+        hs->resumed_cpu_us += conn->handshake_cpu_us;
+        hs->resumed_allocs += conn->handshake_allocs;
+    } else {
+        latency_hist_record(&hs->full, handshake_us);
+        hs->full_cpu_us += conn->handshake_cpu_us;
+        hs->full_allocs += conn->handshake_allocs;
+    }
+    net_log("Network SSL handshake with %s successful (%u ms, %s %s, %s, %u us CPU, %u allocs, %u bytes held)\n",
+            dns_addr_str(&conn->peer, addr_buf, sizeof(addr_buf)),
+            (unsigned int)((now_us - conn->started_us) / 1000),
+            mbedtls_ssl_get_version(&conn->ssl), mbedtls_ssl_get_ciphersuite(&conn->ssl),
+            tls_psk_enabled() ? "PSK" : resumed ? "resumed" : "full", (unsigned int)conn->handshake_cpu_us,
+            (unsigned int)conn->handshake_allocs, (unsigned int)conn->memory);
+
+    if (TLS_KTLS_ENABLE &&
+        ktls_enable_tx(conn->fd, &conn->ssl, &conn->ktls_secrets, &conn->ktls_overhead) == 0) {
+        conn->ktls_tx = true;
+        net_log("Network kTLS transmit offload enabled\n");
+    }
+
+    epoll_ctl(nm.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->events = 0;
+    conn->checked_us = now_us;
+    conn->state = TLS_CONN_READY;
+}
+
+/* Starts the next candidate address. A candidate that fails immediately
+ * is skipped straight away instead of waiting out the race delay. */
+static void conn_launch(tls_conn_t *conn, uint64_t now_us) {
+    char addr_buf[64];
+    while (conn->race_launched < conn->race_count) {
+        int i = conn->race_launched++;
+        const dns_addr_t *addr = &conn->race_addrs[i];
+        int fd = socket(addr->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        net_log("Network Connecting to %s (%s, TLS mode)\n",
+                dns_addr_str(addr, addr_buf, sizeof(addr_buf)), MQTT_BROKER_ADDRESS);
+        conn->race_started_us[i] = now_us;
+        conn->race_fds[i] = -1;
+        if (fd >= 0 &&
+            (connect(fd, (const struct sockaddr *)&addr->addr, addr->addr_len) == 0 ||
+             errno == EINPROGRESS)) {
+            struct epoll_event ev = { .events = EPOLLOUT, .data.fd = fd };
+            epoll_ctl(nm.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+            conn->race_fds[i] = fd;
+            conn->next_launch_us = now_us + NET_RACE_DELAY_MS * 1000ULL;
+            return;
+        }
+        net_log("Network Connect error: %s\n", strerror(errno));
+        dns_cache_report(addr, 0, false);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    conn->next_launch_us = UINT64_MAX;
+}
+
+static void conn_start(tls_conn_t *conn, uint64_t now_us, const dns_addr_t *avoid) {
+    dns_addr_t addrs[DNS_CACHE_MAX_ADDRS];
+    int count = dns_cache_get(addrs, DNS_CACHE_MAX_ADDRS, 0);
+
+    if (count == 0) {
+        if (conn->state != TLS_CONN_RESOLVING) {
+            conn->state = TLS_CONN_RESOLVING;
+            conn->deadline_us = now_us + NET_CONNECT_TIMEOUT_MS * 1000ULL;
+        } else if (now_us >= conn->deadline_us) {
+            net_log("Network Failed to resolve hostname\n");
+            conn->state = TLS_CONN_FAILED;
+        }
+        return;
+    }
+
+    conn->race_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < count; i++) {
+            bool avoided = avoid != NULL && addrs[i].addr_len == avoid->addr_len &&
+                           memcmp(&addrs[i].addr, &avoid->addr, avoid->addr_len) == 0;
+            if (avoided == (pass == 1)) {
+                conn->race_addrs[conn->race_count++] = addrs[i];
+            }
+        }
+    }
+    conn->race_launched = 0;
+    conn->started_us = now_us;
+    conn->deadline_us = now_us + NET_CONNECT_TIMEOUT_MS * 1000ULL;
+    conn->state = TLS_CONN_CONNECTING;
+    conn_launch(conn, now_us);
+}
+
+static void conn_race(tls_conn_t *conn, uint64_t now_us) {
+    struct pollfd pfds[DNS_CACHE_MAX_ADDRS];
+    int index[DNS_CACHE_MAX_ADDRS];
+    int pending = 0;
+    int winner = -1;
+    bool failed = false;
+
+    for (int i = 0; i < conn->race_launched; i++) {
+        if (conn->race_fds[i] >= 0) {
+            pfds[pending].fd = conn->race_fds[i];
+            pfds[pending].events = POLLOUT;
+            index[pending++] = i;
+        }
+    }
+    if (pending > 0 && poll(pfds, pending, 0) > 0) {
+        for (int p = 0; p < pending; p++) {
+            int i = index[p];
+            int optval = 0;
+            socklen_t optlen = sizeof(optval);
+            if (pfds[p].revents == 0) {
+                continue;
+            }
+            if (getsockopt(conn->race_fds[i], SOL_SOCKET, SO_ERROR, &optval, &optlen) == 0 &&
+                optval == 0 && winner < 0) {
+                winner = i;
+                continue;
+            }
+            if (optval == 0) {
+                continue;
+            }
+            net_log("Network Connection failed: %s\n", strerror(optval));
+            dns_cache_report(&conn->race_addrs[i], 0, false);
+            close(conn->race_fds[i]);
+            conn->race_fds[i] = -1;
+            failed = true;
+        }
+    }
+
+    if (winner >= 0) {
+        conn->fd = conn->race_fds[winner];
+        conn->race_fds[winner] = -1;
+        conn->peer = conn->race_addrs[winner];
+        conn->events = EPOLLOUT;
+        dns_cache_report(&conn->peer, (uint32_t)(now_us - conn->race_started_us[winner]), true);
+        for (int i = 0; i < conn->race_launched; i++) {
+            if (conn->race_fds[i] >= 0) {
+                close(conn->race_fds[i]);
+                conn->race_fds[i] = -1;
+            }
+        }
+        net_log("Network TCP connection established\n");
+        if (tls_setup(conn) != 0) {
+            conn->state = TLS_CONN_FAILED;
+            return;
+        }
+        conn->state = TLS_CONN_HANDSHAKE;
+        conn->deadline_us = now_us + NET_HANDSHAKE_TIMEOUT_MS * 1000ULL;
+        conn->handshake_started_us = now_us;
+        conn->handshake_cpu_us = 0;
+        conn->handshake_allocs = 0;
+        conn_handshake(conn, now_us);
+        return;
+    }
+
+    if (now_us >= conn->deadline_us) {
+        net_log("Network Connection timeout\n");
+        for (int i = 0; i < conn->race_launched; i++) {
+            if (conn->race_fds[i] >= 0) {
+                dns_cache_report(&conn->race_addrs[i], 0, false);
+            }
+        }
+        conn->state = TLS_CONN_FAILED;
+        return;
+    }
+    if (failed || now_us >= conn->next_launch_us) {
+        conn_launch(conn, now_us);
+    }
+    for (int i = 0; i < conn->race_launched; i++) {
+        if (conn->race_fds[i] >= 0) {
+            return;
+        }
+    }
+    if (conn->race_launched == conn->race_count) {
+        conn->state = TLS_CONN_FAILED;
+    }
+}
+
+static void conn_step(tls_conn_t *conn, uint64_t now_us, const dns_addr_t *avoid) {
+    switch (conn->state) {
+        case TLS_CONN_IDLE:
+        case TLS_CONN_RESOLVING:
+            conn_start(conn, now_us, avoid);
+            break;
+        case TLS_CONN_CONNECTING:
+            conn_race(conn, now_us);
+            break;
+        case TLS_CONN_HANDSHAKE:
+            conn_handshake(conn, now_us);
+            break;
+        default:
+            break;
+    }
+}
+
+/* An idle standby should never receive data before its MQTT CONNECT, so a
+ * non-blocking one-byte read only returns when the broker has dropped it,
+ * or with a TLS 1.3 session ticket. */
+static void standby_check(tls_conn_t *conn, uint64_t now_us) {
+    unsigned char byte;
+    int ret;
+    if (now_us - conn->checked_us < NET_STANDBY_CHECK_MS * 1000ULL) {
+        return;
+    }
+    conn->checked_us = now_us;
+    while ((ret = netmgr_read(conn, &byte, 1)) == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) {
+        save_session(conn);
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        net_log("Network Standby connection dropped by broker\n");
+        conn->state = TLS_CONN_FAILED;
+    }
+}
+
+int netmgr_init(int epoll_fd) {
+    memset(&nm, 0, sizeof(nm));
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        netmgr_lane_t *lane = &nm.lanes[i];
+        lane->primary = &lane->conns[0];
+        lane->standby = &lane->conns[1];
+        lane->conns[0].fd = -1;
+        lane->conns[1].fd = -1;
+        lane->conns[0].lane = i;
+        lane->conns[1].lane = i;
+        mbedtls_ssl_session_init(&lane->session);
+        lane->backoff_ms = NET_BACKOFF_BASE_MS;
+    }
+    nm.epoll_fd = epoll_fd;
+    nm.rng = get_time_us() | 1;
+    if (tls_init() != 0) {
+        net_log("Network TLS setup failed, will retry on connect\n");
+    }
+    return dns_cache_init(MQTT_BROKER_ADDRESS, MQTT_BROKER_PORT);
+}
+
+void netmgr_shutdown(void) {
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        conn_close(nm.lanes[i].primary, true);
+        conn_close(nm.lanes[i].standby, false);
+        for (int c = 0; c < 2; c++) {
+            tls_conn_t *conn = &nm.lanes[i].conns[c];
+            if (conn->tls_initialized) {
+                tls_memory_charge(&conn->memory);
+                mbedtls_ssl_free(&conn->ssl);
+                tls_memory_charge(NULL);
+                conn->tls_initialized = false;
+            }
+        }
+        mbedtls_ssl_session_free(&nm.lanes[i].session);
+    }
+    tls_free();
+    dns_cache_shutdown();
+}
+
+/* Advances both connections of a lane. Returns its primary connection once
+ * it is ready for an MQTT session, or NULL while there is none to start. */
+tls_conn_t *netmgr_poll(int index, uint64_t now_us) {
+    netmgr_lane_t *lane = &nm.lanes[index];
+    tls_conn_t *primary = lane->primary;
+    tls_conn_t *standby = lane->standby;
+
+    if (!lane->claimed && primary->state != TLS_CONN_READY && now_us >= lane->retry_at_us) {
+        conn_step(primary, now_us, NULL);
+        if (primary->state == TLS_CONN_FAILED) {
+            conn_close(primary, false);
+            lane->retry_at_us = now_us + backoff_next(lane) * 1000ULL;
+            dns_cache_refresh();
+            net_log("Network Reconnecting in %u ms\n", (unsigned int)lane->backoff_ms);
+        }
+    }
+
+    if (NET_STANDBY_ENABLE && lane->session_up) {
+        if (standby->state == TLS_CONN_READY) {
+            standby_check(standby, now_us);
+        } else if (now_us >= lane->standby_retry_at_us) {
+            conn_step(standby, now_us, primary->state == TLS_CONN_READY ? &primary->peer : NULL);
+        }
+        if (standby->state == TLS_CONN_FAILED) {
+            conn_close(standby, false);
+            lane->standby_retry_at_us = now_us + NET_STANDBY_RETRY_MS * 1000ULL;
+        }
+    }
+
+    if (!lane->claimed && primary->state == TLS_CONN_READY) {
+        lane->claimed = true;
+        return primary;
+    }
+    return NULL;
+}
+
+void netmgr_session_up(int index) {
+    nm.lanes[index].session_up = true;
+    nm.lanes[index].backoff_ms = NET_BACKOFF_BASE_MS;
+}
+
+/* Ends the session on `conn`. A standby that is ready (or still coming up)
+ * takes over as the lane's primary immediately; otherwise the next connect
+ * waits out the backoff. */
+void netmgr_release(int index, tls_conn_t *conn, bool failed) {
+    netmgr_lane_t *lane = &nm.lanes[index];
+    char addr_buf[64];
+    uint64_t now_us = get_time_us();
+
+    conn_close(conn, !failed);
+    lane->claimed = false;
+    lane->session_up = false;
+    if (!failed) {
+        return;
+    }
+    if (lane->standby->state != TLS_CONN_IDLE) {
+        tls_conn_t *standby = lane->standby;
+        lane->standby = lane->primary;
+        lane->primary = standby;
+        lane->retry_at_us = now_us;
+        net_log("Network Failing over to standby connection %s\n",
+                dns_addr_str(&standby->peer, addr_buf, sizeof(addr_buf)));
+        return;
+    }
+    lane->retry_at_us = now_us + backoff_next(lane) * 1000ULL;
+    net_log("Network Reconnecting in %u ms\n", (unsigned int)lane->backoff_ms);
+}
+
+static void earliest(uint64_t *next_us, uint64_t at_us) {
+    if (at_us < *next_us) {
+        *next_us = at_us;
+    }
+}
+
+static void conn_deadline(const tls_conn_t *conn, uint64_t *next_us, uint64_t now_us) {
+    switch (conn->state) {
+        case TLS_CONN_RESOLVING:
+            earliest(next_us, now_us + 10000);
+            break;
+        case TLS_CONN_CONNECTING:
+            earliest(next_us, conn->next_launch_us);
+            earliest(next_us, conn->deadline_us);
+            break;
+        case TLS_CONN_HANDSHAKE:
+            earliest(next_us, conn->deadline_us);
+            break;
+        default:
+            break;
+    }
+}
+
+/* How long the engine may sleep before a connection needs attention. */
+int netmgr_timeout_ms(uint64_t now_us, int max_ms) {
+    uint64_t next_us = now_us + max_ms * 1000ULL;
+
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        const netmgr_lane_t *lane = &nm.lanes[i];
+        if (!lane->claimed) {
+            if (lane->primary->state == TLS_CONN_IDLE || lane->primary->state == TLS_CONN_READY) {
+                earliest(&next_us, lane->retry_at_us);
+            }
+            conn_deadline(lane->primary, &next_us, now_us);
+        }
+        if (NET_STANDBY_ENABLE && lane->session_up) {
+            if (lane->standby->state == TLS_CONN_IDLE) {
+                earliest(&next_us, lane->standby_retry_at_us);
+            } else if (lane->standby->state == TLS_CONN_READY) {
+                earliest(&next_us, lane->standby->checked_us + NET_STANDBY_CHECK_MS * 1000ULL);
+            }
+            conn_deadline(lane->standby, &next_us, now_us);
+        }
+    }
+    return next_us <= now_us ? 0 : (int)((next_us - now_us + 999) / 1000);
+}
+
+void netmgr_get_io(uint32_t *syscalls, uint64_t *wire_bytes) {
+    *syscalls = nm.io_syscalls;
+    *wire_bytes = nm.io_wire_bytes;
+}
+
+const netmgr_handshakes_t *netmgr_get_handshakes(void) {
+    return &nm.handshakes;
+}
+
+/* TLS arena bytes held by the connections that finished a handshake: the
+ * record buffers, the session and the record protection state. */
+size_t netmgr_tls_memory(int *conns) {
+    size_t bytes = 0;
+
+    *conns = 0;
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        for (int c = 0; c < 2; c++) {
+            const tls_conn_t *conn = &nm.lanes[i].conns[c];
+            if (conn->state == TLS_CONN_READY) {
+                bytes += conn->memory;
+                (*conns)++;
+            }
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,48 @@
+#include <string.h>
+#include "spsc_ring.h"
+
+void spsc_ring_init(spsc_ring_t *ring, void *storage, uint32_t elem_size, uint32_t capacity) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->slots = storage;
+    ring->elem_size = elem_size;
+    ring->mask = capacity - 1;
+}
+
+bool spsc_ring_push(spsc_ring_t *ring, const void *elem) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask) {
+        return false;
+    }
+    memcpy(ring->slots + (head & ring->mask) * ring->elem_size, elem, ring->elem_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool spsc_ring_pop(spsc_ring_t *ring, void *elem) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+    memcpy(elem, ring->slots + (tail & ring->mask) * ring->elem_size, ring->elem_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Consumer side only: the oldest element, left in place, or NULL. */
+const void *spsc_ring_peek(const spsc_ring_t *ring) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return ring->slots + (tail & ring->mask) * ring->elem_size;
+}
+
+uint32_t spsc_ring_free(const spsc_ring_t *ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return ring->mask + 1 - (head - tail);
+}
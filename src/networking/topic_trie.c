@@ -0,0 +1,191 @@
+#include <string.h>
+#include "topic_trie.h"
+
+/* Subscription filters compiled into a trie of topic levels. Filters are
+ * added once, before any matching, and the trie is only read afterwards;
+ * topic_trie_match() returns a bitmask with one bit per added filter. */
+
+typedef struct {
+    const char *text;
+    uint16_t len;
+} level_t;
+
+static uint32_t level_hash(int parent, const char *text, size_t len) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int split_levels(const char *topic, size_t len, level_t *levels) {
+    int count = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || topic[i] == '/') {
+            if (count == TOPIC_TRIE_MAX_LEVELS) {
+                return -1;
+            }
+            levels[count].text = topic + start;
+            levels[count].len = (uint16_t)(i - start);
+            count++;
+            start = i + 1;
+        }
+    }
+    return count;
+}
+
+static const topic_trie_edge_t *find_edge(const topic_trie_t *trie, int parent, const char *text,
+                                          size_t len, uint32_t hash) {
+    for (uint32_t i = 0; i < TOPIC_TRIE_EDGE_SLOTS; i++) {
+        const topic_trie_edge_t *edge = &trie->edges[(hash + i) & (TOPIC_TRIE_EDGE_SLOTS - 1)];
+        if (edge->child < 0) {
+            return edge;
+        }
+        if (edge->hash == hash && edge->parent == parent && edge->text_len == len &&
+            memcmp(trie->text + edge->text_off, text, len) == 0) {
+            return edge;
+        }
+    }
+    return NULL;
+}
+
+static int new_node(topic_trie_t *trie) {
+    if (trie->node_count == TOPIC_TRIE_MAX_NODES) {
+        return -1;
+    }
+    topic_trie_node_t *node = &trie->nodes[trie->node_count];
+    node->match = 0;
+    node->multi = 0;
+    node->plus = -1;
+    return trie->node_count++;
+}
+
+static int literal_child(topic_trie_t *trie, int parent, const level_t *level) {
+    uint32_t hash = level_hash(parent, level->text, level->len);
+    topic_trie_edge_t *edge = (topic_trie_edge_t *)find_edge(trie, parent, level->text, level->len, hash);
+    if (edge == NULL) {
+        return -1;
+    }
+    if (edge->child >= 0) {
+        return edge->child;
+    }
+    if (TOPIC_TRIE_TEXT_SIZE - trie->text_len < level->len) {
+        return -1;
+    }
+    int child = new_node(trie);
+    if (child < 0) {
+        return -1;
+    }
+    memcpy(trie->text + trie->text_len, level->text, level->len);
+    edge->hash = hash;
+    edge->parent = (int16_t)parent;
+    edge->child = (int16_t)child;
+    edge->text_off = trie->text_len;
+    edge->text_len = level->len;
+    trie->text_len += level->len;
+    return child;
+}
+
+void topic_trie_init(topic_trie_t *trie) {
+    trie->node_count = 0;
+    trie->text_len = 0;
+    trie->filter_count = 0;
+    for (int i = 0; i < TOPIC_TRIE_EDGE_SLOTS; i++) {
+        trie->edges[i].child = -1;
+    }
+    new_node(trie);
+}
+
+/* '+' must fill a whole level and '#' must be the whole last level. */
+bool topic_filter_valid(const char *filter, size_t len) {
+    if (len == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        bool level_start = i == 0 || filter[i - 1] == '/';
+        bool level_end = i + 1 == len || filter[i + 1] == '/';
+        if (filter[i] == '+' && !(level_start && level_end)) {
+            return false;
+        }
+        if (filter[i] == '#' && !(level_start && i + 1 == len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Returns the filter's bit index, or -1 if it is invalid or the trie is
+ * full. The trie is unchanged on failure only when the filter is invalid;
+ * running out of room may leave unused nodes behind. */
+int topic_trie_add(topic_trie_t *trie, const char *filter, size_t len) {
+    level_t levels[TOPIC_TRIE_MAX_LEVELS];
+    int count;
+
+    if (!topic_filter_valid(filter, len) || trie->filter_count == TOPIC_TRIE_MAX_FILTERS ||
+        (count = split_levels(filter, len, levels)) < 0) {
+        return -1;
+    }
+    int node = 0;
+    uint32_t bit = 1u << trie->filter_count;
+    for (int i = 0; i < count; i++) {
+        if (levels[i].len == 1 && levels[i].text[0] == '#') {
+            trie->nodes[node].multi |= bit;
+            return trie->filter_count++;
+        }
+        if (levels[i].len == 1 && levels[i].text[0] == '+') {
+            if (trie->nodes[node].plus < 0) {
+                int child = new_node(trie);
+                if (child < 0) {
+                    return -1;
+                }
+                trie->nodes[node].plus = (int16_t)child;
+            }
+            node = trie->nodes[node].plus;
+        } else if ((node = literal_child(trie, node, &levels[i])) < 0) {
+            return -1;
+        }
+    }
+    trie->nodes[node].match |= bit;
+    return trie->filter_count++;
+}
+
+/* Walks literal and '+' branches together; only '+' can fork, so the work
+ * is bounded by the topic depth times the wildcard fan-out of the filters. */
+static uint32_t match_from(const topic_trie_t *trie, int node, const level_t *levels, int index, int count) {
+    const topic_trie_node_t *n = &trie->nodes[node];
+    uint32_t found = n->multi;
+
+    if (index == count) {
+        return found | n->match;
+    }
+    const level_t *level = &levels[index];
+    const topic_trie_edge_t *edge = find_edge(trie, node, level->text, level->len,
+                                              level_hash(node, level->text, level->len));
+    if (edge != NULL && edge->child >= 0) {
+        found |= match_from(trie, edge->child, levels, index + 1, count);
+    }
+    if (n->plus >= 0) {
+        found |= match_from(trie, n->plus, levels, index + 1, count);
+    }
+    return found;
+}
+
+uint32_t topic_trie_match(const topic_trie_t *trie, const char *topic, size_t len) {
+    level_t levels[TOPIC_TRIE_MAX_LEVELS];
+    int count;
+
+    if (len == 0 || (count = split_levels(topic, len, levels)) < 0) {
+        return 0;
+    }
+    /* Wildcards at the first level never match topics starting with '$'. */
+    if (topic[0] == '$') {
+        const topic_trie_edge_t *edge = find_edge(trie, 0, levels[0].text, levels[0].len,
+                                                  level_hash(0, levels[0].text, levels[0].len));
+        if (edge == NULL || edge->child < 0) {
+            return 0;
+        }
+        return match_from(trie, edge->child, levels, 1, count);
+    }
+    return match_from(trie, 0, levels, 0, count);
+}
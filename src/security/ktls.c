@@ -0,0 +1,226 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#include <linux/tls.h>
+#endif
+#include "config.h"
+#include "common.h"
+#include "ktls.h"
+#include "mbedtls/hkdf.h"
+#include "mbedtls/md.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/platform_util.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define TLS_ALERT_RECORD        21
+#define TLS_SEQ_LEN             8
+
+static void export_keys(void *ctx, mbedtls_ssl_key_export_type type, const unsigned char *secret,
+                        size_t secret_len, const unsigned char client_random[32],
+                        const unsigned char server_random[32], mbedtls_tls_prf_types prf) {
+    ktls_secrets_t *secrets = ctx;
+
+    if ((type != MBEDTLS_SSL_KEY_EXPORT_TLS12_MASTER_SECRET &&
+         type != MBEDTLS_SSL_KEY_EXPORT_TLS1_3_CLIENT_APPLICATION_TRAFFIC_SECRET) ||
+        secret_len > sizeof(secrets->secret)) {
+        return;
+    }
+    memcpy(secrets->secret, secret, secret_len);
+    secrets->secret_len = secret_len;
+    /* The TLS 1.2 key block is seeded with server_random + client_random. */
+    memcpy(secrets->randoms, server_random, 32);
+    memcpy(secrets->randoms + 32, client_random, 32);
+    secrets->prf = prf;
+}
+
+void ktls_capture(mbedtls_ssl_context *ssl, ktls_secrets_t *secrets) {
+    mbedtls_platform_zeroize(secrets, sizeof(*secrets));
+    mbedtls_ssl_set_export_keys_cb(ssl, export_keys, secrets);
+}
+
+/* HKDF-Expand-Label with an empty context, as TLS 1.3 derives its traffic
+ * key and IV (RFC 8446, section 7.3). */
+static int expand_label(const ktls_secrets_t *secrets, const char *label, unsigned char *out, size_t len) {
+    const mbedtls_md_info_t *md = mbedtls_md_info_from_type(secrets->secret_len == 48 ? MBEDTLS_MD_SHA384
+                                                                                      : MBEDTLS_MD_SHA256);
+    unsigned char info[32];
+    size_t label_len = strlen(label);
+
+    info[0] = (unsigned char)(len >> 8);
+    info[1] = (unsigned char)len;
+    info[2] = (unsigned char)(6 + label_len);
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, label_len);
+    info[9 + label_len] = 0;
+    return mbedtls_hkdf_expand(md, secrets->secret, secrets->secret_len, info, 10 + label_len, out, len);
+}
+
+/* For TLS 1.2 the key block holds both write keys and then both fixed IVs;
+ * AES-GCM completes its nonce with an explicit part carried in each record,
+ * which mbedTLS and the kernel both take from the record sequence number. */
+int ktls_derive_client_keys(const ktls_secrets_t *secrets, bool tls13, size_t key_len, size_t fixed_iv_len,
+                            unsigned char *key, unsigned char *iv) {
+    unsigned char block[2 * 32 + 2 * 12];
+    int ret;
+
+    if (tls13) {
+        if ((ret = expand_label(secrets, "key", key, key_len)) != 0) {
+            return ret;
+        }
+        return expand_label(secrets, "iv", iv, 12);
+    }
+    ret = mbedtls_ssl_tls_prf(secrets->prf, secrets->secret, secrets->secret_len, "key expansion",
+                              secrets->randoms, sizeof(secrets->randoms), block, 2 * key_len + 2 * fixed_iv_len);
+    if (ret == 0) {
+        memcpy(key, block, key_len);
+        memcpy(iv, block + 2 * key_len, fixed_iv_len);
+    }
+    mbedtls_platform_zeroize(block, sizeof(block));
+    return ret;
+}
+
+#if defined(__linux__)
+
+static bool ktls_unavailable;
+
+/* Returns 0 once the socket encrypts what is sent on it, or -1 if the suite
+ * or the kernel cannot take the keys, in which case the connection carries
+ * on through mbedTLS. The captured secrets are wiped either way. */
+int ktls_enable_tx(int fd, const mbedtls_ssl_context *ssl, ktls_secrets_t *secrets, uint8_t *record_overhead) {
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    unsigned char key[32];
+    unsigned char iv[12];
+    const char *suite = mbedtls_ssl_get_ciphersuite(ssl);
+    bool tls13 = mbedtls_ssl_get_version_number(ssl) == MBEDTLS_SSL_VERSION_TLS1_3;
+    bool chacha = strstr(suite, "CHACHA20-POLY1305") != NULL;
+    size_t key_len = strstr(suite, "AES-128-GCM") != NULL ? 16 : 32;
+    size_t info_len;
+    int ret = -1;
+
+    memset(&info, 0, sizeof(info));
+    if (ktls_unavailable || secrets->secret_len == 0 ||
+        (!chacha && strstr(suite, "AES-128-GCM") == NULL && strstr(suite, "AES-256-GCM") == NULL)) {
+        goto cleanup;
+    }
+    if (ktls_derive_client_keys(secrets, tls13, key_len, chacha || tls13 ? 12 : 4, key, iv) != 0) {
+        net_log("Network kTLS key derivation failed for %s\n", suite);
+        goto cleanup;
+    }
+    if (!tls13 && !chacha) {
+        memcpy(iv + 4, ssl->MBEDTLS_PRIVATE(cur_out_ctr), TLS_SEQ_LEN);
+    }
+
+    /* Every variant starts with the same struct tls_crypto_info. */
+    info.gcm128.info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+    if (chacha) {
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(info.chacha.iv, iv, 12);
+        memcpy(info.chacha.key, key, 32);
+        memcpy(info.chacha.rec_seq, ssl->MBEDTLS_PRIVATE(cur_out_ctr), TLS_SEQ_LEN);
+        info_len = sizeof(info.chacha);
+    } else if (key_len == 16) {
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.gcm128.salt, iv, 4);
+        memcpy(info.gcm128.iv, iv + 4, 8);
+        memcpy(info.gcm128.key, key, 16);
+        memcpy(info.gcm128.rec_seq, ssl->MBEDTLS_PRIVATE(cur_out_ctr), TLS_SEQ_LEN);
+        info_len = sizeof(info.gcm128);
+    } else {
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.gcm256.salt, iv, 4);
+        memcpy(info.gcm256.iv, iv + 4, 8);
+        memcpy(info.gcm256.key, key, 32);
+        memcpy(info.gcm256.rec_seq, ssl->MBEDTLS_PRIVATE(cur_out_ctr), TLS_SEQ_LEN);
+        info_len = sizeof(info.gcm256);
+    }
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        if (errno == ENOENT || errno == ENOPROTOOPT) {
+            ktls_unavailable = true;
+        }
+        net_log("Network kTLS unavailable (%s), records stay in mbedTLS\n", strerror(errno));
+        goto cleanup;
+    }
+    if (setsockopt(fd, SOL_TLS, TLS_TX, &info, info_len) != 0) {
+        net_log("Network kTLS rejected %s keys: %s\n", suite, strerror(errno));
+        goto cleanup;
+    }
+    /* Header and tag, plus the explicit nonce of TLS 1.2 AES-GCM or the
+     * inner content type of TLS 1.3. */
+    *record_overhead = 5 + 16 + (tls13 ? 1 : chacha ? 0 : 8);
+    ret = 0;
+
+cleanup:
+    mbedtls_platform_zeroize(&info, sizeof(info));
+    mbedtls_platform_zeroize(key, sizeof(key));
+    mbedtls_platform_zeroize(iv, sizeof(iv));
+    mbedtls_platform_zeroize(secrets, sizeof(*secrets));
+    return ret;
+}
+
+/* MSG_MORE keeps the record open, so a packet header and the payload sent
+ * after it share one record. */
+int ktls_send(int fd, const uint8_t *buf, size_t len, bool more) {
+    ssize_t ret = send(fd, buf, len, more ? MSG_MORE : 0);
+    if (ret < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return MBEDTLS_ERR_SSL_WANT_WRITE;
+        }
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return (int)ret;
+}
+
+/* Alerts need their record type set explicitly, or the kernel would send
+ * them as application data. */
+void ktls_close_notify(int fd) {
+    unsigned char alert[2] = { 1, 0 };
+    union {
+        char buf[CMSG_SPACE(sizeof(unsigned char))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = TLS_ALERT_RECORD;
+    sendmsg(fd, &msg, MSG_DONTWAIT);
+}
+
+#else
+
+int ktls_enable_tx(int fd, const mbedtls_ssl_context *ssl, ktls_secrets_t *secrets, uint8_t *record_overhead) {
+    (void)fd;
+    (void)ssl;
+    (void)record_overhead;
+    mbedtls_platform_zeroize(secrets, sizeof(*secrets));
+    return -1;
+}
+
+int ktls_send(int fd, const uint8_t *buf, size_t len, bool more) {
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)more;
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+void ktls_close_notify(int fd) {
+    (void)fd;
+}
+
+#endif
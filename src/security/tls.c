@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#include "config.h"
+#include "common.h"
+#include "tls.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/error.h"
+#include "mbedtls/debug.h"
+#include "mbedtls/platform.h"
+#include "mbedtls/platform_util.h"
+#include "psa/crypto.h"
+#if TLS_CA_EMBEDDED
+#include "tls_ca_bundle.h"
+#endif
+
+/* Only the engine thread uses this state once tls_init() has returned, so
+ * the DRBG needs no locking. */
+typedef struct {
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_x509_crt cacert;
+    mbedtls_x509_crt client_cert;
+    mbedtls_pk_context client_key;
+    mbedtls_ssl_config conf;
+    mbedtls_ssl_config resume_conf;
+    bool resume_psk;
+    bool psk;
+    bool psk_ephemeral;
+    bool initialized;
+    uint32_t certs;
+} tls_shared_t;
+
+static tls_shared_t tls;
+
+#if TLS_ARENA_SIZE > 0
+static uint8_t arena_buf[TLS_ARENA_SIZE];
+static tls_arena_t arena;
+static bool arena_ready;
+
+static void *arena_calloc(size_t n, size_t size) {
+    return tls_arena_calloc(&arena, n, size);
+}
+
+static void arena_free(void *ptr) {
+    tls_arena_free(&arena, ptr);
+}
+#endif
+
+/* Both profiles offer the same AEAD suites and differ only in preference:
+ * AES-GCM is the cheapest with hardware AES, ChaCha20-Poly1305 without it.
+ * Only ECDHE key exchanges are offered under TLS 1.2. */
+static const int aes_first_suites[] = {
+    MBEDTLS_TLS1_3_AES_128_GCM_SHA256,
+    MBEDTLS_TLS1_3_AES_256_GCM_SHA384,
+    MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    0
+};
+
+static const int chacha_first_suites[] = {
+    MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS1_3_AES_128_GCM_SHA256,
+    MBEDTLS_TLS1_3_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+};
+
+/* Pre-shared key suites in AES, ChaCha20-Poly1305 pairs. The TLS 1.3 ones
+ * are limited to SHA-256, the hash an external PSK is bound to; the TLS 1.2
+ * ones depend on whether the key exchange adds ECDHE. mbedTLS has no
+ * ECDHE-PSK suite with AES-GCM, so the forward-secret flavour falls back to
+ * AES-CBC with HMAC-SHA256 under TLS 1.2; plain PSK keeps AES-GCM. */
+static const int ecdhe_psk_suites[] = {
+    MBEDTLS_TLS1_3_AES_128_GCM_SHA256,
+    MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_PSK_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_PSK_WITH_CHACHA20_POLY1305_SHA256,
+    0
+};
+
+static const int psk_suites[] = {
+    MBEDTLS_TLS1_3_AES_128_GCM_SHA256,
+    MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_PSK_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_PSK_WITH_CHACHA20_POLY1305_SHA256,
+    0
+};
+
+static int psk_preference[sizeof(psk_suites) / sizeof(psk_suites[0])];
+
+static void mbedtls_debug_callback(void *ctx, int level, const char *file, int line, const char *str) {
+    ((void) ctx);
+    ((void) level);
+    net_log("%s:%04d: %s", file, line, str);
+}
+
+/* Set on the shared config because the TLS 1.3 client in mbedTLS 3.5
+ * ignores the per-connection callback. Called once per certificate of a
+ * chain the broker sends. */
+static int count_certificate(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags) {
+    ((void) ctx);
+    ((void) crt);
+    ((void) depth);
+    ((void) flags);
+    tls.certs++;
+    return 0;
+}
+
+static void log_error(const char *what, int ret) {
+    char error_buf[100];
+    mbedtls_strerror(ret, error_buf, sizeof(error_buf));
+    net_log("Network %s: -0x%x (%s)\n", what, -ret, error_buf);
+}
+
+static const char *setting(const char *env, const char *fallback) {
+    const char *value = getenv(env);
+    return value != NULL && value[0] != '\0' ? value : fallback;
+}
+
+/* IOT_GATEWAY_CA_FILE overrides the bundle compiled in with
+ * -DIOT_GATEWAY_CA_BUNDLE, which overrides TLS_CA_CERT_PATH. */
+static int load_ca_chain(void) {
+    const char *path = setting("IOT_GATEWAY_CA_FILE", NULL);
+    int ret;
+
+#if TLS_CA_EMBEDDED
+    if (path == NULL) {
+        if ((ret = mbedtls_x509_crt_parse(&tls.cacert, tls_ca_bundle, sizeof(tls_ca_bundle))) != 0) {
+            log_error("Failed to parse embedded CA bundle", ret);
+            return -1;
+        }
+        net_log("Network CA certificates loaded from embedded bundle\n");
+        return 0;
+    }
+#endif
+    if (path == NULL) {
+        path = TLS_CA_CERT_PATH;
+    }
+    net_log("Network Loading CA certificate from: %s\n", path);
+    if ((ret = mbedtls_x509_crt_parse_file(&tls.cacert, path)) != 0) {
+        log_error("Failed to parse CA certificate", ret);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_client_cert(void) {
+    const char *cert_path = setting("IOT_GATEWAY_CLIENT_CERT", TLS_CLIENT_CERT_PATH);
+    const char *key_path = setting("IOT_GATEWAY_CLIENT_KEY", TLS_CLIENT_KEY_PATH);
+    int ret;
+
+    if (cert_path[0] == '\0') {
+        return 0;
+    }
+    if ((ret = mbedtls_x509_crt_parse_file(&tls.client_cert, cert_path)) != 0) {
+        log_error("Failed to parse client certificate", ret);
+        return -1;
+    }
+    if ((ret = mbedtls_pk_parse_keyfile(&tls.client_key, key_path, NULL,
+                                        mbedtls_ctr_drbg_random, &tls.ctr_drbg)) != 0) {
+        log_error("Failed to parse client key", ret);
+        return -1;
+    }
+    net_log("Network Client certificate loaded from: %s\n", cert_path);
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* The provisioning file holds one "identity:hexkey" line, the format of
+ * mosquitto's psk_file, so the broker entry and the gateway file match.
+ * Returns 1 once a key is configured, 0 when none is provisioned. */
+static int load_psk(void) {
+    const char *path = setting("IOT_GATEWAY_PSK_FILE", TLS_PSK_FILE);
+    const char *mode = setting("IOT_GATEWAY_TLS_PSK", NULL);
+    unsigned char key[MBEDTLS_PSK_MAX_LEN];
+    char line[256];
+    size_t key_len = 0;
+    int ret = -1;
+
+    if (path[0] == '\0') {
+        return 0;
+    }
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        net_log("Network Failed to open PSK file: %s\n", path);
+        return -1;
+    }
+    char *hex = fgets(line, sizeof(line), file) != NULL ? strchr(line, ':') : NULL;
+    fclose(file);
+    if (hex == NULL || hex == line) {
+        net_log("Network PSK file %s must hold an identity:hexkey line\n", path);
+        goto cleanup;
+    }
+    *hex++ = '\0';
+    hex[strcspn(hex, "\r\n")] = '\0';
+    for (; hex[0] != '\0' && hex[1] != '\0' && key_len < sizeof(key); hex += 2) {
+        int high = hex_value(hex[0]);
+        int low = hex_value(hex[1]);
+        if (high < 0 || low < 0) {
+            break;
+        }
+        key[key_len++] = (unsigned char)(high << 4 | low);
+    }
+    if (hex[0] != '\0' || key_len == 0) {
+        net_log("Network PSK for %s must be 1 to %d bytes of hex\n", line, MBEDTLS_PSK_MAX_LEN);
+        goto cleanup;
+    }
+    if ((ret = mbedtls_ssl_conf_psk(&tls.conf, key, key_len, (const unsigned char *)line, strlen(line))) != 0) {
+        log_error("Failed to set PSK", ret);
+        ret = -1;
+        goto cleanup;
+    }
+
+    tls.psk = true;
+    tls.psk_ephemeral = mode != NULL ? strcmp(mode, "psk") != 0 : TLS_PSK_EPHEMERAL;
+    mbedtls_ssl_conf_tls13_key_exchange_modes(&tls.conf, tls.psk_ephemeral
+                                              ? MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK_EPHEMERAL
+                                              : MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK);
+    net_log("Network PSK identity %s loaded from %s (%s key exchange)\n", line, path,
+            tls.psk_ephemeral ? "ECDHE-PSK" : "PSK");
+    ret = 1;
+
+cleanup:
+    mbedtls_platform_zeroize(key, sizeof(key));
+    mbedtls_platform_zeroize(line, sizeof(line));
+    return ret;
+}
+
+static bool cpu_has_aes(void) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    return __builtin_cpu_supports("aes");
+#elif defined(__aarch64__) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    return false;
+#endif
+}
+
+/* IOT_GATEWAY_TLS_CIPHERS ("aes" or "chacha") overrides the CPU check. */
+static const int *select_ciphersuites(void) {
+    const char *profile = setting("IOT_GATEWAY_TLS_CIPHERS", NULL);
+    bool aes = profile != NULL ? strcmp(profile, "chacha") != 0 : cpu_has_aes();
+
+    const int *suites = aes ? aes_first_suites : chacha_first_suites;
+
+    if (tls.psk) {
+        const int *pairs = tls.psk_ephemeral ? ecdhe_psk_suites : psk_suites;
+        for (int i = 0; pairs[i] != 0; i += 2) {
+            psk_preference[i] = pairs[i + !aes];
+            psk_preference[i + 1] = pairs[i + aes];
+        }
+        suites = psk_preference;
+    }
+    net_log("Network TLS cipher preference: %s (%s)\n", aes ? "AES-GCM" : "ChaCha20-Poly1305",
+            profile != NULL ? "configured" : aes ? "CPU has AES instructions" : "no AES instructions");
+    return suites;
+}
+
+/* Asks the broker for records of at most TLS_MAX_FRAGMENT_LEN bytes, so
+ * MBEDTLS_SSL_IN_CONTENT_LEN can be lowered to match. mbedTLS only
+ * negotiates the extension under TLS 1.2, and its TLS 1.3 client rejects
+ * a broker that acknowledges it, so setting it caps the version at 1.2. */
+static int configure_record_limits(mbedtls_ssl_config *conf) {
+    unsigned char code;
+
+    switch (TLS_MAX_FRAGMENT_LEN) {
+    case 0:     code = MBEDTLS_SSL_MAX_FRAG_LEN_NONE; break;
+    case 512:   code = MBEDTLS_SSL_MAX_FRAG_LEN_512; break;
+    case 1024:  code = MBEDTLS_SSL_MAX_FRAG_LEN_1024; break;
+    case 2048:  code = MBEDTLS_SSL_MAX_FRAG_LEN_2048; break;
+    case 4096:  code = MBEDTLS_SSL_MAX_FRAG_LEN_4096; break;
+    default:
+        net_log("Network TLS_MAX_FRAGMENT_LEN must be 0, 512, 1024, 2048 or 4096\n");
+        return -1;
+    }
+    mbedtls_ssl_conf_max_tls_version(conf, code == MBEDTLS_SSL_MAX_FRAG_LEN_NONE ? MBEDTLS_SSL_VERSION_TLS1_3
+                                                                                   : MBEDTLS_SSL_VERSION_TLS1_2);
+    return mbedtls_ssl_conf_max_frag_len(conf, code);
+}
+
+/* Settings every client config shares. The ciphersuites, the PSK, the
+ * certificates and the TLS 1.3 key exchange modes are left to the caller. */
+static int configure(mbedtls_ssl_config *conf) {
+    int ret;
+
+    if ((ret = mbedtls_ssl_config_defaults(conf,
+                                           MBEDTLS_SSL_IS_CLIENT,
+                                           MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+        log_error("Failed to set SSL/TLS defaults", ret);
+        return -1;
+    }
+    mbedtls_ssl_conf_min_tls_version(conf, MBEDTLS_SSL_VERSION_TLS1_2);
+    if (configure_record_limits(conf) != 0) {
+        return -1;
+    }
+    mbedtls_ssl_conf_rng(conf, mbedtls_ctr_drbg_random, &tls.ctr_drbg);
+    mbedtls_ssl_conf_dbg(conf, mbedtls_debug_callback, NULL);
+    mbedtls_ssl_conf_read_timeout(conf, 10000);
+    return 0;
+}
+
+/* Verifies the broker against the CA chain and presents the client
+ * certificate, if one is loaded. */
+static int configure_certificates(mbedtls_ssl_config *conf) {
+    int ret;
+
+    mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    mbedtls_ssl_conf_ca_chain(conf, &tls.cacert, NULL);
+    mbedtls_ssl_conf_verify(conf, count_certificate, NULL);
+    if (mbedtls_pk_get_type(&tls.client_key) == MBEDTLS_PK_NONE) {
+        return 0;
+    }
+    if ((ret = mbedtls_ssl_conf_own_cert(conf, &tls.client_cert, &tls.client_key)) != 0) {
+        log_error("Failed to set client certificate", ret);
+        return -1;
+    }
+    return 0;
+}
+
+/* A TLS 1.3 resumption still runs ECDHE next to the ticket (psk_dhe_ke),
+ * which is most of a full handshake's client CPU. With TLS_RESUME_EPHEMERAL
+ * at 0 (or IOT_GATEWAY_TLS_RESUME=psk) resuming connections use a second
+ * config that offers the ticket alone (psk_ke) and sends no key share.
+ * Traffic of those sessions is then only as secret as the broker's ticket
+ * key, and brokers accept psk_ke only when configured to, e.g. OpenSSL with
+ * SSL_OP_ALLOW_NO_DHE_KEX. */
+static int configure_resumption(const int *suites) {
+    const char *mode = setting("IOT_GATEWAY_TLS_RESUME", NULL);
+
+    tls.resume_psk = mode != NULL ? strcmp(mode, "psk") == 0 : !TLS_RESUME_EPHEMERAL;
+    if (!tls.resume_psk) {
+        return 0;
+    }
+    if (configure(&tls.resume_conf) != 0 || configure_certificates(&tls.resume_conf) != 0) {
+        return -1;
+    }
+    mbedtls_ssl_conf_ciphersuites(&tls.resume_conf, suites);
+    mbedtls_ssl_conf_tls13_key_exchange_modes(&tls.resume_conf, MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK);
+    net_log("Network TLS 1.3 sessions are resumed without ECDHE (psk_ke)\n");
+    return 0;
+}
+
+static int setup_shared(void) {
+    const char *pers = "iot_gateway_client";
+    int ret;
+
+    /* TLS 1.3 runs its key schedule through PSA. */
+    if ((ret = psa_crypto_init()) != PSA_SUCCESS) {
+        net_log("Network Failed to initialize PSA crypto: %d\n", ret);
+        return -1;
+    }
+    if ((ret = mbedtls_ctr_drbg_seed(&tls.ctr_drbg, mbedtls_entropy_func,
+                                     &tls.entropy, (const unsigned char *) pers, strlen(pers))) != 0) {
+        log_error("Failed to seed the random number generator", ret);
+        return -1;
+    }
+    if (configure(&tls.conf) != 0) {
+        return -1;
+    }
+    mbedtls_debug_set_threshold(1); //debug level -> 0,1,2,3; higher number for more debug info
+
+    if (load_psk() < 0) {
+        return -1;
+    }
+    const int *suites = select_ciphersuites();
+    mbedtls_ssl_conf_ciphersuites(&tls.conf, suites);
+
+    /* The key authenticates both sides, so no certificate is exchanged or
+     * parsed. */
+    if (tls.psk) {
+        return 0;
+    }
+    if (load_ca_chain() != 0) {
+        return -1;
+    }
+    if (load_client_cert() != 0 || configure_certificates(&tls.conf) != 0) {
+        return -1;
+    }
+    return configure_resumption(suites);
+}
+
+static void free_shared(void) {
+    mbedtls_ssl_config_free(&tls.resume_conf);
+    tls.resume_psk = false;
+    mbedtls_ssl_config_free(&tls.conf);
+    mbedtls_pk_free(&tls.client_key);
+    mbedtls_x509_crt_free(&tls.client_cert);
+    mbedtls_x509_crt_free(&tls.cacert);
+    mbedtls_ctr_drbg_free(&tls.ctr_drbg);
+    mbedtls_entropy_free(&tls.entropy);
+    mbedtls_psa_crypto_free();
+    tls.psk = false;
+}
+
+/* Safe to call again after a failure, e.g. once the CA file exists. */
+int tls_init(void) {
+    if (tls.initialized) {
+        return 0;
+    }
+#if TLS_ARENA_SIZE > 0
+    /* Installed before the first allocation and kept for the life of the
+     * process, so nothing is ever freed to a different heap. */
+    if (!arena_ready) {
+        tls_arena_init(&arena, arena_buf, sizeof(arena_buf));
+        mbedtls_platform_set_calloc_free(arena_calloc, arena_free);
+        arena_ready = true;
+    }
+#endif
+    mbedtls_entropy_init(&tls.entropy);
+    mbedtls_ctr_drbg_init(&tls.ctr_drbg);
+    mbedtls_x509_crt_init(&tls.cacert);
+    mbedtls_x509_crt_init(&tls.client_cert);
+    mbedtls_pk_init(&tls.client_key);
+    mbedtls_ssl_config_init(&tls.conf);
+    mbedtls_ssl_config_init(&tls.resume_conf);
+    if (setup_shared() != 0) {
+        free_shared();
+        return -1;
+    }
+    tls.initialized = true;
+    net_log("Network TLS configuration ready\n");
+    return 0;
+}
+
+void tls_free(void) {
+    if (tls.initialized) {
+        free_shared();
+        tls.initialized = false;
+    }
+#if TLS_ARENA_SIZE > 0
+    if (arena.blocks != 0) {
+        net_log("Network TLS arena: %u blocks still allocated at shutdown\n", (unsigned int)arena.blocks);
+    }
+#endif
+}
+
+const mbedtls_ssl_config *tls_config(void) {
+    return &tls.conf;
+}
+
+const mbedtls_ssl_config *tls_resume_config(void) {
+    return tls.resume_psk ? &tls.resume_conf : &tls.conf;
+}
+
+bool tls_psk_enabled(void) {
+    return tls.psk;
+}
+
+size_t tls_memory_used(void) {
+#if TLS_ARENA_SIZE > 0
+    return arena.used;
+#else
+    return 0;
+#endif
+}
+
+void tls_memory_charge(size_t *owner) {
+#if TLS_ARENA_SIZE > 0
+    arena.owner = owner;
+#else
+    (void)owner;
+#endif
+}
+
+uint32_t tls_cert_count(void) {
+    return tls.certs;
+}
+
+uint32_t tls_alloc_count(void) {
+#if TLS_ARENA_SIZE > 0
+    return arena.allocs;
+#else
+    return 0;
+#endif
+}
+
+bool tls_memory_stats(tls_arena_stats_t *stats) {
+#if TLS_ARENA_SIZE > 0
+    tls_arena_stats(&arena, stats);
+    return true;
+#else
+    (void)stats;
+    return false;
+#endif
+}
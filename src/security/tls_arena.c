@@ -0,0 +1,122 @@
+#include <string.h>
+#include "tls_arena.h"
+
+#define ARENA_ALIGN 16
+
+struct tls_arena_block {
+    size_t size;                    /* whole block, header included */
+    union {
+        tls_arena_block_t *next;    /* next free block by address, while free */
+        size_t *owner;              /* charged counter or NULL, while allocated */
+    } u;
+};
+
+#define HEADER_SIZE ((sizeof(tls_arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define MIN_BLOCK   (HEADER_SIZE + ARENA_ALIGN)
+
+/* A buffer too small for a single block leaves the arena empty, so every
+ * allocation fails. */
+void tls_arena_init(tls_arena_t *arena, void *buf, size_t len) {
+    uintptr_t start = ((uintptr_t)buf + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+    size_t skip = start - (uintptr_t)buf;
+
+    memset(arena, 0, sizeof(*arena));
+    if (len < skip + MIN_BLOCK) {
+        return;
+    }
+    arena->base = (uint8_t *)start;
+    arena->size = (len - skip) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->free_list = (tls_arena_block_t *)arena->base;
+    arena->free_list->size = arena->size;
+    arena->free_list->u.next = NULL;
+}
+
+/* Zero-sized requests still get a unique block, as with libc calloc. */
+void *tls_arena_calloc(tls_arena_t *arena, size_t n, size_t size) {
+    if (size != 0 && n > (SIZE_MAX - MIN_BLOCK) / size) {
+        arena->failures++;
+        return NULL;
+    }
+    size_t len = n * size;
+    size_t need = HEADER_SIZE + (len == 0 ? ARENA_ALIGN : (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+
+    for (tls_arena_block_t **link = &arena->free_list; *link != NULL; link = &(*link)->u.next) {
+        tls_arena_block_t *block = *link;
+        if (block->size < need) {
+            continue;
+        }
+        if (block->size - need >= MIN_BLOCK) {
+            tls_arena_block_t *rest = (tls_arena_block_t *)((uint8_t *)block + need);
+            rest->size = block->size - need;
+            rest->u.next = block->u.next;
+            *link = rest;
+            block->size = need;
+        } else {
+            *link = block->u.next;
+        }
+        block->u.owner = arena->owner;
+        if (block->u.owner != NULL) {
+            *block->u.owner += block->size;
+        }
+        arena->used += block->size;
+        if (arena->used > arena->peak) {
+            arena->peak = arena->used;
+        }
+        arena->blocks++;
+        arena->allocs++;
+        uint8_t *ptr = (uint8_t *)block + HEADER_SIZE;
+        memset(ptr, 0, len);
+        return ptr;
+    }
+    arena->failures++;
+    return NULL;
+}
+
+void tls_arena_free(tls_arena_t *arena, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    tls_arena_block_t *block = (tls_arena_block_t *)((uint8_t *)ptr - HEADER_SIZE);
+    tls_arena_block_t *prev = NULL;
+    tls_arena_block_t *next = arena->free_list;
+
+    if (block->u.owner != NULL) {
+        *block->u.owner -= block->size;
+    }
+    arena->used -= block->size;
+    arena->blocks--;
+    while (next != NULL && next < block) {
+        prev = next;
+        next = next->u.next;
+    }
+    if (next != NULL && (uint8_t *)block + block->size == (uint8_t *)next) {
+        block->size += next->size;
+        block->u.next = next->u.next;
+    } else {
+        block->u.next = next;
+    }
+    if (prev == NULL) {
+        arena->free_list = block;
+    } else if ((uint8_t *)prev + prev->size == (uint8_t *)block) {
+        prev->size += block->size;
+        prev->u.next = block->u.next;
+    } else {
+        prev->u.next = block;
+    }
+}
+
+void tls_arena_stats(const tls_arena_t *arena, tls_arena_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->size = arena->size;
+    stats->used = arena->used;
+    stats->peak = arena->peak;
+    stats->blocks = arena->blocks;
+    stats->allocs = arena->allocs;
+    stats->failures = arena->failures;
+    for (const tls_arena_block_t *block = arena->free_list; block != NULL; block = block->u.next) {
+        if (block->size > stats->largest_free) {
+            stats->largest_free = block->size;
+        }
+        stats->free_blocks++;
+    }
+}
@@ -32,7 +32,7 @@ static uint8_t batch_count = 0;
 static TickType_t last_batch_time;
 
 static BaseType_t send_to_network_queue(const message_t *msg, TickType_t timeout) {
-    BaseType_t result = xQueueSend(xNetworkQueue, msg, timeout);
+    BaseType_t result = network_enqueue(msg, timeout);
     
     if (result != pdPASS) {
         UBaseType_t messages_waiting = uxQueueMessagesWaiting(xNetworkQueue);
@@ -41,7 +41,7 @@ static BaseType_t send_to_network_queue(const message_t *msg, TickType_t timeout
             if (msg->priority >= 2) {
                 message_t old_msg;
                 if (xQueueReceive(xNetworkQueue, &old_msg, 0) == pdPASS) {
-                    result = xQueueSend(xNetworkQueue, msg, 0);
+                    result = network_enqueue(msg, 0);
                     if (result == pdPASS) {
                         safe_printf("[DataProcessor] Dropped old message for high priority one\n");
                     }
@@ -152,7 +152,7 @@ static void process_sensor_data(const sensor_data_t *data) {
         immediate_msg.encrypted = false;
         immediate_msg.priority = (data->type == SENSOR_TYPE_MOTION) ? 3 : 2;
         
-        if (xQueueSend(xNetworkQueue, &immediate_msg, pdMS_TO_TICKS(100)) != pdPASS) {
+        if (network_enqueue(&immediate_msg, pdMS_TO_TICKS(100)) != pdPASS) {
             safe_printf("[DataProcessor] Failed to send high-priority message\n");
         } else {
             safe_printf("[DataProcessor] Sent immediate %s message\n", 
@@ -218,7 +218,7 @@ void vDataProcessorTask(void *pvParameters) {
         if (batch_count > 0 && 
             (xTaskGetTickCount() - last_batch_time) > pdMS_TO_TICKS(BATCH_TIMEOUT_MS)) {
             for (int i = 0; i < batch_count; i++) {
-                if (xQueueSend(xNetworkQueue, &batch_buffer[i], pdMS_TO_TICKS(50)) != pdPASS) {
+                if (network_enqueue(&batch_buffer[i], pdMS_TO_TICKS(50)) != pdPASS) {
                     safe_printf("[DataProcessor] Failed to send message %d/%d to network queue\n", 
                                i+1, batch_count);
                 }
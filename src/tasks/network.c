@@ -3,9 +3,6 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
 #include "FreeRTOS.h"
 #include "task.h"
 #include "queue.h"
@@ -13,32 +10,32 @@
 #include "event_groups.h"
 #include "config.h"
 #include "common.h"
+#include "mqtt.h"
+#include "net_metrics.h"
+#include "spsc_ring.h"
+#include "network_manager.h"
+#include "tls.h"
+#include "topic_trie.h"
 #include <errno.h>
-#include <fcntl.h>
-#include <sys/select.h>
-#include "mbedtls/net_sockets.h"
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include "mbedtls/ssl.h"
-#include "mbedtls/entropy.h"
-#include "mbedtls/ctr_drbg.h"
-#include "mbedtls/x509.h"
 #include "mbedtls/error.h"
-#include "mbedtls/debug.h"
-#include "mbedtls/timing.h"
-#define MQTT_PROTOCOL_LEVEL     4
-#define MQTT_CONNECT            0x10
-#define MQTT_CONNACK            0x20
-#define MQTT_PUBLISH            0x30
-#define MQTT_PUBACK             0x40
-#define MQTT_SUBSCRIBE          0x80
-#define MQTT_SUBACK             0x90
-#define MQTT_PINGREQ            0xC0
-#define MQTT_PINGRESP           0xD0
-#define MQTT_DISCONNECT         0xE0
-#define MQTT_QOS0               0x00
-#define MQTT_QOS1               0x02
-#define MQTT_RETAIN             0x01
 #define MQTT_KEEPALIVE_SEC      60
-#define MQTT_BUFFER_SIZE        1024
+#define MQTT_TOPIC_MAX_LEN      64
+#define SENSOR_TYPE_COUNT       3
+#define MQTT_PROPERTIES_MAX     16
+#define MQTT_PUBLISH_MAX_SIZE   (1 + 4 + 2 + MQTT_TOPIC_MAX_LEN + 2 + MQTT_PROPERTIES_MAX + MAX_MESSAGE_SIZE)
+#define MQTT_BULK_ROOM          (1 + 4 + 2 + MQTT_TOPIC_MAX_LEN + MQTT_PROPERTIES_MAX + MQTT_TX_DIRECT_MIN)
+#define NET_POLL_INTERVAL_MS    100
+#define NET_BRIDGE_POLL_TICKS   1
+#define NET_SHUTDOWN_FLUSH_MS   2000
+#define TOPIC_TABLE_SIZE        (NUM_TEMP_SENSORS + NUM_HUMIDITY_SENSORS + NUM_MOTION_SENSORS)
+#define MQTT_SUBSCRIBE_MAX_SIZE (1 + 4 + 2 + 1 + NET_MAX_SUBSCRIPTIONS * (2 + MQTT_TOPIC_MAX_LEN + 1))
+#define MQTT_ACK_MAX_SIZE       5
 
 
 typedef enum {
@@ -50,652 +47,1675 @@ typedef enum {
 } network_state_t;
 
 
+/* A QoS1 publish awaiting its PUBACK. first_sent_us is when it was first
+ * queued and drives expiry; sent_us is when the transmit buffer holding
+ * its latest copy was written out, or 0 while that copy is still waiting
+ * there, and drives the retry timer and the RTT. */
 typedef struct {
-    int socket_fd;
-    network_state_t state;
     uint16_t packet_id;
-    TickType_t last_ping_time;
-    uint8_t tx_buffer[MQTT_BUFFER_SIZE];
-    uint8_t rx_buffer[MQTT_BUFFER_SIZE];
-    mbedtls_ssl_context ssl_ctx;
-    mbedtls_ssl_config ssl_conf;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_x509_crt cacert;
+    uint8_t retries;
+    bool resend;
+    uint64_t sent_us;
+    uint64_t first_sent_us;
+    message_t msg;
+} inflight_entry_t;
+
+/* QoS1 messages awaiting PUBACK. A packet_id always lives in slot
+ * packet_id % MQTT_INFLIGHT_WINDOW, so lookups by id are a single index. */
+typedef struct {
+    inflight_entry_t slots[MQTT_INFLIGHT_WINDOW];
+    uint16_t count;
+    uint16_t next_id;
+} inflight_window_t;
+
+/* AIMD controller for the QoS1 window. Grows while PUBACKs come back close
+ * to the base RTT and halves (at most once per RTT) when queueing delay or
+ * total RTT exceeds the configured bounds, or when a retransmit fires. */
+typedef struct {
+    float cwnd;
+    float ssthresh;
+    uint32_t srtt_us;
+    uint32_t min_rtt_us;
+    uint64_t recovery_until_us;
+    uint32_t decreases;
+    uint32_t retransmits;
+    latency_hist_t rtt_hist;
+} window_ctrl_t;
+
+typedef struct {
+    uint32_t messages;
+    uint32_t records;
+    uint32_t aliased;
+    uint32_t rejected;
+    uint32_t expired;
+} tx_stats_t;
+
+typedef struct {
+    uint32_t oversized;
+    uint32_t dropped;
+} rx_stats_t;
+
+/* Limits the broker announced in an MQTT 5 CONNACK, reset to the protocol
+ * defaults for every connection. alias_sent marks the topic_table entries
+ * whose alias the broker has already seen on this connection. */
+typedef struct {
+    uint16_t receive_maximum;
+    uint16_t topic_alias_maximum;
+    uint8_t maximum_qos;
+    uint32_t maximum_packet_size;
+    bool alias_sent[TOPIC_TABLE_SIZE];
+} mqtt_peer_t;
+
+/* One MQTT session over one lane of the connection manager. Topics are
+ * striped across the sessions by hash, so each topic keeps its order while
+ * the sessions fill NET_STRIPE_COUNT TLS streams in parallel. queue and
+ * bulk hold the messages routed to this session until it can send them. */
+typedef struct {
+    int index;
+    tls_conn_t *conn;
+    network_state_t state;
+    uint8_t protocol_level;
+    bool session_present;
+    bool up;
+    mqtt_peer_t peer;
+    inflight_window_t inflight;
+    window_ctrl_t wnd;
+    uint32_t keepalive_sec;
+    uint64_t last_tx_us;
+    uint64_t last_rx_us;
+    uint64_t ping_sent_us;
+    uint8_t tx_buffer[MQTT_COALESCE_BUFFER_SIZE];
+    size_t tx_len;
+    size_t tx_off;
+    size_t tx_pending;
+    uint8_t *tx_direct;
+    size_t tx_direct_len;
+    size_t tx_direct_off;
+    size_t tx_direct_pending;
+    uint64_t tx_deadline_us;
+    uint32_t sock_events;
+    tx_stats_t tx_stats;
+    rx_stats_t rx_stats;
+    mqtt_rx_ring_t rx_ring;
+    spsc_ring_t queue;
+    spsc_ring_t bulk;
+    bool subscribe_pending;
+    uint16_t subscribe_id;
+    uint16_t rx_acks[MQTT_INFLIGHT_WINDOW];
+    uint16_t rx_ack_count;
+} mqtt_session_t;
+
+typedef struct {
+    mqtt_session_t sessions[NET_STRIPE_COUNT];
+    uint8_t protocol_level;
+    int sessions_up;
+    int epoll_fd;
+    int wake_fd;
 } mqtt_context_t;
 
+/* Topic name formatted once per sensor; NUL terminated so it can also be
+ * logged. */
+typedef struct {
+    uint16_t len;
+    uint8_t stripe;
+    char name[MQTT_TOPIC_MAX_LEN + 1];
+} mqtt_topic_t;
+
+/* A caller-built payload published at QoS 0. The payload comes from malloc()
+ * and is owned by the network task until it has been written. */
+typedef struct {
+    mqtt_topic_t topic;
+    uint8_t *payload;
+    uint32_t len;
+} net_bulk_t;
+
+typedef struct {
+    char filter[MQTT_TOPIC_MAX_LEN + 1];
+    uint16_t len;
+    uint8_t qos;
+    network_command_handler_t handler;
+    void *ctx;
+} net_subscription_t;
+
+/* An inbound publish on its way from the engine to the bridge task. subs
+ * has the bit of every subscription whose filter matched the topic. */
+typedef struct {
+    uint32_t subs;
+    uint16_t topic_len;
+    uint32_t payload_len;
+    char topic[MQTT_TOPIC_MAX_LEN + 1];
+    uint8_t payload[NET_COMMAND_MAX_PAYLOAD + 1];
+} net_command_t;
+
+/* Notifications from the engine thread to the FreeRTOS bridge task. Nothing
+ * wakes the bridge when one is pushed; it finds them on its next poll. */
+typedef enum {
+    NET_EVENT_MQTT_UP,
+    NET_EVENT_MQTT_DOWN
+} net_event_t;
+
 static mqtt_context_t mqtt_ctx;
+static message_t tx_ring_storage[NET_TX_RING_SIZE];
+static net_event_t event_ring_storage[NET_EVENT_RING_SIZE];
+static net_bulk_t bulk_ring_storage[NET_BULK_RING_SIZE];
+static message_t stripe_queue_storage[NET_STRIPE_COUNT][NET_TX_RING_SIZE];
+static net_bulk_t stripe_bulk_storage[NET_STRIPE_COUNT][NET_BULK_RING_SIZE];
+static spsc_ring_t tx_ring;
+static spsc_ring_t bulk_ring;
+static QueueHandle_t bulk_queue;
+static spsc_ring_t event_ring;
+static net_command_t command_ring_storage[NET_COMMAND_RING_SIZE];
+static spsc_ring_t command_ring;
+static topic_trie_t command_trie;
+static net_subscription_t subscriptions[NET_MAX_SUBSCRIPTIONS];
+static int subscription_count;
+static bool subscriptions_frozen;
+static int engine_stop;
+static uint32_t stats_seq;
+static network_stats_t stats_snapshot;
+static mqtt_topic_t topic_table[TOPIC_TABLE_SIZE];
+static const uint16_t topic_table_base[SENSOR_TYPE_COUNT] = {
+    0,
+    NUM_TEMP_SENSORS,
+    NUM_TEMP_SENSORS + NUM_HUMIDITY_SENSORS
+};
+static const uint16_t topic_table_count[SENSOR_TYPE_COUNT] = {
+    NUM_TEMP_SENSORS,
+    NUM_HUMIDITY_SENSORS,
+    NUM_MOTION_SENSORS
+};
 
-static int is_connection_alive(void) {
-    if (mqtt_ctx.socket_fd < 0) {
-        return 0;
-    }
-    int error = 0;
-    socklen_t len = sizeof(error);
-    int retval = getsockopt(mqtt_ctx.socket_fd, SOL_SOCKET, SO_ERROR, &error, &len);
-    
-    if (retval != 0) {
-        safe_printf("Network getsockopt failed: %s\n", strerror(errno));
-        return 0;
+static void net_sleep_ms(uint32_t ms) {
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
     }
-    
-    if (error != 0) {
-        safe_printf("Network Socket error detected: %s\n", strerror(error));
-        return 0;
+}
+
+static void post_event(net_event_t event) {
+    if (!spsc_ring_push(&event_ring, &event)) {
+        net_log("Network Event ring full, dropping event %d\n", (int)event);
     }
+}
 
-    fd_set readfds;
-    struct timeval tv = {0, 0};
-    FD_ZERO(&readfds);
-    FD_SET(mqtt_ctx.socket_fd, &readfds);
-    int sel = select(mqtt_ctx.socket_fd + 1, &readfds, NULL, NULL, &tv);
-    if (sel < 0 && errno != EINTR) {
-        safe_printf("Network Select failed in health check: %s\n", strerror(errno));
-        return 0;
+static const char *sensor_type_name(sensor_type_t type) {
+    switch (type) {
+        case SENSOR_TYPE_TEMPERATURE:
+            return "temperature";
+        case SENSOR_TYPE_HUMIDITY:
+            return "humidity";
+        case SENSOR_TYPE_MOTION:
+            return "motion";
+        default:
+            return "unknown";
     }
-    
-    return 1;
 }
 
-static void debug_certificate_verification(void) {
-    uint32_t flags = mbedtls_ssl_get_verify_result(&mqtt_ctx.ssl_ctx);
-    
-    if (flags != 0) {
-        char vrfy_buf[512];
-        safe_printf("Network Certificate verification flags: 0x%08x\n", flags);
-        
-        if (flags & MBEDTLS_X509_BADCERT_EXPIRED)
-            safe_printf("Network   - Certificate expired\n");
-        if (flags & MBEDTLS_X509_BADCERT_REVOKED)
-            safe_printf("Network   - Certificate revoked\n");
-        if (flags & MBEDTLS_X509_BADCERT_CN_MISMATCH)
-            safe_printf("Network   - CN mismatch (expected: %s)\n", MQTT_BROKER_ADDRESS);
-        if (flags & MBEDTLS_X509_BADCERT_NOT_TRUSTED)
-            safe_printf("Network   - Certificate not trusted\n");
-        if (flags & MBEDTLS_X509_BADCRL_NOT_TRUSTED)
-            safe_printf("Network   - CRL not trusted\n");
-        if (flags & MBEDTLS_X509_BADCRL_EXPIRED)
-            safe_printf("Network   - CRL expired\n");
-        if (flags & MBEDTLS_X509_BADCERT_OTHER)
-            safe_printf("Network   - Other certificate issue\n");
-        if (flags & MBEDTLS_X509_BADCERT_FUTURE)
-            safe_printf("Network   - Certificate validity starts in the future\n");
-        if (flags & MBEDTLS_X509_BADCRL_FUTURE)
-            safe_printf("Network   - CRL validity starts in the future\n");
-        if (flags & MBEDTLS_X509_BADCERT_KEY_USAGE)
-            safe_printf("Network   - Key usage violation\n");
-        if (flags & MBEDTLS_X509_BADCERT_EXT_KEY_USAGE)
-            safe_printf("Network   - Extended key usage violation\n");
-        if (flags & MBEDTLS_X509_BADCERT_NS_CERT_TYPE)
-            safe_printf("Network   - NS certificate type violation\n");
-        if (flags & MBEDTLS_X509_BADCERT_BAD_MD)
-            safe_printf("Network   - Bad message digest\n");
-        if (flags & MBEDTLS_X509_BADCERT_BAD_PK)
-            safe_printf("Network   - Bad public key\n");
-        if (flags & MBEDTLS_X509_BADCERT_BAD_KEY)
-            safe_printf("Network   - Bad key\n");
-        if (flags & MBEDTLS_X509_BADCRL_BAD_MD)
-            safe_printf("Network   - Bad CRL message digest\n");
-        if (flags & MBEDTLS_X509_BADCRL_BAD_PK)
-            safe_printf("Network   - Bad CRL public key\n");
-        if (flags & MBEDTLS_X509_BADCRL_BAD_KEY)
-            safe_printf("Network   - Bad CRL key\n");
-            
-        mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "  ! ", flags);
-        safe_printf("Network Full verification info:\n%s\n", vrfy_buf);
+/* FNV-1a over the topic name picks the session a topic is published on. */
+static uint8_t topic_stripe(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
     }
-    
-    const mbedtls_x509_crt *peer_cert = mbedtls_ssl_get_peer_cert(&mqtt_ctx.ssl_ctx);
-    if (peer_cert != NULL) {
-        char cert_buf[2048];
-        mbedtls_x509_crt_info(cert_buf, sizeof(cert_buf), "  ", peer_cert);
-        //safe_printf("Network Peer certificate:\n%s\n", cert_buf);
+    return (uint8_t)(hash % NET_STRIPE_COUNT);
+}
+
+static int encode_topic(mqtt_topic_t *topic, sensor_type_t type, uint8_t sensor_id) {
+    int len = snprintf(topic->name, sizeof(topic->name), "%s%s/sensor_%d",
+                       MQTT_TOPIC_BASE, sensor_type_name(type), sensor_id);
+    if (len < 0 || len > MQTT_TOPIC_MAX_LEN) {
+        topic->len = 0;
+        return -1;
     }
+    topic->len = (uint16_t)len;
+    topic->stripe = topic_stripe(topic->name, topic->len);
+    return 0;
 }
 
-static uint16_t mqtt_encode_length(uint8_t *buf, uint32_t length) {
-    uint16_t encoded_bytes = 0;
-    do {
-        uint8_t encoded_byte = length % 128;
-        length /= 128;
-        if (length > 0) {
-            encoded_byte |= 128;
-        }
-        buf[encoded_bytes++] = encoded_byte;
-    } while (length > 0);
-    return encoded_bytes;
-}
-
-static int mqtt_create_connect_packet(uint8_t *buf, size_t buf_size) {
-    uint8_t *ptr = buf;
-    uint16_t client_id_len = strlen(MQTT_CLIENT_ID);
-    *ptr++ = MQTT_CONNECT;
-    uint32_t remaining_length = 10 + 2 + client_id_len; 
-    ptr += mqtt_encode_length(ptr, remaining_length);
-    *ptr++ = 0x00;
-    *ptr++ = 0x04;
-    memcpy(ptr, "MQTT", 4);
-    ptr += 4;
-    *ptr++ = MQTT_PROTOCOL_LEVEL;
-    *ptr++ = 0x02;
-    *ptr++ = (MQTT_KEEPALIVE_SEC >> 8) & 0xFF;
-    *ptr++ = MQTT_KEEPALIVE_SEC & 0xFF;
-    *ptr++ = (client_id_len >> 8) & 0xFF;
-    *ptr++ = client_id_len & 0xFF;
-    memcpy(ptr, MQTT_CLIENT_ID, client_id_len);
-    ptr += client_id_len;
-    safe_printf("Network CONNECT packet created, size: %ld bytes\n", ptr - buf);
-    return ptr - buf;
-}
-
-
-static int mqtt_create_publish_packet(uint8_t *buf, size_t buf_size, 
-                                     const char *topic, const uint8_t *payload, 
-                                     size_t payload_len, uint8_t qos) {
-    uint8_t *ptr = buf;
-    uint16_t topic_len = strlen(topic);
-    uint16_t variable_header_len = 2 + topic_len;
-    
-    if (qos > 0) {
-        variable_header_len += 2; 
+static void init_topic_table(void) {
+    for (int type = 0; type < SENSOR_TYPE_COUNT; type++) {
+        for (uint16_t id = 0; id < topic_table_count[type]; id++) {
+            if (encode_topic(&topic_table[topic_table_base[type] + id], (sensor_type_t)type, id) != 0) {
+                net_log("Network Topic for %s sensor %u exceeds %d bytes\n",
+                            sensor_type_name((sensor_type_t)type), id, MQTT_TOPIC_MAX_LEN);
+            }
+        }
     }
+}
 
-    *ptr++ = MQTT_PUBLISH | (qos << 1);
-    ptr += mqtt_encode_length(ptr, variable_header_len + payload_len);
-    *ptr++ = (topic_len >> 8) & 0xFF;
-    *ptr++ = topic_len & 0xFF;
-    memcpy(ptr, topic, topic_len);
-    ptr += topic_len;
-    
-    if (qos > 0) {
-        mqtt_ctx.packet_id++;
-        *ptr++ = (mqtt_ctx.packet_id >> 8) & 0xFF;
-        *ptr++ = mqtt_ctx.packet_id & 0xFF;
+static const mqtt_topic_t *lookup_topic(sensor_type_t type, uint8_t sensor_id, mqtt_topic_t *scratch) {
+    if ((unsigned)type < SENSOR_TYPE_COUNT && sensor_id < topic_table_count[type]) {
+        const mqtt_topic_t *topic = &topic_table[topic_table_base[type] + sensor_id];
+        if (topic->len > 0) {
+            return topic;
+        }
     }
-    
-    memcpy(ptr, payload, payload_len);
-    ptr += payload_len;
-    return ptr - buf;
+    return encode_topic(scratch, type, sensor_id) == 0 ? scratch : NULL;
 }
 
+static bool mqtt_v5(const mqtt_session_t *session) {
+    return session->protocol_level == MQTT_PROTOCOL_LEVEL_5;
+}
 
-static int mqtt_create_ping_packet(uint8_t *buf) {
-    buf[0] = MQTT_PINGREQ;
-    buf[1] = 0x00;
-    return 2;
+static void peer_reset(mqtt_peer_t *peer) {
+    memset(peer, 0, sizeof(*peer));
+    peer->receive_maximum = UINT16_MAX;
+    peer->maximum_qos = MQTT_QOS2;
 }
 
+static void peer_apply(mqtt_peer_t *peer, const mqtt_properties_t *props) {
+    if (props->present & MQTT_HAS_RECEIVE_MAXIMUM) {
+        peer->receive_maximum = props->receive_maximum;
+    }
+    if (props->present & MQTT_HAS_TOPIC_ALIAS_MAXIMUM) {
+        peer->topic_alias_maximum = props->topic_alias_maximum;
+    }
+    if (props->present & MQTT_HAS_MAXIMUM_QOS) {
+        peer->maximum_qos = props->maximum_qos;
+    }
+    if (props->present & MQTT_HAS_MAXIMUM_PACKET_SIZE) {
+        peer->maximum_packet_size = props->maximum_packet_size;
+    }
+}
 
-static void mbedtls_debug_callback(void *ctx, int level, const char *file, int line, const char *str) {
-    ((void) level);
-    safe_printf("%s:%04d: %s", file, line, str);
+/* Every session needs its own client id, or the broker would take each
+ * CONNECT over the others; the first keeps MQTT_CLIENT_ID unchanged. */
+static int encode_connect(mqtt_session_t *session, uint8_t *buf, size_t size) {
+    mqtt_connect_t connect;
+    mqtt_properties_t props;
+    char client_id[64];
+    int id_len = session->index == 0 ?
+                 snprintf(client_id, sizeof(client_id), "%s", MQTT_CLIENT_ID) :
+                 snprintf(client_id, sizeof(client_id), "%s-%d", MQTT_CLIENT_ID, session->index);
+    memset(&connect, 0, sizeof(connect));
+    memset(&props, 0, sizeof(props));
+    props.present = MQTT_HAS_RECEIVE_MAXIMUM | MQTT_HAS_MAXIMUM_PACKET_SIZE;
+    props.receive_maximum = MQTT_INFLIGHT_WINDOW;
+    props.maximum_packet_size = MQTT_RX_RING_SIZE;
+    if (MQTT_PERSISTENT_SESSION) {
+        props.present |= MQTT_HAS_SESSION_EXPIRY;
+        props.session_expiry = MQTT_SESSION_EXPIRY_SEC;
+    }
+    connect.protocol_level = session->protocol_level;
+    connect.properties = &props;
+    connect.client_id.data = (const uint8_t *)client_id;
+    connect.client_id.len = (uint16_t)id_len;
+    connect.clean_session = !MQTT_PERSISTENT_SESSION;
+    connect.keepalive_sec = MQTT_KEEPALIVE_SEC;
+    return mqtt_encode_connect(buf, size, &connect);
 }
 
 
-static int my_mbedtls_send(void *ctx, const unsigned char *buf, size_t len) {
-    int fd = *(int *)ctx;
-    int ret = send(fd, buf, len, 0);
-    if (ret < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            return MBEDTLS_ERR_SSL_WANT_WRITE;
+static void inflight_init(inflight_window_t *win) {
+    memset(win, 0, sizeof(*win));
+    win->next_id = 1;
+}
+
+static uint16_t inflight_acquire(inflight_window_t *win, const message_t *msg) {
+    if (win->count >= MQTT_INFLIGHT_WINDOW) {
+        return 0;
+    }
+    for (;;) {
+        uint16_t id = win->next_id++;
+        if (win->next_id == 0) {
+            win->next_id = 1;
+        }
+        inflight_entry_t *slot = &win->slots[id % MQTT_INFLIGHT_WINDOW];
+        if (slot->packet_id == 0) {
+            slot->packet_id = id;
+            slot->retries = 0;
+            slot->resend = false;
+            slot->first_sent_us = get_time_us();
+            slot->sent_us = 0;
+            slot->msg = *msg;
+            win->count++;
+            return id;
         }
-        return -1;
     }
-    return ret;
 }
 
-static int my_mbedtls_recv(void *ctx, unsigned char *buf, size_t len) {
-    int fd = *(int *)ctx;
-    int ret = recv(fd, buf, len, 0);
-    if (ret < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            return MBEDTLS_ERR_SSL_WANT_READ;
+/* A packet id for something other than a QoS1 publish, such as a
+ * SUBSCRIBE, that must not clash with the ids in flight. */
+static uint16_t inflight_reserve_id(inflight_window_t *win) {
+    for (;;) {
+        uint16_t id = win->next_id++;
+        if (win->next_id == 0) {
+            win->next_id = 1;
+        }
+        if (win->slots[id % MQTT_INFLIGHT_WINDOW].packet_id != id) {
+            return id;
         }
-        return -1;
     }
-    return ret;
 }
 
-static int init_mbedtls(void) {
-    int ret;
-    const char *pers = "iot_gateway_client";
-    mbedtls_ssl_init(&mqtt_ctx.ssl_ctx);
-    mbedtls_ssl_config_init(&mqtt_ctx.ssl_conf);
-    mbedtls_entropy_init(&mqtt_ctx.entropy);
-    mbedtls_ctr_drbg_init(&mqtt_ctx.ctr_drbg);
-    mbedtls_x509_crt_init(&mqtt_ctx.cacert);
-    
-    if ((ret = mbedtls_ctr_drbg_seed(&mqtt_ctx.ctr_drbg, mbedtls_entropy_func, 
-                                     &mqtt_ctx.entropy, (const unsigned char *) pers, strlen(pers))) != 0) {
-        safe_printf("Network Failed to seed the random number generator: -0x%x\n", -ret);
-        return -1;
+static inflight_entry_t *inflight_find(inflight_window_t *win, uint16_t packet_id) {
+    inflight_entry_t *slot = &win->slots[packet_id % MQTT_INFLIGHT_WINDOW];
+    if (packet_id == 0 || slot->packet_id != packet_id) {
+        return NULL;
     }
+    return slot;
+}
 
-    const char *ca_cert_path = "/home/stickman/Real-Time-IoT-Simulator/mosquitto.org.crt";
+static void inflight_release(inflight_window_t *win, inflight_entry_t *slot) {
+    slot->packet_id = 0;
+    win->count--;
+}
 
-    if (access(ca_cert_path, R_OK) != 0) {
-        safe_printf("Network CA certificate file not found, trying alternative...\n");
-        ca_cert_path = "/home/stickman/Real-Time-IoT-Simulator/lets-encrypt-r3.pem";
-        if (access(ca_cert_path, R_OK) != 0) {
-            safe_printf("Network No CA certificate file found\n");
-            return -1;
+/* Called once the transmit buffer has been written out: every publish that
+ * was waiting in it, coalesced or retransmitted, left at now_us. */
+static void inflight_mark_sent(inflight_window_t *win, uint64_t now_us) {
+    for (int i = 0, seen = 0; i < MQTT_INFLIGHT_WINDOW && seen < win->count; i++) {
+        inflight_entry_t *slot = &win->slots[i];
+        if (slot->packet_id != 0) {
+            seen++;
+            if (slot->sent_us == 0) {
+                slot->sent_us = now_us;
+            }
         }
     }
-    
-    safe_printf("Network Loading CA certificate from: %s\n", ca_cert_path);
-    if ((ret = mbedtls_x509_crt_parse_file(&mqtt_ctx.cacert, ca_cert_path)) != 0) {
-        char error_buf[100];
-        mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-        safe_printf("Network Failed to parse CA certificate: -0x%x (%s)\n", -ret, error_buf);
-        return -1;
+}
+
+static void window_ctrl_init(window_ctrl_t *wnd) {
+    memset(wnd, 0, sizeof(*wnd));
+    wnd->cwnd = MQTT_INFLIGHT_INITIAL_WINDOW;
+    wnd->ssthresh = MQTT_INFLIGHT_WINDOW;
+}
+
+static uint16_t window_ctrl_size(const window_ctrl_t *wnd) {
+    return (uint16_t)wnd->cwnd;
+}
+
+static void window_ctrl_decrease(window_ctrl_t *wnd, uint64_t now_us, float new_cwnd) {
+    if (now_us < wnd->recovery_until_us) {
+        return;
     }
-    
-    safe_printf("Network CA certificate loaded successfully\n");
-    if ((ret = mbedtls_ssl_config_defaults(&mqtt_ctx.ssl_conf,
-                                          MBEDTLS_SSL_IS_CLIENT,
-                                          MBEDTLS_SSL_TRANSPORT_STREAM,
-                                          MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
-        safe_printf("Network Failed to set SSL/TLS defaults: -0x%x\n", -ret);
-        return -1;
+    wnd->ssthresh = wnd->cwnd / 2;
+    if (wnd->ssthresh < MQTT_INFLIGHT_MIN_WINDOW) {
+        wnd->ssthresh = MQTT_INFLIGHT_MIN_WINDOW;
     }
-    
-    mbedtls_ssl_conf_rng(&mqtt_ctx.ssl_conf, mbedtls_ctr_drbg_random, &mqtt_ctx.ctr_drbg);
-    mbedtls_ssl_conf_dbg(&mqtt_ctx.ssl_conf, mbedtls_debug_callback, NULL);
-    
-    mbedtls_debug_set_threshold(1); //debug level -> 0,1,2,3; higher number for more debug info
-    
-    mbedtls_ssl_conf_authmode(&mqtt_ctx.ssl_conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
-    mbedtls_ssl_conf_ca_chain(&mqtt_ctx.ssl_conf, &mqtt_ctx.cacert, NULL);
-    mbedtls_ssl_conf_read_timeout(&mqtt_ctx.ssl_conf, 10000);
-    if ((ret = mbedtls_ssl_setup(&mqtt_ctx.ssl_ctx, &mqtt_ctx.ssl_conf)) != 0) {
-        safe_printf("Network Failed to set up SSL context: -0x%x\n", -ret);
-        return -1;
+    wnd->cwnd = new_cwnd < MQTT_INFLIGHT_MIN_WINDOW ? MQTT_INFLIGHT_MIN_WINDOW : new_cwnd;
+    wnd->recovery_until_us = now_us + wnd->srtt_us;
+    wnd->decreases++;
+}
+
+static void window_ctrl_on_ack(window_ctrl_t *wnd, uint32_t rtt_us, uint64_t now_us) {
+    latency_hist_record(&wnd->rtt_hist, rtt_us);
+    if (wnd->min_rtt_us == 0 || rtt_us < wnd->min_rtt_us) {
+        wnd->min_rtt_us = rtt_us;
     }
+    wnd->srtt_us = wnd->srtt_us == 0 ? rtt_us : (7 * wnd->srtt_us + rtt_us) / 8;
 
-    if ((ret = mbedtls_ssl_set_hostname(&mqtt_ctx.ssl_ctx, MQTT_BROKER_ADDRESS)) != 0) {
-        safe_printf("Network Failed to set hostname: -0x%x\n", -ret);
-        return -1;
+    if (rtt_us > MQTT_RTT_LIMIT_MS * 1000U ||
+        rtt_us - wnd->min_rtt_us > MQTT_RTT_QUEUE_DELAY_MS * 1000U) {
+        window_ctrl_decrease(wnd, now_us, wnd->cwnd / 2);
+        return;
+    }
+    if (wnd->cwnd < wnd->ssthresh) {
+        wnd->cwnd += 1.0f;
+    } else {
+        wnd->cwnd += 1.0f / wnd->cwnd;
+    }
+    if (wnd->cwnd > MQTT_INFLIGHT_WINDOW) {
+        wnd->cwnd = MQTT_INFLIGHT_WINDOW;
     }
-    
-    return 0;
 }
 
+static void window_ctrl_on_timeout(window_ctrl_t *wnd, uint64_t now_us) {
+    wnd->retransmits++;
+    window_ctrl_decrease(wnd, now_us, MQTT_INFLIGHT_MIN_WINDOW);
+}
 
-static int init_tls_connection(void) {
-    int ret;
-    
-    if (init_mbedtls() != 0) {
-        safe_printf("Network Failed to initialize mbedTLS\n");
-        return -1;
+/* The engine thread publishes a copy of its counters under a sequence
+ * lock; readers on the FreeRTOS side retry until they see an even, unchanged
+ * sequence number, so neither side ever blocks the other. */
+static void publish_stats(void) {
+    network_stats_t *stats = &stats_snapshot;
+    static latency_hist_t rtt_hist;
+    uint64_t srtt_sum = 0;
+    uint32_t srtt_count = 0;
+    uint32_t seq = __atomic_load_n(&stats_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(stats, 0, sizeof(*stats));
+    latency_hist_reset(&rtt_hist);
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        const mqtt_session_t *session = &mqtt_ctx.sessions[i];
+        stats->window += window_ctrl_size(&session->wnd);
+        stats->inflight += session->inflight.count;
+        if (session->wnd.min_rtt_us != 0 &&
+            (stats->rtt_min_us == 0 || session->wnd.min_rtt_us < stats->rtt_min_us)) {
+            stats->rtt_min_us = session->wnd.min_rtt_us;
+        }
+        if (session->wnd.srtt_us != 0) {
+            srtt_sum += session->wnd.srtt_us;
+            srtt_count++;
+        }
+        latency_hist_merge(&rtt_hist, &session->wnd.rtt_hist);
+        stats->retransmits += session->wnd.retransmits;
+        stats->window_decreases += session->wnd.decreases;
+        stats->tx_messages += session->tx_stats.messages;
+        stats->tx_records += session->tx_stats.records;
+        stats->tx_aliased += session->tx_stats.aliased;
+        stats->tx_rejected += session->tx_stats.rejected;
+        stats->tx_expired += session->tx_stats.expired;
+        stats->rx_oversized += session->rx_stats.oversized;
+        stats->rx_dropped += session->rx_stats.dropped;
     }
-    
-    mqtt_ctx.socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (mqtt_ctx.socket_fd < 0) {
-        safe_printf("Network Failed to create socket\n");
-        return -1;
+    stats->rtt_samples = rtt_hist.count;
+    stats->rtt_srtt_us = srtt_count > 0 ? (uint32_t)(srtt_sum / srtt_count) : 0;
+    stats->rtt_p50_us = latency_hist_percentile(&rtt_hist, 50);
+    stats->rtt_p90_us = latency_hist_percentile(&rtt_hist, 90);
+    stats->rtt_p99_us = latency_hist_percentile(&rtt_hist, 99);
+    stats->protocol_level = mqtt_ctx.protocol_level;
+    stats->sessions = NET_STRIPE_COUNT;
+    stats->sessions_up = (uint8_t)mqtt_ctx.sessions_up;
+    netmgr_get_io(&stats->tx_syscalls, &stats->tx_wire_bytes);
+    const netmgr_handshakes_t *hs = netmgr_get_handshakes();
+    stats->tls_full = hs->full.count;
+    stats->tls_full_p50_us = latency_hist_percentile(&hs->full, 50);
+    stats->tls_full_p99_us = latency_hist_percentile(&hs->full, 99);
+    if (hs->full.count > 0) {
+        stats->tls_full_cpu_us = (uint32_t)(hs->full_cpu_us / hs->full.count);
+        stats->tls_full_allocs = (uint32_t)(hs->full_allocs / hs->full.count);
     }
-    
-    int flags = fcntl(mqtt_ctx.socket_fd, F_GETFL, 0);
-    fcntl(mqtt_ctx.socket_fd, F_SETFL, flags | O_NONBLOCK);
-    
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    if (getaddrinfo(MQTT_BROKER_ADDRESS, NULL, &hints, &res) != 0) {
-        safe_printf("Network Failed to resolve hostname\n");
-        close(mqtt_ctx.socket_fd);
-        return -1;
+    stats->tls_resumed = hs->resumed.count;
+    stats->tls_resumed_p50_us = latency_hist_percentile(&hs->resumed, 50);
+    stats->tls_resumed_p99_us = latency_hist_percentile(&hs->resumed, 99);
+    if (hs->resumed.count > 0) {
+        stats->tls_resumed_cpu_us = (uint32_t)(hs->resumed_cpu_us / hs->resumed.count);
+        stats->tls_resumed_allocs = (uint32_t)(hs->resumed_allocs / hs->resumed.count);
+    }
+    tls_arena_stats_t mem;
+    if (tls_memory_stats(&mem)) {
+        stats->tls_arena_size = (uint32_t)mem.size;
+        stats->tls_arena_used = (uint32_t)mem.used;
+        stats->tls_arena_peak = (uint32_t)mem.peak;
+        stats->tls_arena_largest_free = (uint32_t)mem.largest_free;
+        stats->tls_arena_failures = mem.failures;
+    }
+    int conns;
+    stats->tls_conn_memory = (uint32_t)netmgr_tls_memory(&conns);
+    stats->tls_conns = (uint8_t)conns;
+    __atomic_store_n(&stats_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void network_get_stats(network_stats_t *stats) {
+    uint32_t seq;
+    do {
+        seq = __atomic_load_n(&stats_seq, __ATOMIC_ACQUIRE);
+        memcpy(stats, &stats_snapshot, sizeof(*stats));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) != 0 || seq != __atomic_load_n(&stats_seq, __ATOMIC_RELAXED));
+}
+
+/* Outgoing packets are appended to tx_buffer and written with a single
+ * mbedtls_ssl_write() per flush, so a burst of publishes shares one TLS
+ * record and one send() instead of paying for both per message. */
+static uint8_t *tx_reserve(mqtt_session_t *session, size_t *avail) {
+    *avail = session->tx_direct != NULL ? 0 : MQTT_COALESCE_BUFFER_SIZE - session->tx_len;
+    return session->tx_buffer + session->tx_len;
+}
+
+static void tx_commit(mqtt_session_t *session, size_t len, bool urgent) {
+    uint64_t now_us = get_time_us();
+    session->tx_len += len;
+    if (urgent || !MQTT_COALESCE_ENABLE) {
+        session->tx_deadline_us = now_us;
+    } else if (session->tx_deadline_us == 0) {
+        session->tx_deadline_us = now_us + MQTT_COALESCE_DEADLINE_MS * 1000ULL;
     }
+}
 
-    struct sockaddr_in *server_addr_ptr = (struct sockaddr_in *)res->ai_addr;
-    server_addr_ptr->sin_port = htons(MQTT_BROKER_PORT);
-    safe_printf("Network Connecting to %s:%d (TLS mode)\n", MQTT_BROKER_ADDRESS, MQTT_BROKER_PORT);
-    
-    int connect_res = connect(mqtt_ctx.socket_fd, (struct sockaddr *)server_addr_ptr, sizeof(*server_addr_ptr));
-    
-    if (connect_res < 0) {
-        if (errno == EINPROGRESS) {
-            fd_set writefds;
-            struct timeval timeout;
-            int sel;
-            do {
-                FD_ZERO(&writefds);
-                FD_SET(mqtt_ctx.socket_fd, &writefds);
-                timeout.tv_sec = 10;
-                timeout.tv_usec = 0;
-                
-                sel = select(mqtt_ctx.socket_fd + 1, NULL, &writefds, NULL, &timeout);
-            } while (sel < 0 && errno == EINTR);
-            if (sel > 0 && FD_ISSET(mqtt_ctx.socket_fd, &writefds)) {
-                int optval;
-                socklen_t optlen = sizeof(optval);
-                if (getsockopt(mqtt_ctx.socket_fd, SOL_SOCKET, SO_ERROR, &optval, &optlen) == 0 && optval == 0) {
-                    connect_res = 0;  
-                } else {
-                    safe_printf("Network Connection failed: %s\n", strerror(optval));
-                    connect_res = -1;
-                }
-            } else if (sel == 0) {
-                safe_printf("Network Connection timeout\n");
-                connect_res = -1;
-            } else {
-                safe_printf("Network Select error: %s\n", strerror(errno));
-                connect_res = -1;
-            }
+static void tx_reset(mqtt_session_t *session) {
+    session->tx_len = 0;
+    session->tx_off = 0;
+    session->tx_pending = 0;
+    session->tx_deadline_us = 0;
+    free(session->tx_direct);
+    session->tx_direct = NULL;
+    session->tx_direct_len = 0;
+    session->tx_direct_off = 0;
+    session->tx_direct_pending = 0;
+}
+
+/* Large payloads skip tx_buffer: once the buffered bytes (which end with the
+ * payload's header) are written, the payload goes to mbedtls_ssl_write()
+ * straight from its own buffer. Nothing more is buffered until it is done. */
+static void tx_attach_direct(mqtt_session_t *session, uint8_t *payload, size_t len) {
+    session->tx_direct = payload;
+    session->tx_direct_len = len;
+    session->tx_direct_off = 0;
+    session->tx_direct_pending = 0;
+}
+
+static bool tx_blocked(mqtt_session_t *session) {
+    return session->tx_pending != 0 || session->tx_direct_pending != 0;
+}
+
+static int tx_write(mqtt_session_t *session, const uint8_t *data, size_t len, size_t *off, size_t *pending,
+                    bool more) {
+    while (*off < len) {
+        size_t chunk = *pending ? *pending : len - *off;
+        int ret = netmgr_write(session->conn, data + *off, chunk, more);
+        if (ret > 0) {
+            *off += ret;
+            *pending = 0;
+            session->tx_stats.records++;
+            session->last_tx_us = get_time_us();
+        } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            *pending = chunk;
+            return 1;
+        } else if (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) {
+            /* A ticket read earlier is processed first; nothing was sent. */
+            *pending = chunk;
+            netmgr_session_ticket(session->conn);
         } else {
-            safe_printf("Network Connect error: %s\n", strerror(errno));
-            connect_res = -1;
+            char error_buf[100];
+            mbedtls_strerror(ret, error_buf, sizeof(error_buf));
+            net_log("Network Failed to send packet: -0x%x (%s)\n", -ret, error_buf);
+            return -1;
         }
     }
+    return 0;
+}
 
-    freeaddrinfo(res);
-    
-    if (connect_res < 0) {
-        close(mqtt_ctx.socket_fd);
-        return -1;
+/* Writes as much as the socket takes without blocking. Returns 0 once
+ * everything is written, 1 if the socket is full (the same chunk must be
+ * retried once it is writable, as mbedTLS requires), or -1 on error. */
+static int tx_flush(mqtt_session_t *session) {
+    int ret = tx_write(session, session->tx_buffer, session->tx_len, &session->tx_off, &session->tx_pending,
+                       session->tx_direct != NULL);
+    if (ret == 0 && session->tx_direct != NULL) {
+        ret = tx_write(session, session->tx_direct, session->tx_direct_len,
+                       &session->tx_direct_off, &session->tx_direct_pending, false);
     }
-    
-    safe_printf("Network TCP connection established\n");
-    mbedtls_ssl_set_bio(&mqtt_ctx.ssl_ctx, &mqtt_ctx.socket_fd, 
-                        my_mbedtls_send, my_mbedtls_recv, NULL);
-    
-    safe_printf("Network Starting SSL handshake...\n");
-    int handshake_attempts = 0;
-    const int max_attempts = 50;
-
-    while ((ret = mbedtls_ssl_handshake(&mqtt_ctx.ssl_ctx)) != 0) {
-        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            handshake_attempts++;
-            if (handshake_attempts > max_attempts) {
-                safe_printf("Network SSL handshake timeout\n");
-                close(mqtt_ctx.socket_fd);
-                return -1;
+    if (ret == 0) {
+        tx_reset(session);
+        inflight_mark_sent(&session->inflight, get_time_us());
+    }
+    return ret;
+}
+
+/* Only for shutdown, when there is no engine loop left to wait in: blocks
+ * on the socket becoming writable until everything is sent or the timeout
+ * expires. */
+static int tx_flush_wait(mqtt_session_t *session, int timeout_ms) {
+    uint64_t deadline_us = get_time_us() + timeout_ms * 1000ULL;
+    int ret;
+    while ((ret = tx_flush(session)) == 1) {
+        uint64_t now_us = get_time_us();
+        if (now_us >= deadline_us) {
+            net_log("Network Send timeout\n");
+            return -1;
+        }
+        struct pollfd pfd = { .fd = session->conn->fd, .events = POLLOUT };
+        poll(&pfd, 1, (int)((deadline_us - now_us + 999) / 1000));
+    }
+    return ret;
+}
+
+/* Returns 0 once at least `need` bytes are free, 1 if that needs the socket
+ * to drain first, or -1 on error. */
+static int tx_make_room(mqtt_session_t *session, size_t need) {
+    size_t avail;
+    tx_reserve(session, &avail);
+    if (avail >= need) {
+        return 0;
+    }
+    int ret = tx_flush(session);
+    if (ret != 0) {
+        return ret;
+    }
+    tx_reserve(session, &avail);
+    return avail >= need ? 0 : -1;
+}
+
+/* Fills in the MQTT 5 properties of a publish. Topics from topic_table get
+ * the alias of their table slot while the broker allows that many; after
+ * the first use on a connection the topic itself is left out. Returns true
+ * if the alias replaces the topic. */
+static bool publish_properties(mqtt_session_t *session, mqtt_properties_t *props, const mqtt_topic_t *topic, uint32_t expiry_sec) {
+    memset(props, 0, sizeof(*props));
+    if (expiry_sec > 0) {
+        props->present |= MQTT_HAS_MESSAGE_EXPIRY;
+        props->message_expiry = expiry_sec;
+    }
+    if (!MQTT_TOPIC_ALIAS_ENABLE || topic < topic_table || topic >= topic_table + TOPIC_TABLE_SIZE) {
+        return false;
+    }
+    size_t index = (size_t)(topic - topic_table);
+    if (index >= session->peer.topic_alias_maximum) {
+        return false;
+    }
+    props->present |= MQTT_HAS_TOPIC_ALIAS;
+    props->topic_alias = (uint16_t)(index + 1);
+    return session->peer.alias_sent[index];
+}
+
+static void mark_alias_sent(mqtt_session_t *session, const mqtt_properties_t *props) {
+    if (props->present & MQTT_HAS_TOPIC_ALIAS) {
+        session->peer.alias_sent[props->topic_alias - 1] = true;
+    }
+}
+
+/* Seconds left of MQTT_MESSAGE_EXPIRY_SEC for a message first sent at
+ * first_sent_us, 0 once it has expired. */
+static uint32_t expiry_remaining(uint64_t first_sent_us, uint64_t now_us) {
+    uint64_t age_sec = (now_us - first_sent_us) / 1000000ULL;
+    return age_sec < MQTT_MESSAGE_EXPIRY_SEC ? (uint32_t)(MQTT_MESSAGE_EXPIRY_SEC - age_sec) : 0;
+}
+
+/* Returns the packet size on success, 0 if the message cannot be encoded
+ * and was dropped, or -1 if the send failed. The caller makes room for
+ * MQTT_PUBLISH_MAX_SIZE bytes first. expiry_sec is only sent over MQTT 5. */
+static int publish_message(mqtt_session_t *session, const message_t *msg, uint8_t qos, uint16_t packet_id, bool dup,
+                           uint32_t expiry_sec) {
+    mqtt_topic_t topic_scratch;
+    char payload[MAX_MESSAGE_SIZE];
+    const char *sensor_type_str = sensor_type_name(msg->data.type);
+    const mqtt_topic_t *topic = lookup_topic(msg->data.type, msg->data.sensor_id, &topic_scratch);
+
+    snprintf(payload, sizeof(payload),
+            "{\"sensor_id\":%d,\"type\":\"%s\",\"value\":%.2f,"
+            "\"timestamp\":%u,\"priority\":%d,\"encrypted\":%s}",
+            msg->data.sensor_id, sensor_type_str, msg->data.value,
+            (unsigned int)msg->data.timestamp, msg->priority,
+            msg->encrypted ? "true" : "false");
+
+    size_t avail;
+    uint8_t *dst = tx_reserve(session, &avail);
+    mqtt_properties_t props;
+    bool aliased = false;
+    int len = -1;
+    if (topic != NULL) {
+        mqtt_publish_t publish = {
+            .topic = { (const uint8_t *)topic->name, topic->len },
+            .payload = (const uint8_t *)payload,
+            .payload_len = strlen(payload),
+            .qos = qos,
+            .dup = dup,
+            .packet_id = packet_id
+        };
+        if (mqtt_v5(session)) {
+            aliased = publish_properties(session, &props, topic, expiry_sec);
+            publish.properties = &props;
+            if (aliased) {
+                publish.topic.len = 0;
             }
-            continue;
         }
-        
-        char error_buf[100];
-        mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-        safe_printf("Network SSL handshake failed: -0x%x (%s)\n", -ret, error_buf);
-        close(mqtt_ctx.socket_fd);
-        return -1;
+        len = mqtt_encode_publish(dst, avail, &publish);
     }
-    
-    safe_printf("Network SSL handshake successful\n");
-    debug_certificate_verification();
-    
-    uint32_t verify_flags;
-    if ((verify_flags = mbedtls_ssl_get_verify_result(&mqtt_ctx.ssl_ctx)) != 0) {
-    char vrfy_buf[512];
-    mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "  ! ", verify_flags);
-    safe_printf("Network Certificate verification failed:\n%s\n", vrfy_buf);
-    
-    if (TLS_VERIFY_REQUIRED) {
-        safe_printf("Network Continuing despite verification failure (debug mode)\n");
-        close(mqtt_ctx.socket_fd);
-        return -1;
+    if (len < 0 || (session->peer.maximum_packet_size != 0 && (uint32_t)len > session->peer.maximum_packet_size)) {
+        net_log("Network Dropping unencodable message for %s sensor %d\n",
+                   sensor_type_str, msg->data.sensor_id);
+        return 0;
+    }
+    if (mqtt_v5(session)) {
+        mark_alias_sent(session, &props);
+        session->tx_stats.aliased += aliased ? 1 : 0;
     }
+    tx_commit(session, len, false);
+    session->tx_stats.messages++;
+    if (dup) {
+        net_log("Network Republished packet ID %u to %s: %.2f\n",
+                   packet_id, topic->name, msg->data.value);
+    } else {
+        net_log("Network Published to %s: %.2f\n",
+                   topic->name, msg->data.value);
+    }
+    return len;
 }
-    
-    return 0;
+
+/* Same return convention as publish_message(). Payloads of at least
+ * MQTT_TX_DIRECT_MIN bytes are written from the caller's buffer; smaller
+ * ones are cheaper to coalesce. Takes ownership of bulk->payload. */
+static int publish_bulk(mqtt_session_t *session, net_bulk_t *bulk) {
+    mqtt_publish_t publish = {
+        .topic = { (const uint8_t *)bulk->topic.name, bulk->topic.len },
+        .payload = bulk->payload,
+        .payload_len = bulk->len,
+        .qos = MQTT_QOS0
+    };
+    mqtt_properties_t props;
+    if (mqtt_v5(session)) {
+        publish_properties(session, &props, &bulk->topic, MQTT_MESSAGE_EXPIRY_SEC);
+        publish.properties = &props;
+    }
+    mqtt_iovec_t iov[2];
+    size_t avail;
+    uint8_t *dst = tx_reserve(session, &avail);
+    bool direct = bulk->len >= MQTT_TX_DIRECT_MIN;
+    int len = direct ? mqtt_publish_iov(dst, avail, &publish, iov) :
+                       mqtt_encode_publish(dst, avail, &publish);
+
+    /* The whole packet counts against the broker's limit: header and
+     * payload on the direct path, the encoded copy otherwise. */
+    if (len >= 0 && session->peer.maximum_packet_size != 0 &&
+        (direct ? (uint64_t)iov[0].len + bulk->len : (uint64_t)len) > session->peer.maximum_packet_size) {
+        len = -1;
+    }
+    if (len < 0) {
+        net_log("Network Dropping unencodable %u byte publish to %s\n",
+                (unsigned int)bulk->len, bulk->topic.name);
+        free(bulk->payload);
+        return 0;
+    }
+    if (direct) {
+        tx_commit(session, iov[0].len, true);
+        tx_attach_direct(session, bulk->payload, bulk->len);
+        len = (int)(iov[0].len + bulk->len);
+    } else {
+        tx_commit(session, len, false);
+        free(bulk->payload);
+    }
+    session->tx_stats.messages++;
+    net_log("Network Published %u bytes to %s\n", (unsigned int)bulk->len, bulk->topic.name);
+    return len;
 }
 
+/* Collects the slots due for a resend, oldest first, since a resumed
+ * session must repeat its publishes in their original order. */
+static int inflight_due(inflight_window_t *win, uint64_t now_us, inflight_entry_t **due) {
+    int count = 0;
+    for (int i = 0; i < MQTT_INFLIGHT_WINDOW && count < win->count; i++) {
+        inflight_entry_t *slot = &win->slots[i];
+        if (slot->packet_id == 0 ||
+            (!slot->resend && (slot->sent_us == 0 || now_us - slot->sent_us < MQTT_RETRY_TIMEOUT_MS * 1000ULL))) {
+            continue;
+        }
+        int j = count++;
+        while (j > 0 && due[j - 1]->first_sent_us > slot->first_sent_us) {
+            due[j] = due[j - 1];
+            j--;
+        }
+        due[j] = slot;
+    }
+    return count;
+}
 
-static int mqtt_send_packet(const uint8_t *packet, size_t len) {
-    int ret;
-    size_t written = 0;
-    int attempts = 0;
-    const int max_attempts = 50; 
-    
-    while (written < len) {
-        ret = mbedtls_ssl_write(&mqtt_ctx.ssl_ctx, packet + written, len - written);
-        
-        if (ret > 0) {
-            written += ret;
-            attempts = 0; 
-        } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            attempts++;
-            if (attempts > max_attempts) {
-                safe_printf("Network Send timeout\n");
-                return -1;
+static void retransmit_inflight(mqtt_session_t *session) {
+    uint64_t now_us = get_time_us();
+    inflight_entry_t *due[MQTT_INFLIGHT_WINDOW];
+    int count = inflight_due(&session->inflight, now_us, due);
+    bool timed_out = false;
+    for (int i = 0; i < count; i++) {
+        inflight_entry_t *slot = due[i];
+        int room = tx_make_room(session, MQTT_PUBLISH_MAX_SIZE);
+        if (room > 0) {
+            break;
+        }
+        uint32_t expiry_sec = 0;
+        if (mqtt_v5(session) && MQTT_MESSAGE_EXPIRY_SEC > 0) {
+            expiry_sec = expiry_remaining(slot->first_sent_us, now_us);
+            if (expiry_sec == 0) {
+                net_log("Network Message %u expired before it was acknowledged\n", slot->packet_id);
+                session->tx_stats.expired++;
+                inflight_release(&session->inflight, slot);
+                continue;
             }
-        } else {
-            char error_buf[100];
-            mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-            safe_printf("Network Failed to send packet: -0x%x (%s)\n", -ret, error_buf);
-            return -1;
         }
+        /* Without a stored session on the broker a resend is a new publish. */
+        bool dup = !slot->resend || session->session_present;
+        int ret = room < 0 ? -1 : publish_message(session, &slot->msg, MQTT_QOS1, slot->packet_id, dup, expiry_sec);
+        if (ret < 0) {
+            net_log("Network Failed to retransmit packet ID %u\n", slot->packet_id);
+            session->state = NET_STATE_ERROR;
+            return;
+        }
+        if (ret == 0) {
+            inflight_release(&session->inflight, slot);
+            continue;
+        }
+        timed_out = timed_out || !slot->resend;
+        slot->resend = false;
+        slot->sent_us = 0;
+        slot->retries++;
+    }
+    if (timed_out) {
+        window_ctrl_on_timeout(&session->wnd, now_us);
     }
-    
-    return written;
 }
 
+/* Hands a matching publish to the bridge task. Returns false only if the
+ * command ring is full and the command was dropped. It is acknowledged all
+ * the same: the broker would not send it again before a reconnect, and
+ * until then it would hold one of our Receive Maximum slots. */
+static bool deliver_command(const mqtt_publish_t *publish) {
+    net_command_t cmd;
 
-static void cleanup_tls_connection(void) {
-    mbedtls_ssl_close_notify(&mqtt_ctx.ssl_ctx);
-    if (mqtt_ctx.socket_fd >= 0) {
-        close(mqtt_ctx.socket_fd);
-        mqtt_ctx.socket_fd = -1;
+    if (publish->topic.len == 0 || publish->topic.len > MQTT_TOPIC_MAX_LEN) {
+        net_log("Network Dropping inbound publish with a %u byte topic\n", publish->topic.len);
+        return true;
+    }
+    uint32_t subs = topic_trie_match(&command_trie, (const char *)publish->topic.data, publish->topic.len);
+    if (subs == 0) {
+        net_log("Network No subscription matches %.*s\n", publish->topic.len, (const char *)publish->topic.data);
+        return true;
+    }
+    if (publish->payload_len > NET_COMMAND_MAX_PAYLOAD) {
+        net_log("Network Dropping %u byte command on %.*s\n", (unsigned int)publish->payload_len,
+                publish->topic.len, (const char *)publish->topic.data);
+        return true;
+    }
+    if (spsc_ring_free(&command_ring) == 0) {
+        net_log("Network Command ring full, dropping %.*s\n", publish->topic.len, (const char *)publish->topic.data);
+        return false;
     }
-    mbedtls_ssl_free(&mqtt_ctx.ssl_ctx);
-    mbedtls_ssl_config_free(&mqtt_ctx.ssl_conf);
-    mbedtls_ctr_drbg_free(&mqtt_ctx.ctr_drbg);
-    mbedtls_entropy_free(&mqtt_ctx.entropy);
-    mbedtls_x509_crt_free(&mqtt_ctx.cacert);
+    cmd.subs = subs;
+    cmd.topic_len = publish->topic.len;
+    memcpy(cmd.topic, publish->topic.data, publish->topic.len);
+    cmd.topic[publish->topic.len] = '\0';
+    cmd.payload_len = publish->payload_len;
+    memcpy(cmd.payload, publish->payload, publish->payload_len);
+    cmd.payload[publish->payload_len] = '\0';
+    spsc_ring_push(&command_ring, &cmd);
+    return true;
 }
 
-static void process_mqtt_packet(uint8_t *packet, size_t len) {
-    if (len < 2) {
-        safe_printf("Network Packet too short: %zu bytes\n", len);
+static void receive_publish(mqtt_session_t *session, const mqtt_packet_view_t *packet) {
+    mqtt_publish_t publish;
+    mqtt_properties_t props;
+    int ret = mqtt_v5(session) ? mqtt_decode_publish_v5(packet, &publish, &props) :
+                                 mqtt_decode_publish(packet, &publish);
+    if (ret != 0) {
+        net_log("Network Malformed PUBLISH packet\n");
+        session->state = NET_STATE_ERROR;
         return;
     }
-    
-    uint8_t packet_type = packet[0] & 0xF0;
-    safe_printf("Network Received packet type: 0x%02x, length: %zu\n", packet_type, len);
+    if (publish.qos == MQTT_QOS2) {
+        net_log("Network Ignoring QoS 2 publish to %.*s\n", publish.topic.len, (const char *)publish.topic.data);
+        return;
+    }
+    if (!deliver_command(&publish)) {
+        session->rx_stats.dropped++;
+    }
+    if (publish.qos == MQTT_QOS0) {
+        return;
+    }
+    if (session->rx_ack_count == MQTT_INFLIGHT_WINDOW) {
+        net_log("Network Too many unacknowledged inbound publishes, not acknowledging %u\n", publish.packet_id);
+        return;
+    }
+    session->rx_acks[session->rx_ack_count++] = publish.packet_id;
+}
+
+static int send_subscribe(mqtt_session_t *session) {
+    mqtt_subscription_t subs[NET_MAX_SUBSCRIPTIONS];
+    mqtt_properties_t props;
+    size_t avail;
+    int room = tx_make_room(session, MQTT_SUBSCRIBE_MAX_SIZE);
+
+    if (room != 0) {
+        return room;
+    }
+    for (int i = 0; i < subscription_count; i++) {
+        subs[i].filter.data = (const uint8_t *)subscriptions[i].filter;
+        subs[i].filter.len = subscriptions[i].len;
+        subs[i].qos = subscriptions[i].qos;
+    }
+    memset(&props, 0, sizeof(props));
+    uint8_t *dst = tx_reserve(session, &avail);
+    uint16_t packet_id = inflight_reserve_id(&session->inflight);
+    int len = mqtt_v5(session) ?
+              mqtt_encode_subscribe_v5(dst, avail, packet_id, subs, subscription_count, &props) :
+              mqtt_encode_subscribe(dst, avail, packet_id, subs, subscription_count);
+    if (len < 0) {
+        return -1;
+    }
+    tx_commit(session, len, true);
+    session->subscribe_pending = false;
+    session->subscribe_id = packet_id;
+    net_log("Network SUBSCRIBE queued for %d filters\n", subscription_count);
+    return 0;
+}
+
+/* PUBACKs for inbound QoS1 publishes, in the order the publishes came in. */
+static int send_acks(mqtt_session_t *session) {
+    uint16_t sent = 0;
+    int ret = 0;
+
+    while (sent < session->rx_ack_count) {
+        size_t avail;
+        if ((ret = tx_make_room(session, MQTT_ACK_MAX_SIZE)) != 0) {
+            break;
+        }
+        uint8_t *dst = tx_reserve(session, &avail);
+        uint16_t packet_id = session->rx_acks[sent++];
+        int len = mqtt_v5(session) ? mqtt_encode_ack_v5(dst, avail, MQTT_PUBACK, packet_id, MQTT_RC_SUCCESS) :
+                                     mqtt_encode_ack(dst, avail, MQTT_PUBACK, packet_id);
+        tx_commit(session, len, true);
+    }
+    session->rx_ack_count -= sent;
+    memmove(session->rx_acks, session->rx_acks + sent, session->rx_ack_count * sizeof(session->rx_acks[0]));
+    return ret < 0 ? -1 : 0;
+}
+
+static void process_mqtt_packet(mqtt_session_t *session, const mqtt_packet_view_t *packet) {
+    const uint8_t *body = packet->body;
+    uint32_t len = packet->body_len;
+    uint8_t packet_type = packet->type;
+    net_log("Network Received packet type: 0x%02x, length: %u\n", packet_type, (unsigned int)len);
     
     switch (packet_type) {
-        case MQTT_CONNACK:
-            if (len >= 4) {
-                uint8_t connect_return_code = packet[3];
+        case MQTT_CONNACK: {
+            bool session_present;
+            uint8_t connect_return_code;
+            mqtt_properties_t props;
+            int ret = mqtt_v5(session) ?
+                      mqtt_decode_connack_v5(packet, &session_present, &connect_return_code, &props) :
+                      mqtt_decode_connack(packet, &session_present, &connect_return_code);
+            if (ret == 0) {
                 if (connect_return_code == 0x00) {
-                    safe_printf("Network MQTT connected successfully\n");
-                    mqtt_ctx.state = NET_STATE_CONNECTED;
-                    xEventGroupSetBits(xSystemEvents, EVENT_MQTT_CONNECTED);
+                    session->ping_sent_us = 0;
+                    if (mqtt_v5(session)) {
+                        if (props.present & MQTT_HAS_SERVER_KEEPALIVE) {
+                            session->keepalive_sec = props.server_keepalive;
+                        }
+                        peer_apply(&session->peer, &props);
+                        net_log("Network MQTT 5 session: receive maximum %u, topic alias maximum %u, maximum QoS %u\n",
+                                session->peer.receive_maximum, session->peer.topic_alias_maximum,
+                                session->peer.maximum_qos);
+                    }
+                    net_log("Network MQTT connected successfully%s\n",
+                            session_present ? ", session resumed" : "");
+                    session->state = NET_STATE_CONNECTED;
+                    session->session_present = session_present;
+                    session->up = true;
+                    /* Only the first session subscribes, so each command
+                     * arrives once. Subscribing again is harmless when the
+                     * broker kept the session. */
+                    session->subscribe_pending = session->index == 0 && subscription_count > 0;
+                    netmgr_session_up(session->index);
+                    if (mqtt_ctx.sessions_up++ == 0) {
+                        post_event(NET_EVENT_MQTT_UP);
+                    }
+                    if (session->inflight.count > 0) {
+                        net_log("Network Resending %u unacknowledged messages%s\n",
+                                    session->inflight.count,
+                                    session_present ? "" : " as new publishes");
+                        for (int i = 0; i < MQTT_INFLIGHT_WINDOW; i++) {
+                            session->inflight.slots[i].resend = session->inflight.slots[i].packet_id != 0;
+                        }
+                    }
+                } else if (mqtt_v5(session) && (connect_return_code == 0x01 ||
+                                         connect_return_code == MQTT_RC_UNSUPPORTED_VERSION)) {
+                    net_log("Network Broker does not support MQTT 5, falling back to 3.1.1\n");
+                    mqtt_ctx.protocol_level = MQTT_PROTOCOL_LEVEL;
+                    session->state = NET_STATE_ERROR;
                 } else {
-                    safe_printf("Network MQTT connection rejected, return code: 0x%02x\n", connect_return_code);
+                    net_log("Network MQTT connection rejected, return code: 0x%02x\n", connect_return_code);
                     switch(connect_return_code) {
-                        case 0x01: safe_printf("Network   Reason: Unacceptable protocol version\n"); break;
-                        case 0x02: safe_printf("Network   Reason: Identifier rejected\n"); break;
-                        case 0x03: safe_printf("Network   Reason: Server unavailable\n"); break;
-                        case 0x04: safe_printf("Network   Reason: Bad username or password\n"); break;
-                        case 0x05: safe_printf("Network   Reason: Not authorized\n"); break;
-                        default: safe_printf("Network   Reason: Unknown (0x%02x)\n", connect_return_code); break;
+                        case 0x01: net_log("Network   Reason: Unacceptable protocol version\n"); break;
+                        case 0x02: net_log("Network   Reason: Identifier rejected\n"); break;
+                        case 0x03: net_log("Network   Reason: Server unavailable\n"); break;
+                        case 0x04: net_log("Network   Reason: Bad username or password\n"); break;
+                        case 0x05: net_log("Network   Reason: Not authorized\n"); break;
+                        default: net_log("Network   Reason: Unknown (0x%02x)\n", connect_return_code); break;
                     }
-                    mqtt_ctx.state = NET_STATE_ERROR;
+                    session->state = NET_STATE_ERROR;
                 }
             } else {
-                safe_printf("Network CONNACK packet too short\n");
-                mqtt_ctx.state = NET_STATE_ERROR;
+                net_log("Network Malformed CONNACK packet\n");
+                session->state = NET_STATE_ERROR;
             }
             break;
+        }
             
-        case MQTT_PUBACK:
-            if (len >= 4) {
-                uint16_t packet_id = (packet[2] << 8) | packet[3];
-                safe_printf("Network PUBACK received for packet ID: %u\n", packet_id);
+        case MQTT_PUBACK: {
+            uint16_t packet_id;
+            uint8_t reason_code = MQTT_RC_SUCCESS;
+            mqtt_properties_t props;
+            int ret = mqtt_v5(session) ? mqtt_decode_ack_v5(packet, &packet_id, &reason_code, &props) :
+                                  mqtt_decode_ack(packet, &packet_id);
+            if (ret == 0) {
+                inflight_entry_t *slot = inflight_find(&session->inflight, packet_id);
+                if (slot != NULL && reason_code >= 0x80) {
+                    /* The broker will not take the message; resending it would
+                     * get the same answer. */
+                    net_log("Network Publish %u rejected, reason 0x%02x%s%.*s\n", packet_id, reason_code,
+                            (props.present & MQTT_HAS_REASON_STRING) ? ": " : "",
+                            (props.present & MQTT_HAS_REASON_STRING) ? props.reason_string.len : 0,
+                            (props.present & MQTT_HAS_REASON_STRING) ? (const char *)props.reason_string.data : "");
+                    session->tx_stats.rejected++;
+                    inflight_release(&session->inflight, slot);
+                } else if (slot != NULL) {
+                    /* Timed from the write, so time spent coalescing is not
+                     * taken for queueing delay at the broker. */
+                    if (slot->retries == 0 && slot->sent_us != 0) {
+                        uint64_t now_us = get_time_us();
+                        window_ctrl_on_ack(&session->wnd, (uint32_t)(now_us - slot->sent_us), now_us);
+                    }
+                    inflight_release(&session->inflight, slot);
+                    net_log("Network PUBACK received for packet ID: %u (%u in flight)\n",
+                                packet_id, session->inflight.count);
+                } else {
+                    net_log("Network PUBACK for unknown packet ID: %u\n", packet_id);
+                }
             }
             break;
+        }
             
+        case MQTT_PUBLISH:
+            receive_publish(session, packet);
+            break;
+
+        case MQTT_SUBACK: {
+            uint16_t packet_id;
+            const uint8_t *codes;
+            size_t count;
+            mqtt_properties_t props;
+            int ret = mqtt_v5(session) ? mqtt_decode_suback_v5(packet, &packet_id, &codes, &count, &props) :
+                                         mqtt_decode_suback(packet, &packet_id, &codes, &count);
+            if (ret != 0 || packet_id != session->subscribe_id) {
+                net_log("Network Unexpected SUBACK\n");
+                break;
+            }
+            session->subscribe_id = 0;
+            for (size_t i = 0; i < count && i < (size_t)subscription_count; i++) {
+                if (codes[i] >= MQTT_SUBACK_FAILURE) {
+                    net_log("Network Subscription to %s refused, reason 0x%02x\n", subscriptions[i].filter, codes[i]);
+                } else {
+                    net_log("Network Subscribed to %s at QoS %u\n", subscriptions[i].filter, codes[i]);
+                }
+            }
+            break;
+        }
+
         case MQTT_PINGRESP:
-            safe_printf("Network PINGRESP received\n");
+            session->ping_sent_us = 0;
+            net_log("Network PINGRESP received\n");
+            break;
+
+        case MQTT_DISCONNECT:
+            net_log("Network Broker sent DISCONNECT, reason 0x%02x\n", len > 0 ? body[0] : MQTT_RC_SUCCESS);
+            session->state = NET_STATE_ERROR;
             break;
             
         default:
-            safe_printf("Network Unknown packet type: 0x%02x\n", packet_type);
-            safe_printf("Network Packet dump: ");
-            for (size_t i = 0; i < len && i < 16; i++) {
-                safe_printf("%02x ", packet[i]);
+            net_log("Network Unknown packet type: 0x%02x\n", packet_type);
+            net_log("Network Packet dump: ");
+            for (uint32_t i = 0; i < len && i < 16; i++) {
+                net_log("%02x ", body[i]);
             }
-            safe_printf("\n");
+            net_log("\n");
             break;
     }
 }
 
-void vNetworkTask(void *pvParameters) {
-    (void)pvParameters; 
-    
-    message_t msg;
-    char topic[128];
-    char payload[256];
-    int reconnect_attempts = 0;
-    const int max_reconnect_attempts = 5;
-    
-    safe_printf("Network Started (TLS mode)\n");
-    mqtt_ctx.state = NET_STATE_DISCONNECTED;
-    mqtt_ctx.packet_id = 1;
-    mqtt_ctx.socket_fd = -1;
-    printf("Network Waiting for system ready event...\n");
-    xEventGroupWaitBits(xSystemEvents, EVENT_DATA_READY, pdFALSE, pdTRUE, portMAX_DELAY);
-    printf("Network System ready event received!\n");
-    printf("Network Initializing network interface...\n");
-    printf("Network Entering main loop...\n");
-    
+static bool session_active(mqtt_session_t *session) {
+    return session->state == NET_STATE_MQTT_CONNECT || session->state == NET_STATE_CONNECTED;
+}
+
+static void network_wake(void) {
+    uint64_t one = 1;
+    if (mqtt_ctx.wake_fd >= 0) {
+        (void)write(mqtt_ctx.wake_fd, &one, sizeof(one));
+    }
+}
+
+BaseType_t network_enqueue(const message_t *msg, TickType_t timeout) {
+    return xQueueSend(xNetworkQueue, msg, timeout);
+}
+
+/* Subscriptions are fixed once the engine starts: they are compiled into
+ * command_trie, which the engine then reads without locking. */
+BaseType_t network_subscribe(const char *filter, uint8_t qos, network_command_handler_t handler, void *ctx) {
+    size_t len = strlen(filter);
+    if (subscriptions_frozen || handler == NULL || qos > MQTT_QOS1 || len > MQTT_TOPIC_MAX_LEN ||
+        subscription_count == NET_MAX_SUBSCRIPTIONS) {
+        return pdFAIL;
+    }
+    if (subscription_count == 0) {
+        topic_trie_init(&command_trie);
+    }
+    if (topic_trie_add(&command_trie, filter, len) != subscription_count) {
+        return pdFAIL;
+    }
+    net_subscription_t *sub = &subscriptions[subscription_count++];
+    memcpy(sub->filter, filter, len + 1);
+    sub->len = (uint16_t)len;
+    sub->qos = qos;
+    sub->handler = handler;
+    sub->ctx = ctx;
+    return pdPASS;
+}
+
+BaseType_t network_publish_buffer(const char *topic, uint8_t *payload, uint32_t len, TickType_t timeout) {
+    net_bulk_t bulk;
+    int n = snprintf(bulk.topic.name, sizeof(bulk.topic.name), "%s%s", MQTT_TOPIC_BASE, topic);
+    if (bulk_queue == NULL || n < 0 || n >= (int)sizeof(bulk.topic.name)) {
+        return pdFAIL;
+    }
+    bulk.topic.len = (uint16_t)n;
+    bulk.topic.stripe = topic_stripe(bulk.topic.name, bulk.topic.len);
+    bulk.payload = payload;
+    bulk.len = len;
+    return xQueueSend(bulk_queue, &bulk, timeout);
+}
+
+static int watch_socket(mqtt_session_t *session, uint32_t events) {
+    if (session->conn == NULL || events == session->sock_events) {
+        return 0;
+    }
+    struct epoll_event ev = { .events = events, .data.fd = session->conn->fd };
+    int op = session->sock_events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(mqtt_ctx.epoll_fd, op, session->conn->fd, &ev) != 0) {
+        net_log("Network epoll_ctl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    session->sock_events = events;
+    return 0;
+}
+
+static void unwatch_socket(mqtt_session_t *session) {
+    if (session->conn != NULL && session->sock_events != 0) {
+        epoll_ctl(mqtt_ctx.epoll_fd, EPOLL_CTL_DEL, session->conn->fd, NULL);
+    }
+    session->sock_events = 0;
+}
+
+static int read_available(mqtt_session_t *session) {
     for (;;) {
-        if (mqtt_ctx.state == NET_STATE_DISCONNECTED) {
-            if (reconnect_attempts >= max_reconnect_attempts) {
-                safe_printf("Network Max reconnection attempts reached, waiting longer...\n");
-                vTaskDelay(pdMS_TO_TICKS(30000)); 
-                reconnect_attempts = 0;
+        size_t avail;
+        uint8_t *rx = mqtt_rx_write_ptr(&session->rx_ring, &avail);
+        int ret = netmgr_read(session->conn, rx, avail);
+        if (ret > 0) {
+            mqtt_packet_view_t packet;
+            uint32_t oversized = session->rx_ring.oversized;
+            int framed;
+            session->last_rx_us = get_time_us();
+            mqtt_rx_commit(&session->rx_ring, ret);
+            while ((framed = mqtt_rx_next(&session->rx_ring, &packet)) > 0) {
+                process_mqtt_packet(session, &packet);
             }
-            
-            if (init_tls_connection() == 0) {
-                int len = mqtt_create_connect_packet(mqtt_ctx.tx_buffer, MQTT_BUFFER_SIZE);
-                if (mqtt_send_packet(mqtt_ctx.tx_buffer, len) > 0) {
-                    mqtt_ctx.state = NET_STATE_MQTT_CONNECT;
-                    mqtt_ctx.last_ping_time = xTaskGetTickCount();
-                    reconnect_attempts = 0; 
-                    safe_printf("Network MQTT CONNECT packet sent\n");
-                } else {
-                    safe_printf("Network Failed to send MQTT CONNECT\n");
-                    mqtt_ctx.state = NET_STATE_ERROR;
-                }
-            } else {
-                reconnect_attempts++;
-                mqtt_ctx.state = NET_STATE_ERROR;
+            if (session->rx_ring.oversized != oversized) {
+                session->rx_stats.oversized += session->rx_ring.oversized - oversized;
+                net_log("Network Skipping an MQTT packet larger than the %u byte receive ring\n",
+                        (unsigned int)MQTT_RX_RING_SIZE);
+            }
+            if (framed < 0) {
+                net_log("Network Malformed MQTT packet received\n");
+                return -1;
             }
+        } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return 0;
+        } else if (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) {
+            netmgr_session_ticket(session->conn);
+        } else if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            net_log("Network Peer closed connection gracefully\n");
+            return -1;
+        } else if (ret == 0) {
+            net_log("Network Connection closed by peer\n");
+            return -1;
+        } else {
+            char error_buf[100];
+            mbedtls_strerror(ret, error_buf, sizeof(error_buf));
+            net_log("Network Read error: -0x%x (%s)\n", -ret, error_buf);
+            return -1;
         }
-        
-        if (mqtt_ctx.state >= NET_STATE_MQTT_CONNECT && !is_connection_alive()) {
-            safe_printf("Network Connection health check failed\n");
-            mqtt_ctx.state = NET_STATE_ERROR;
-        }
-        
-        if (mqtt_ctx.state >= NET_STATE_MQTT_CONNECT) {
-            int ret = mbedtls_ssl_read(&mqtt_ctx.ssl_ctx, mqtt_ctx.rx_buffer, MQTT_BUFFER_SIZE);
-            if (ret > 0) {
-                process_mqtt_packet(mqtt_ctx.rx_buffer, ret);
-            } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-            } else if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
-                safe_printf("Network Peer closed connection gracefully\n");
-                mqtt_ctx.state = NET_STATE_ERROR;
-            } else if (ret < 0) {
-                char error_buf[100];
-                mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-                safe_printf("Network Read error: -0x%x (%s)\n", -ret, error_buf);
-                mqtt_ctx.state = NET_STATE_ERROR;
+    }
+}
+
+static void drain_network_queue(mqtt_session_t *session) {
+    message_t msg;
+    uint16_t window = window_ctrl_size(&session->wnd);
+    uint16_t batch = 0;
+
+    if (window > session->peer.receive_maximum) {
+        window = session->peer.receive_maximum;
+    }
+
+    while (session->state == NET_STATE_CONNECTED &&
+           batch < window &&
+           session->inflight.count < window) {
+        int room = tx_make_room(session, MQTT_PUBLISH_MAX_SIZE);
+        if (room != 0) {
+            if (room < 0) {
+                session->state = NET_STATE_ERROR;
             }
+            break;
         }
-        
-        if (mqtt_ctx.state == NET_STATE_CONNECTED) {
-            if (xQueueReceive(xNetworkQueue, &msg, pdMS_TO_TICKS(100)) == pdPASS) {
-                const char *sensor_type_str;
-                switch (msg.data.type) {
-                    case SENSOR_TYPE_TEMPERATURE:
-                        sensor_type_str = "temperature";
-                        break;
-                    case SENSOR_TYPE_HUMIDITY:
-                        sensor_type_str = "humidity";
-                        break;
-                    case SENSOR_TYPE_MOTION:
-                        sensor_type_str = "motion";
-                        break;
-                    default:
-                        sensor_type_str = "unknown";
-                }
-                
-                snprintf(topic, sizeof(topic), "%s%s/sensor_%d", 
-                        MQTT_TOPIC_BASE, sensor_type_str, msg.data.sensor_id);
-
-                snprintf(payload, sizeof(payload),
-                        "{\"sensor_id\":%d,\"type\":\"%s\",\"value\":%.2f,"
-                        "\"timestamp\":%u,\"priority\":%d,\"encrypted\":%s}",
-                        msg.data.sensor_id, sensor_type_str, msg.data.value,
-                        (unsigned int)msg.data.timestamp, msg.priority,
-                        msg.encrypted ? "true" : "false");
-                
-                int len = mqtt_create_publish_packet(mqtt_ctx.tx_buffer, MQTT_BUFFER_SIZE, topic, (uint8_t*)payload, strlen(payload), msg.priority > 1 ? MQTT_QOS1 : MQTT_QOS0);
-                
-                if (mqtt_send_packet(mqtt_ctx.tx_buffer, len) > 0) {
-                    safe_printf("Network Published to %s: %.2f\n", 
-                               topic, msg.data.value);
-                } else {
-                    safe_printf("Network Failed to publish message\n");
-                    if (xQueueSendToFront(xNetworkQueue, &msg, 0) != pdPASS) {
-                        safe_printf("Network Failed to requeue message\n");
-                    }
-                    mqtt_ctx.state = NET_STATE_ERROR;
-                }
+        if (!spsc_ring_pop(&session->queue, &msg)) {
+            break;
+        }
+        uint8_t qos = msg.priority > 1 && session->peer.maximum_qos > MQTT_QOS0 ? MQTT_QOS1 : MQTT_QOS0;
+        uint16_t packet_id = 0;
+        batch++;
+
+        if (qos > 0) {
+            packet_id = inflight_acquire(&session->inflight, &msg);
+        }
+        if (publish_message(session, &msg, qos, packet_id, false, MQTT_MESSAGE_EXPIRY_SEC) == 0 && packet_id != 0) {
+            inflight_release(&session->inflight, inflight_find(&session->inflight, packet_id));
+        }
+    }
+}
+
+/* Bulk publishes go out after the per-sensor messages of the same pass, one
+ * at a time since each holds the transmit path until its payload is sent. */
+static void drain_bulk_queue(mqtt_session_t *session) {
+    net_bulk_t bulk;
+
+    while (session->state == NET_STATE_CONNECTED) {
+        int room = tx_make_room(session, MQTT_BULK_ROOM);
+        if (room != 0) {
+            if (room < 0) {
+                session->state = NET_STATE_ERROR;
             }
-    
-            if ((xTaskGetTickCount() - mqtt_ctx.last_ping_time) > 
-                pdMS_TO_TICKS(MQTT_KEEPALIVE_SEC * 1000 / 2)) {
-                
-                int len = mqtt_create_ping_packet(mqtt_ctx.tx_buffer);
-                if (mqtt_send_packet(mqtt_ctx.tx_buffer, len) > 0) {
-                    mqtt_ctx.last_ping_time = xTaskGetTickCount();
-                    safe_printf("Network PING sent\n");
-                } else {
-                    safe_printf("Network Failed to send PING\n");
-                    mqtt_ctx.state = NET_STATE_ERROR;
-                }
+            break;
+        }
+        if (!spsc_ring_pop(&session->bulk, &bulk)) {
+            break;
+        }
+        publish_bulk(session, &bulk);
+    }
+}
+
+/* A full queue on a session that is down is the only case where routing
+ * gives up a message: the oldest one there is dropped so that the other
+ * sessions keep draining tx_ring. A single session keeps the backpressure. */
+static bool stripe_has_room(mqtt_session_t *session, spsc_ring_t *queue, void *dropped) {
+    if (spsc_ring_free(queue) > 0) {
+        return true;
+    }
+    if (session->up || NET_STRIPE_COUNT == 1) {
+        return false;
+    }
+    spsc_ring_pop(queue, dropped);
+    return true;
+}
+
+/* Hands each message to the session its topic hashes to, in tx_ring order,
+ * so per-topic ordering survives the striping. */
+static void route_messages(void) {
+    const message_t *next;
+    const net_bulk_t *next_bulk;
+    message_t msg;
+    net_bulk_t bulk;
+
+    while ((next = spsc_ring_peek(&tx_ring)) != NULL) {
+        mqtt_topic_t topic_scratch;
+        const mqtt_topic_t *topic = lookup_topic(next->data.type, next->data.sensor_id, &topic_scratch);
+        mqtt_session_t *session = &mqtt_ctx.sessions[topic != NULL ? topic->stripe : 0];
+        if (spsc_ring_free(&session->queue) == 0) {
+            if (!stripe_has_room(session, &session->queue, &msg)) {
+                break;
             }
+            net_log("Network Session %d is down, dropping queued message for sensor %d\n",
+                    session->index, msg.data.sensor_id);
         }
-        
-        if (mqtt_ctx.state == NET_STATE_ERROR) {
-            safe_printf("Network Connection error, cleaning up and reconnecting...\n");
-            xEventGroupClearBits(xSystemEvents, 
-                               EVENT_NETWORK_CONNECTED | EVENT_MQTT_CONNECTED);
-            
-            cleanup_tls_connection();
-            int delay_ms = 5000 + (reconnect_attempts * 2000); 
+        spsc_ring_pop(&tx_ring, &msg);
+        spsc_ring_push(&session->queue, &msg);
+    }
+    while ((next_bulk = spsc_ring_peek(&bulk_ring)) != NULL) {
+        mqtt_session_t *session = &mqtt_ctx.sessions[next_bulk->topic.stripe];
+        if (spsc_ring_free(&session->bulk) == 0) {
+            if (!stripe_has_room(session, &session->bulk, &bulk)) {
+                break;
+            }
+            net_log("Network Session %d is down, dropping queued publish to %s\n",
+                    session->index, bulk.topic.name);
+            free(bulk.payload);
+        }
+        spsc_ring_pop(&bulk_ring, &bulk);
+        spsc_ring_push(&session->bulk, &bulk);
+    }
+}
 
-            if (delay_ms > 30000) {
-                delay_ms = 30000; 
+static int wait_epoll(int timeout_ms) {
+    struct epoll_event events[8];
+    int n = epoll_wait(mqtt_ctx.epoll_fd, events, 8, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        net_log("Network epoll_wait failed: %s\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == mqtt_ctx.wake_fd) {
+            uint64_t count;
+            (void)read(mqtt_ctx.wake_fd, &count, sizeof(count));
+        }
+    }
+    return 0;
+}
+
+static int wait_for_events(uint64_t now_us, int timeout_ms) {
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        mqtt_session_t *session = &mqtt_ctx.sessions[i];
+        if (!session_active(session)) {
+            continue;
+        }
+        if (mbedtls_ssl_check_pending(&session->conn->ssl)) {
+            timeout_ms = 0;
+        } else if (session->tx_len > 0 && !tx_blocked(session)) {
+            uint64_t due = session->tx_deadline_us > now_us ? session->tx_deadline_us - now_us : 0;
+            if (due / 1000 < (uint64_t)timeout_ms) {
+                timeout_ms = (int)((due + 999) / 1000);
             }
+        }
+        if (watch_socket(session, EPOLLIN | (tx_blocked(session) ? EPOLLOUT : 0)) != 0) {
+            session->state = NET_STATE_ERROR;
+            timeout_ms = 0;
+        }
+    }
+    return wait_epoll(timeout_ms);
+}
+
+static int init_event_loop(void) {
+    mqtt_ctx.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    mqtt_ctx.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mqtt_ctx.epoll_fd < 0 || mqtt_ctx.wake_fd < 0) {
+        net_log("Network Failed to create event loop: %s\n", strerror(errno));
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = mqtt_ctx.wake_fd };
+    if (epoll_ctl(mqtt_ctx.epoll_fd, EPOLL_CTL_ADD, mqtt_ctx.wake_fd, &ev) != 0) {
+        net_log("Network Failed to watch wake event: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static bool engine_stopping(void) {
+    return __atomic_load_n(&engine_stop, __ATOMIC_ACQUIRE) != 0;
+}
 
-            safe_printf("Network Waiting %d seconds before reconnect attempt %d\n", delay_ms/1000, reconnect_attempts + 1);
-            vTaskDelay(pdMS_TO_TICKS(delay_ms));
-            mqtt_ctx.state = NET_STATE_DISCONNECTED;
+static void start_session(mqtt_session_t *session, tls_conn_t *conn) {
+    session->conn = conn;
+    session->protocol_level = mqtt_ctx.protocol_level;
+    mqtt_rx_init(&session->rx_ring);
+    tx_reset(session);
+    session->subscribe_pending = false;
+    session->subscribe_id = 0;
+    session->rx_ack_count = 0;
+    peer_reset(&session->peer);
+    size_t avail;
+    int len = encode_connect(session, tx_reserve(session, &avail), avail);
+    if (len > 0) {
+        /* Written by the flush at the end of this pass, and afterwards as the
+         * socket drains, like any other urgent packet. */
+        tx_commit(session, len, true);
+        session->state = NET_STATE_MQTT_CONNECT;
+        session->keepalive_sec = MQTT_KEEPALIVE_SEC;
+        session->last_tx_us = get_time_us();
+        session->last_rx_us = session->last_tx_us;
+        /* The CONNACK is held to the same deadline as a PINGRESP. */
+        session->ping_sent_us = session->last_tx_us;
+        net_log("Network MQTT CONNECT packet queued\n");
+    } else {
+        net_log("Network Failed to encode MQTT CONNECT\n");
+        session->state = NET_STATE_ERROR;
+    }
+}
+
+static void end_session(mqtt_session_t *session, bool failed) {
+    if (session->conn == NULL) {
+        return;
+    }
+    unwatch_socket(session);
+    netmgr_release(session->index, session->conn, failed);
+    session->conn = NULL;
+}
+
+/* A PINGREQ goes out after half the keepalive without writing, which keeps
+ * the broker's deadline safe, or after the whole interval without reading.
+ * A quiet receive side is normal for QoS 0 traffic and only needs a
+ * half-open probe. Any traffic in the meantime pushes the ping back. */
+static bool keepalive_due(const mqtt_session_t *session, uint64_t now_us) {
+    uint64_t interval_us = session->keepalive_sec * 1000000ULL;
+    if (session->keepalive_sec == 0 || session->ping_sent_us != 0) {
+        return false;
+    }
+    return now_us - session->last_tx_us >= interval_us / 2 || now_us - session->last_rx_us >= interval_us;
+}
+
+static void service_session(mqtt_session_t *session, uint64_t now_us) {
+    if (session->state == NET_STATE_DISCONNECTED) {
+        tls_conn_t *conn = netmgr_poll(session->index, now_us);
+        if (conn != NULL) {
+            start_session(session, conn);
         }
-        
-        EventBits_t events = xEventGroupGetBits(xSystemEvents);
-        if (events & EVENT_SHUTDOWN) {
-            safe_printf("Network shutting down\n");
+    } else {
+        netmgr_poll(session->index, now_us);
+    }
+
+    if (session_active(session) && read_available(session) != 0) {
+        session->state = NET_STATE_ERROR;
+    }
+
+    if (session->state == NET_STATE_CONNECTED &&
+        (send_acks(session) != 0 || (session->subscribe_pending && send_subscribe(session) < 0))) {
+        net_log("Network Failed to queue acknowledgements or SUBSCRIBE\n");
+        session->state = NET_STATE_ERROR;
+    }
+
+    if (session->state == NET_STATE_CONNECTED) {
+        retransmit_inflight(session);
+        drain_network_queue(session);
+        drain_bulk_queue(session);
+    }
+
+    now_us = get_time_us();
+    if (session->state == NET_STATE_CONNECTED && keepalive_due(session, now_us)) {
+        int ret = tx_make_room(session, 2);
+        if (ret == 0) {
+            size_t avail;
+            tx_commit(session, mqtt_encode_empty(tx_reserve(session, &avail), avail, MQTT_PINGREQ), true);
+            session->ping_sent_us = now_us;
+            net_log("Network PING queued\n");
+        } else if (ret < 0) {
+            net_log("Network Failed to send PING\n");
+            session->state = NET_STATE_ERROR;
+        }
+    }
+
+    if (session_active(session) && session->ping_sent_us != 0 &&
+        now_us - session->ping_sent_us > MQTT_PINGRESP_TIMEOUT_MS * 1000ULL) {
+        net_log("Network No %s within %d ms, dropping connection\n",
+                session->state == NET_STATE_CONNECTED ? "PINGRESP" : "CONNACK", MQTT_PINGRESP_TIMEOUT_MS);
+        session->state = NET_STATE_ERROR;
+    }
+
+    if (session_active(session) && session->tx_len > 0 &&
+        (tx_blocked(session) || now_us >= session->tx_deadline_us ||
+         MQTT_COALESCE_BUFFER_SIZE - session->tx_len < MQTT_PUBLISH_MAX_SIZE) &&
+        tx_flush(session) < 0) {
+        net_log("Network Failed to flush coalesced packets\n");
+        session->state = NET_STATE_ERROR;
+    }
+
+    if (session->state == NET_STATE_ERROR) {
+        net_log("Network Connection error on session %d, cleaning up and reconnecting...\n", session->index);
+        if (session->up) {
+            session->up = false;
+            if (--mqtt_ctx.sessions_up == 0) {
+                post_event(NET_EVENT_MQTT_DOWN);
+            }
+        }
+        end_session(session, true);
+        session->state = NET_STATE_DISCONNECTED;
+    }
+}
+
+/* The MQTT/TLS engine runs on a native thread outside the FreeRTOS scheduler,
+ * so blocking DNS, connect and handshakes never stall the sensor tasks. It
+ * must not call any FreeRTOS API: messages arrive through tx_ring, and state
+ * changes go back to the bridge task through event_ring. Connection setup
+ * and reconnects belong to the connection manager. */
+static void *network_engine_thread(void *arg) {
+    (void)arg;
+    uint64_t stats_published_us = 0;
+
+    net_log("Network Engine thread started\n");
+    netmgr_init(mqtt_ctx.epoll_fd);
+
+    while (!engine_stopping()) {
+        uint64_t now_us = get_time_us();
+        route_messages();
+        for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+            service_session(&mqtt_ctx.sessions[i], now_us);
+        }
+
+        now_us = get_time_us();
+        if (now_us - stats_published_us >= NET_POLL_INTERVAL_MS * 1000ULL) {
+            publish_stats();
+            stats_published_us = now_us;
+        }
+
+        if (wait_for_events(now_us, netmgr_timeout_ms(now_us, NET_POLL_INTERVAL_MS)) != 0) {
+            net_sleep_ms(NET_POLL_INTERVAL_MS);
+        }
+    }
+
+    net_log("Network shutting down\n");
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        mqtt_session_t *session = &mqtt_ctx.sessions[i];
+        net_bulk_t bulk;
+        size_t avail;
+        if (session->state == NET_STATE_CONNECTED && tx_make_room(session, 2) == 0) {
+            tx_commit(session, mqtt_encode_empty(tx_reserve(session, &avail), avail, MQTT_DISCONNECT), true);
+            tx_flush_wait(session, NET_SHUTDOWN_FLUSH_MS);
+        }
+        end_session(session, false);
+        tx_reset(session);
+        while (spsc_ring_pop(&session->bulk, &bulk)) {
+            free(bulk.payload);
+        }
+    }
+    net_bulk_t bulk;
+    while (spsc_ring_pop(&bulk_ring, &bulk)) {
+        free(bulk.payload);
+    }
+    netmgr_shutdown();
+    return NULL;
+}
+
+static int start_engine(pthread_t *thread) {
+    /* Same trick the POSIX port uses for its task threads: create the thread
+     * inside a critical section so it inherits a mask that blocks the
+     * scheduler's signals. */
+    taskENTER_CRITICAL();
+    int ret = pthread_create(thread, NULL, network_engine_thread, NULL);
+    taskEXIT_CRITICAL();
+    return ret;
+}
+
+/* Moves messages from the FreeRTOS queue into the engine's ring. Blocks for
+ * up to one tick while the queue is empty, which also paces event polling. */
+static void forward_network_queue(void) {
+    message_t msg;
+    TickType_t wait = NET_BRIDGE_POLL_TICKS;
+    bool forwarded = false;
+
+    if (spsc_ring_free(&tx_ring) == 0) {
+        vTaskDelay(NET_BRIDGE_POLL_TICKS);
+        return;
+    }
+    while (spsc_ring_free(&tx_ring) > 0 &&
+           xQueueReceive(xNetworkQueue, &msg, wait) == pdPASS) {
+        spsc_ring_push(&tx_ring, &msg);
+        forwarded = true;
+        wait = 0;
+    }
+    net_bulk_t bulk;
+    while (spsc_ring_free(&bulk_ring) > 0 && xQueueReceive(bulk_queue, &bulk, 0) == pdPASS) {
+        spsc_ring_push(&bulk_ring, &bulk);
+        forwarded = true;
+    }
+    if (forwarded) {
+        network_wake();
+    }
+}
 
-            if (mqtt_ctx.state == NET_STATE_CONNECTED) {
-                mqtt_ctx.tx_buffer[0] = MQTT_DISCONNECT;
-                mqtt_ctx.tx_buffer[1] = 0x00;
-                mqtt_send_packet(mqtt_ctx.tx_buffer, 2);
+/* Commands run on the bridge task within a tick of arriving, so handlers
+ * must be quick and must not block. */
+static void dispatch_commands(void) {
+    net_command_t cmd;
+    while (spsc_ring_pop(&command_ring, &cmd)) {
+        for (int i = 0; i < subscription_count; i++) {
+            if (cmd.subs & (1u << i)) {
+                subscriptions[i].handler(cmd.topic, cmd.payload, cmd.payload_len, subscriptions[i].ctx);
             }
-            cleanup_tls_connection();
+        }
+    }
+}
+
+static void dispatch_engine_events(void) {
+    net_event_t event;
+    while (spsc_ring_pop(&event_ring, &event)) {
+        switch (event) {
+            case NET_EVENT_MQTT_UP:
+                xEventGroupSetBits(xSystemEvents, EVENT_MQTT_CONNECTED);
+                break;
+            case NET_EVENT_MQTT_DOWN:
+                xEventGroupClearBits(xSystemEvents,
+                                     EVENT_NETWORK_CONNECTED | EVENT_MQTT_CONNECTED);
+                break;
+        }
+    }
+}
+
+/* The bridge between the FreeRTOS tasks and the engine thread. The bridge
+ * wakes the engine through its eventfd, but the engine cannot notify the
+ * bridge: it is not a FreeRTOS task, so it may not call xTaskNotify() or
+ * any other API of the POSIX port. The bridge therefore polls event_ring and
+ * command_ring once per NET_BRIDGE_POLL_TICKS, while it waits on
+ * xNetworkQueue. MQTT up/down bits and subscription handlers run up to one
+ * tick (10 ms at configTICK_RATE_HZ 100) after the engine posts them, and an
+ * idle gateway wakes the bridge on every tick. */
+void vNetworkTask(void *pvParameters) {
+    (void)pvParameters; 
+    pthread_t engine;
+    
+    safe_printf("Network Started (TLS mode)\n");
+    mqtt_ctx.protocol_level = MQTT_PROTOCOL_VERSION;
+    for (int i = 0; i < NET_STRIPE_COUNT; i++) {
+        mqtt_session_t *session = &mqtt_ctx.sessions[i];
+        session->index = i;
+        session->state = NET_STATE_DISCONNECTED;
+        session->conn = NULL;
+        peer_reset(&session->peer);
+        inflight_init(&session->inflight);
+        window_ctrl_init(&session->wnd);
+        spsc_ring_init(&session->queue, stripe_queue_storage[i], sizeof(message_t), NET_TX_RING_SIZE);
+        spsc_ring_init(&session->bulk, stripe_bulk_storage[i], sizeof(net_bulk_t), NET_BULK_RING_SIZE);
+    }
+    mqtt_ctx.wake_fd = -1;
+    spsc_ring_init(&tx_ring, tx_ring_storage, sizeof(message_t), NET_TX_RING_SIZE);
+    spsc_ring_init(&event_ring, event_ring_storage, sizeof(net_event_t), NET_EVENT_RING_SIZE);
+    spsc_ring_init(&bulk_ring, bulk_ring_storage, sizeof(net_bulk_t), NET_BULK_RING_SIZE);
+    spsc_ring_init(&command_ring, command_ring_storage, sizeof(net_command_t), NET_COMMAND_RING_SIZE);
+    bulk_queue = xQueueCreate(NET_BULK_QUEUE_LENGTH, sizeof(net_bulk_t));
+    init_topic_table();
+    if (init_event_loop() != 0) {
+        vTaskDelete(NULL);
+        return;
+    }
+    printf("Network Waiting for system ready event...\n");
+    xEventGroupWaitBits(xSystemEvents, EVENT_DATA_READY, pdFALSE, pdTRUE, portMAX_DELAY);
+    printf("Network System ready event received!\n");
+    printf("Network Initializing network interface...\n");
+    subscriptions_frozen = true;
+    if (start_engine(&engine) != 0) {
+        safe_printf("Network Failed to start engine thread\n");
+        vTaskDelete(NULL);
+        return;
+    }
+    printf("Network Entering main loop...\n");
+    
+    for (;;) {
+        forward_network_queue();
+        dispatch_engine_events();
+        dispatch_commands();
+
+        EventBits_t events = xEventGroupGetBits(xSystemEvents);
+        if (events & EVENT_SHUTDOWN) {
             break;
         }
-        vTaskDelay(pdMS_TO_TICKS(10));
     }
+
+    __atomic_store_n(&engine_stop, 1, __ATOMIC_RELEASE);
+    network_wake();
+    pthread_join(engine, NULL);
+    close(mqtt_ctx.wake_fd);
+    close(mqtt_ctx.epoll_fd);
     vTaskDelete(NULL);
-}
\ No newline at end of file
+}
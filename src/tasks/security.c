@@ -143,7 +143,7 @@ void vSecurityTask(void *pvParameters) {
                                    encrypted_buffer, &encrypted_len) == 0) {
                         if (sign_data(encrypted_buffer, encrypted_len, &signature) == 0) {
                             msg.encrypted = true;
-                            xQueueSendToBack(xNetworkQueue, &msg, pdMS_TO_TICKS(100));
+                            network_enqueue(&msg, pdMS_TO_TICKS(100));
                             safe_printf("[Security] Encrypted and signed message for %s sensor %d (sig: 0x%08x)\n",
                                       msg.data.type == SENSOR_TYPE_TEMPERATURE ? "temp" :
                                       msg.data.type == SENSOR_TYPE_HUMIDITY ? "humidity" : "motion",
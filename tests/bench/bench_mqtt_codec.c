@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mqtt.h"
+
+#define ITERATIONS 2000000
+
+static volatile uint32_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t start_ns, uint64_t end_ns) {
+    double per_op = (double)(end_ns - start_ns) / ITERATIONS;
+    printf("%-24s %8.1f ns/op %10.2f Mops/s\n", name, per_op, 1000.0 / per_op);
+}
+
+int main(void) {
+    static const char topic[] = "iot/gateway/temperature/sensor_0";
+    static const char payload[] = "{\"sensor_id\":0,\"type\":\"temperature\",\"value\":21.50,\"timestamp\":1234567}";
+    uint8_t buf[256];
+    uint8_t header[64];
+    mqtt_iovec_t iov[2];
+    mqtt_packet_view_t view;
+    mqtt_publish_t out;
+    mqtt_publish_t pub = {
+        .topic = { (const uint8_t *)topic, sizeof(topic) - 1 },
+        .payload = (const uint8_t *)payload,
+        .payload_len = sizeof(payload) - 1,
+        .qos = MQTT_QOS1,
+        .packet_id = 1
+    };
+    uint64_t start;
+    int len;
+
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        pub.packet_id = (uint16_t)(i | 1);
+        sink += mqtt_encode_publish(buf, sizeof(buf), &pub);
+    }
+    report("encode_publish", start, now_ns());
+
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        pub.packet_id = (uint16_t)(i | 1);
+        sink += mqtt_publish_iov(header, sizeof(header), &pub, iov);
+        sink += iov[0].len;
+    }
+    report("publish_iov", start, now_ns());
+
+    mqtt_properties_t props = {
+        .present = MQTT_HAS_MESSAGE_EXPIRY | MQTT_HAS_TOPIC_ALIAS,
+        .message_expiry = 300,
+        .topic_alias = 1
+    };
+    mqtt_publish_t aliased = pub;
+    aliased.topic.len = 0;
+    aliased.properties = &props;
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        aliased.packet_id = (uint16_t)(i | 1);
+        sink += mqtt_encode_publish(buf, sizeof(buf), &aliased);
+    }
+    report("encode_publish_v5_alias", start, now_ns());
+
+    len = mqtt_encode_publish(buf, sizeof(buf), &aliased);
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        mqtt_properties_t out_props;
+        mqtt_decode_packet(buf, len, &view);
+        mqtt_decode_publish_v5(&view, &out, &out_props);
+        sink += out_props.topic_alias;
+    }
+    report("decode_publish_v5_alias", start, now_ns());
+
+    len = mqtt_encode_publish(buf, sizeof(buf), &pub);
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        mqtt_decode_packet(buf, len, &view);
+        mqtt_decode_publish(&view, &out);
+        sink += out.packet_id;
+    }
+    report("decode_publish", start, now_ns());
+
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        uint16_t packet_id;
+        mqtt_encode_ack(buf, sizeof(buf), MQTT_PUBACK, (uint16_t)(i | 1));
+        mqtt_decode_packet(buf, 4, &view);
+        mqtt_decode_ack(&view, &packet_id);
+        sink += packet_id;
+    }
+    report("puback_roundtrip", start, now_ns());
+
+    static mqtt_rx_ring_t ring;
+    mqtt_rx_init(&ring);
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        size_t avail;
+        uint8_t *dst = mqtt_rx_write_ptr(&ring, &avail);
+        if (avail < (size_t)len) {
+            while (mqtt_rx_next(&ring, &view) > 0) {
+                sink += view.body_len;
+            }
+            dst = mqtt_rx_write_ptr(&ring, &avail);
+        }
+        memcpy(dst, buf, len);
+        mqtt_rx_commit(&ring, len);
+    }
+    report("rx_ring_publish", start, now_ns());
+
+    return 0;
+}
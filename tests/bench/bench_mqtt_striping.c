@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#include "config.h"
+#include "mqtt.h"
+#include "bench_common.h"
+
+/* Aggregate QoS 1 throughput against a local broker stand-in as the number
+ * of striped connections grows. Like the network engine, a single thread
+ * drives every connection, each with its own TLS context and in-flight
+ * window, and topics are spread over the connections by the same FNV-1a
+ * hash. The broker acks every publish rtt_ms after reading it, standing in
+ * for the round trip to a real broker.
+ *
+ * usage: bench_mqtt_striping [max_connections] [rtt_ms] [seconds] */
+
+#define BENCH_MAX_CONNS         16
+#define BENCH_TOPICS            64
+#define BENCH_ACK_QUEUE         1024
+
+typedef struct {
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    int fd;
+} tls_t;
+
+typedef struct {
+    uint16_t packet_id;
+    uint64_t due_us;
+} pending_ack_t;
+
+typedef struct {
+    tls_t tls;
+    pthread_t thread;
+    pending_ack_t acks[BENCH_ACK_QUEUE];
+    uint32_t ack_head;
+    uint32_t ack_tail;
+    mqtt_rx_ring_t rx;
+} broker_conn_t;
+
+typedef struct {
+    tls_t tls;
+    mqtt_rx_ring_t rx;
+    uint8_t tx[MQTT_COALESCE_BUFFER_SIZE];
+    size_t tx_len;
+    size_t tx_off;
+    size_t tx_pending;
+    uint16_t inflight;
+    uint16_t next_id;
+    uint16_t topics[BENCH_TOPICS];
+    int topic_count;
+    int next_topic;
+    uint64_t acked;
+} client_conn_t;
+
+static mbedtls_x509_crt srv_cert;
+static mbedtls_pk_context srv_key;
+static int listen_fd;
+static uint16_t listen_port;
+static uint32_t ack_delay_us;
+static char topic_names[BENCH_TOPICS][48];
+static broker_conn_t broker_conns[BENCH_MAX_CONNS];
+static client_conn_t client_conns[BENCH_MAX_CONNS];
+
+static uint8_t topic_stripe(const char *name, size_t len, int stripes) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return (uint8_t)(hash % stripes);
+}
+
+static int bench_send(void *ctx, const unsigned char *buf, size_t len) {
+    int ret = send(*(int *)ctx, buf, len, MSG_NOSIGNAL);
+    if (ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_WRITE : -1;
+    }
+    return ret;
+}
+
+static int bench_recv(void *ctx, unsigned char *buf, size_t len) {
+    int ret = recv(*(int *)ctx, buf, len, 0);
+    if (ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_READ : -1;
+    }
+    return ret;
+}
+
+static int tls_init(tls_t *tls, int fd, int endpoint) {
+    const char *pers = "bench_mqtt_striping";
+    mbedtls_ssl_init(&tls->ssl);
+    mbedtls_ssl_config_init(&tls->conf);
+    mbedtls_entropy_init(&tls->entropy);
+    mbedtls_ctr_drbg_init(&tls->ctr_drbg);
+    tls->fd = fd;
+    if (mbedtls_ctr_drbg_seed(&tls->ctr_drbg, mbedtls_entropy_func, &tls->entropy,
+                              (const unsigned char *)pers, strlen(pers)) != 0 ||
+        mbedtls_ssl_config_defaults(&tls->conf, endpoint, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+        return -1;
+    }
+    /* The TLS 1.3 client insists on verifying the stand-in's certificate;
+     * the record layer cost is what matters here. */
+    mbedtls_ssl_conf_max_tls_version(&tls->conf, MBEDTLS_SSL_VERSION_TLS1_2);
+    mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &tls->ctr_drbg);
+    if (endpoint == MBEDTLS_SSL_IS_SERVER) {
+        if (mbedtls_ssl_conf_own_cert(&tls->conf, &srv_cert, &srv_key) != 0) {
+            return -1;
+        }
+    } else {
+        mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    if (mbedtls_ssl_setup(&tls->ssl, &tls->conf) != 0) {
+        return -1;
+    }
+    mbedtls_ssl_set_bio(&tls->ssl, &tls->fd, bench_send, bench_recv, NULL);
+    return 0;
+}
+
+static void tls_free(tls_t *tls) {
+    mbedtls_ssl_free(&tls->ssl);
+    mbedtls_ssl_config_free(&tls->conf);
+    mbedtls_ctr_drbg_free(&tls->ctr_drbg);
+    mbedtls_entropy_free(&tls->entropy);
+    close(tls->fd);
+}
+
+static int write_all(tls_t *tls, const uint8_t *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        int ret = mbedtls_ssl_write(&tls->ssl, buf + off, len - off);
+        if (ret > 0) {
+            off += ret;
+        } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Broker side: one thread per connection, acking each QoS 1 publish once
+ * its delay has passed. */
+static void *broker_thread(void *arg) {
+    broker_conn_t *conn = arg;
+    uint8_t out[MQTT_COALESCE_BUFFER_SIZE];
+
+    if (mbedtls_ssl_handshake(&conn->tls.ssl) != 0) {
+        return NULL;
+    }
+    mqtt_rx_init(&conn->rx);
+    for (;;) {
+        uint64_t now = now_us();
+        int timeout_ms = 100;
+        if (conn->ack_tail != conn->ack_head) {
+            uint64_t due = conn->acks[conn->ack_tail % BENCH_ACK_QUEUE].due_us;
+            timeout_ms = due > now ? (int)((due - now + 999) / 1000) : 0;
+        }
+        struct pollfd pfd = { .fd = conn->tls.fd, .events = POLLIN };
+        if (mbedtls_ssl_get_bytes_avail(&conn->tls.ssl) > 0 || poll(&pfd, 1, timeout_ms) > 0) {
+            size_t avail;
+            uint8_t *dst = mqtt_rx_write_ptr(&conn->rx, &avail);
+            int ret = mbedtls_ssl_read(&conn->tls.ssl, dst, avail);
+            if (ret <= 0 && ret != MBEDTLS_ERR_SSL_WANT_READ) {
+                return NULL;
+            }
+            if (ret > 0) {
+                mqtt_packet_view_t view;
+                mqtt_publish_t publish;
+                size_t len = 0;
+                mqtt_rx_commit(&conn->rx, ret);
+                now = now_us();
+                while (mqtt_rx_next(&conn->rx, &view) > 0) {
+                    if (view.type == MQTT_CONNECT) {
+                        len += mqtt_encode_connack(out + len, sizeof(out) - len, false, 0);
+                    } else if (view.type == MQTT_PUBLISH && mqtt_decode_publish(&view, &publish) == 0 &&
+                               publish.qos == MQTT_QOS1 && conn->ack_head - conn->ack_tail < BENCH_ACK_QUEUE) {
+                        pending_ack_t *ack = &conn->acks[conn->ack_head++ % BENCH_ACK_QUEUE];
+                        ack->packet_id = publish.packet_id;
+                        ack->due_us = now + ack_delay_us;
+                    } else if (view.type == MQTT_DISCONNECT) {
+                        return NULL;
+                    }
+                }
+                if (len > 0 && write_all(&conn->tls, out, len) != 0) {
+                    return NULL;
+                }
+            }
+        }
+
+        size_t len = 0;
+        now = now_us();
+        while (conn->ack_tail != conn->ack_head && len + 4 <= sizeof(out) &&
+               conn->acks[conn->ack_tail % BENCH_ACK_QUEUE].due_us <= now) {
+            len += mqtt_encode_ack(out + len, sizeof(out) - len, MQTT_PUBACK,
+                                   conn->acks[conn->ack_tail++ % BENCH_ACK_QUEUE].packet_id);
+        }
+        if (len > 0 && write_all(&conn->tls, out, len) != 0) {
+            return NULL;
+        }
+    }
+}
+
+static int broker_start(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, BENCH_MAX_CONNS) != 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        return -1;
+    }
+    listen_port = ntohs(addr.sin_port);
+    return 0;
+}
+
+static int broker_accept(broker_conn_t *conn) {
+    int fd = accept(listen_fd, NULL, NULL);
+    int one = 1;
+    memset(conn, 0, sizeof(*conn));
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (tls_init(&conn->tls, fd, MBEDTLS_SSL_IS_SERVER) != 0) {
+        return -1;
+    }
+    return pthread_create(&conn->thread, NULL, broker_thread, conn);
+}
+
+static int client_connect(client_conn_t *conn, broker_conn_t *peer, int index) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(listen_port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    char client_id[32];
+    mqtt_connect_t hello = { .keepalive_sec = 60, .clean_session = true };
+    mqtt_packet_view_t view;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (broker_accept(peer) != 0 || tls_init(&conn->tls, fd, MBEDTLS_SSL_IS_CLIENT) != 0) {
+        return -1;
+    }
+    int ret;
+    while ((ret = mbedtls_ssl_handshake(&conn->tls.ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return -1;
+        }
+    }
+
+    snprintf(client_id, sizeof(client_id), "bench-%d", index);
+    hello.client_id.data = (const uint8_t *)client_id;
+    hello.client_id.len = strlen(client_id);
+    conn->tx_len = mqtt_encode_connect(conn->tx, sizeof(conn->tx), &hello);
+    if (write_all(&conn->tls, conn->tx, conn->tx_len) != 0) {
+        return -1;
+    }
+    conn->tx_len = 0;
+    mqtt_rx_init(&conn->rx);
+    do {
+        size_t avail;
+        uint8_t *dst = mqtt_rx_write_ptr(&conn->rx, &avail);
+        ret = mbedtls_ssl_read(&conn->tls.ssl, dst, avail);
+        if (ret <= 0) {
+            return -1;
+        }
+        mqtt_rx_commit(&conn->rx, ret);
+    } while (mqtt_rx_next(&conn->rx, &view) == 0);
+    if (view.type != MQTT_CONNACK) {
+        return -1;
+    }
+    conn->next_id = 1;
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Fills the window with publishes, round robin over the connection's
+ * topics, and writes the batch as one coalesced buffer. */
+static int client_send(client_conn_t *conn, uint32_t seq) {
+    char payload[96];
+    while (conn->tx_pending == 0 && conn->topic_count > 0 && conn->inflight < MQTT_INFLIGHT_WINDOW &&
+           sizeof(conn->tx) - conn->tx_len >= 256) {
+        uint16_t topic = conn->topics[conn->next_topic++ % conn->topic_count];
+        int payload_len = snprintf(payload, sizeof(payload),
+                                   "{\"sensor_id\":%u,\"type\":\"bench\",\"value\":%u.00,\"timestamp\":%u}",
+                                   topic, seq % 1000, seq);
+        seq++;
+        mqtt_publish_t publish = {
+            .topic = { (const uint8_t *)topic_names[topic], strlen(topic_names[topic]) },
+            .payload = (const uint8_t *)payload,
+            .payload_len = payload_len,
+            .qos = MQTT_QOS1,
+            .packet_id = conn->next_id
+        };
+        conn->next_id = conn->next_id == UINT16_MAX ? 1 : conn->next_id + 1;
+        conn->tx_len += mqtt_encode_publish(conn->tx + conn->tx_len, sizeof(conn->tx) - conn->tx_len, &publish);
+        conn->inflight++;
+    }
+    while (conn->tx_off < conn->tx_len) {
+        size_t chunk = conn->tx_pending ? conn->tx_pending : conn->tx_len - conn->tx_off;
+        int ret = mbedtls_ssl_write(&conn->tls.ssl, conn->tx + conn->tx_off, chunk);
+        if (ret > 0) {
+            conn->tx_off += ret;
+            conn->tx_pending = 0;
+        } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            conn->tx_pending = chunk;
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    conn->tx_len = 0;
+    conn->tx_off = 0;
+    return 0;
+}
+
+static int client_receive(client_conn_t *conn) {
+    for (;;) {
+        size_t avail;
+        uint8_t *dst = mqtt_rx_write_ptr(&conn->rx, &avail);
+        int ret = mbedtls_ssl_read(&conn->tls.ssl, dst, avail);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return 0;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        mqtt_packet_view_t view;
+        mqtt_rx_commit(&conn->rx, ret);
+        while (mqtt_rx_next(&conn->rx, &view) > 0) {
+            if (view.type == MQTT_PUBACK && conn->inflight > 0) {
+                conn->inflight--;
+                conn->acked++;
+            }
+        }
+    }
+}
+
+static double run(int conns, double seconds) {
+    uint64_t acked = 0;
+    uint32_t seq = 0;
+
+    for (int i = 0; i < conns; i++) {
+        client_conn_t *conn = &client_conns[i];
+        memset(conn, 0, sizeof(*conn));
+        if (client_connect(conn, &broker_conns[i], i) != 0) {
+            fprintf(stderr, "connection %d failed\n", i);
+            return -1;
+        }
+    }
+    for (int t = 0; t < BENCH_TOPICS; t++) {
+        client_conn_t *conn = &client_conns[topic_stripe(topic_names[t], strlen(topic_names[t]), conns)];
+        conn->topics[conn->topic_count++] = (uint16_t)t;
+    }
+
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)(seconds * 1000000.0);
+    while (now_us() < end) {
+        struct pollfd pfds[BENCH_MAX_CONNS];
+        for (int i = 0; i < conns; i++) {
+            client_conn_t *conn = &client_conns[i];
+            if (client_send(conn, seq) != 0 || client_receive(conn) != 0) {
+                fprintf(stderr, "connection %d dropped\n", i);
+                return -1;
+            }
+            seq += 7;
+            pfds[i].fd = conn->tls.fd;
+            pfds[i].events = POLLIN | (conn->tx_pending ? POLLOUT : 0);
+        }
+        poll(pfds, conns, 1);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    for (int i = 0; i < conns; i++) {
+        client_conn_t *conn = &client_conns[i];
+        uint8_t disconnect[2];
+        acked += conn->acked;
+        fcntl(conn->tls.fd, F_SETFL, fcntl(conn->tls.fd, F_GETFL) & ~O_NONBLOCK);
+        while (conn->tx_off < conn->tx_len && client_send(conn, seq) == 0) {
+        }
+        write_all(&conn->tls, disconnect, mqtt_encode_empty(disconnect, sizeof(disconnect), MQTT_DISCONNECT));
+        pthread_join(broker_conns[i].thread, NULL);
+        tls_free(&broker_conns[i].tls);
+        tls_free(&conn->tls);
+    }
+    return acked / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int max_conns = argc > 1 ? atoi(argv[1]) : 8;
+    double rtt_ms = argc > 2 ? atof(argv[2]) : 5.0;
+    double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+
+    if (max_conns < 1 || max_conns > BENCH_MAX_CONNS) {
+        fprintf(stderr, "max_connections must be 1..%d\n", BENCH_MAX_CONNS);
+        return 1;
+    }
+    ack_delay_us = (uint32_t)(rtt_ms * 1000.0);
+    for (int t = 0; t < BENCH_TOPICS; t++) {
+        snprintf(topic_names[t], sizeof(topic_names[t]), "iot/gateway/bench/sensor_%d", t);
+    }
+
+    mbedtls_x509_crt_init(&srv_cert);
+    mbedtls_pk_init(&srv_key);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0) != 0 ||
+        mbedtls_x509_crt_parse(&srv_cert, (const unsigned char *)bench_cert, sizeof(bench_cert)) != 0 ||
+        mbedtls_pk_parse_key(&srv_key, (const unsigned char *)bench_key, sizeof(bench_key), NULL, 0,
+                             mbedtls_ctr_drbg_random, &ctr_drbg) != 0 ||
+        broker_start() != 0) {
+        fprintf(stderr, "broker stand-in setup failed\n");
+        return 1;
+    }
+
+    printf("QoS 1 publishes, window %d per connection, broker ack delay %.1f ms, %.1f s per run\n",
+           MQTT_INFLIGHT_WINDOW, rtt_ms, seconds);
+    printf("%-12s %12s %10s\n", "connections", "msgs/s", "speedup");
+    double base = 0;
+    for (int conns = 1; conns <= max_conns; conns *= 2) {
+        double rate = run(conns, seconds);
+        if (rate < 0) {
+            return 1;
+        }
+        if (conns == 1) {
+            base = rate;
+        }
+        printf("%-12d %12.0f %9.2fx\n", conns, rate, base > 0 ? rate / base : 0.0);
+    }
+
+    close(listen_fd);
+    mbedtls_pk_free(&srv_key);
+    mbedtls_x509_crt_free(&srv_cert);
+    mbedtls_ctr_drbg_free(&ctr_drbg);
+    mbedtls_entropy_free(&entropy);
+    return 0;
+}
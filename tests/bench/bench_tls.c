@@ -0,0 +1,478 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_ticket.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#include "psa/crypto.h"
+#include "bench_common.h"
+
+/* TLS cost per cipher suite and authentication profile against an mbedTLS
+ * server stand-in on loopback, from the client's side. Each profile runs
+ * full handshakes, then resumed ones from a session ticket where the gateway
+ * would resume, then streams records of publish sizes over one connection.
+ * The certificate profiles verify the server's chain as the gateway does.
+ * mbedTLS is built with the project's build type, so configure with
+ * -DCMAKE_BUILD_TYPE=Release for representative numbers.
+ *
+ * usage: bench_tls [handshakes] [megabytes] [profile filter] */
+
+#define BENCH_SERVER_BUF        16384
+
+static const unsigned char bench_psk[32] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+static const char bench_identity[] = "bench-gateway";
+
+/* One sensor publish, a batch of them, and a full outgoing record. */
+static const size_t record_sizes[] = { 96, 512, 4096 };
+#define BENCH_RECORD_SIZES      (sizeof(record_sizes) / sizeof(record_sizes[0]))
+
+typedef enum {
+    AUTH_CERT,
+    AUTH_PSK,
+    AUTH_ECDHE_PSK
+} auth_t;
+
+typedef struct {
+    const char *name;
+    mbedtls_ssl_protocol_version version;
+    auth_t auth;
+    int suite;
+} profile_t;
+
+static const profile_t profiles[] = {
+    { "TLS1.2 ECDSA AES128-GCM", MBEDTLS_SSL_VERSION_TLS1_2, AUTH_CERT,
+      MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256 },
+    { "TLS1.2 ECDSA CHACHA20", MBEDTLS_SSL_VERSION_TLS1_2, AUTH_CERT,
+      MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256 },
+    { "TLS1.2 ECDHE-PSK AES128-CBC", MBEDTLS_SSL_VERSION_TLS1_2, AUTH_ECDHE_PSK,
+      MBEDTLS_TLS_ECDHE_PSK_WITH_AES_128_CBC_SHA256 },
+    { "TLS1.2 ECDHE-PSK CHACHA20", MBEDTLS_SSL_VERSION_TLS1_2, AUTH_ECDHE_PSK,
+      MBEDTLS_TLS_ECDHE_PSK_WITH_CHACHA20_POLY1305_SHA256 },
+    { "TLS1.2 PSK AES128-GCM", MBEDTLS_SSL_VERSION_TLS1_2, AUTH_PSK, MBEDTLS_TLS_PSK_WITH_AES_128_GCM_SHA256 },
+    { "TLS1.3 ECDSA AES128-GCM", MBEDTLS_SSL_VERSION_TLS1_3, AUTH_CERT, MBEDTLS_TLS1_3_AES_128_GCM_SHA256 },
+    { "TLS1.3 ECDSA AES256-GCM", MBEDTLS_SSL_VERSION_TLS1_3, AUTH_CERT, MBEDTLS_TLS1_3_AES_256_GCM_SHA384 },
+    { "TLS1.3 ECDSA CHACHA20", MBEDTLS_SSL_VERSION_TLS1_3, AUTH_CERT,
+      MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256 },
+    { "TLS1.3 ECDHE-PSK AES128-GCM", MBEDTLS_SSL_VERSION_TLS1_3, AUTH_ECDHE_PSK,
+      MBEDTLS_TLS1_3_AES_128_GCM_SHA256 },
+    { "TLS1.3 PSK AES128-GCM", MBEDTLS_SSL_VERSION_TLS1_3, AUTH_PSK, MBEDTLS_TLS1_3_AES_128_GCM_SHA256 },
+};
+#define BENCH_PROFILES          (sizeof(profiles) / sizeof(profiles[0]))
+
+typedef struct {
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    int suites[2];
+    int fd;
+} endpoint_t;
+
+typedef struct {
+    const profile_t *profile;
+    int connections;
+    size_t stream_bytes;
+    int failures;
+} server_job_t;
+
+static mbedtls_x509_crt srv_cert;
+static mbedtls_pk_context srv_key;
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context ctr_drbg;
+static mbedtls_ssl_ticket_context ticket;
+static pthread_mutex_t rng_lock = PTHREAD_MUTEX_INITIALIZER;
+static int listen_fd;
+static struct sockaddr_in listen_addr;
+static unsigned verifications;
+
+static uint64_t thread_cpu_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Both threads draw from one DRBG. */
+static int bench_random(void *ctx, unsigned char *buf, size_t len) {
+    pthread_mutex_lock(&rng_lock);
+    int ret = mbedtls_ctr_drbg_random(ctx, buf, len);
+    pthread_mutex_unlock(&rng_lock);
+    return ret;
+}
+
+static int bench_send(void *ctx, const unsigned char *buf, size_t len) {
+    int ret = send(*(int *)ctx, buf, len, MSG_NOSIGNAL);
+    return ret < 0 ? MBEDTLS_ERR_SSL_INTERNAL_ERROR : ret;
+}
+
+static int bench_recv(void *ctx, unsigned char *buf, size_t len) {
+    int ret = recv(*(int *)ctx, buf, len, 0);
+    return ret < 0 ? MBEDTLS_ERR_SSL_INTERNAL_ERROR : ret;
+}
+
+/* A resumed handshake never sees the server's certificate. */
+static int count_verify(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags) {
+    (void)ctx;
+    (void)crt;
+    (void)depth;
+    (void)flags;
+    verifications++;
+    return 0;
+}
+
+static int endpoint_init(endpoint_t *ep, const profile_t *profile, int endpoint) {
+    mbedtls_ssl_init(&ep->ssl);
+    mbedtls_ssl_config_init(&ep->conf);
+    ep->fd = -1;
+    if (mbedtls_ssl_config_defaults(&ep->conf, endpoint, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+        return -1;
+    }
+    mbedtls_ssl_conf_min_tls_version(&ep->conf, profile->version);
+    mbedtls_ssl_conf_max_tls_version(&ep->conf, profile->version);
+    ep->suites[0] = profile->suite;
+    ep->suites[1] = 0;
+    mbedtls_ssl_conf_ciphersuites(&ep->conf, ep->suites);
+    mbedtls_ssl_conf_rng(&ep->conf, bench_random, &ctr_drbg);
+    /* Certificate sessions resume from tickets, which TLS 1.3 turns into a
+     * PSK of their own. */
+    mbedtls_ssl_conf_tls13_key_exchange_modes(&ep->conf,
+        profile->auth == AUTH_CERT ? MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_ALL
+        : profile->auth == AUTH_PSK ? MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK
+        : MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK_EPHEMERAL);
+
+    if (profile->auth != AUTH_CERT) {
+        if (mbedtls_ssl_conf_psk(&ep->conf, bench_psk, sizeof(bench_psk), (const unsigned char *)bench_identity,
+                                 sizeof(bench_identity) - 1) != 0) {
+            return -1;
+        }
+    } else if (endpoint == MBEDTLS_SSL_IS_SERVER) {
+        if (mbedtls_ssl_conf_own_cert(&ep->conf, &srv_cert, &srv_key) != 0) {
+            return -1;
+        }
+    } else {
+        /* The stand-in's certificate is its own CA. */
+        mbedtls_ssl_conf_authmode(&ep->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&ep->conf, &srv_cert, NULL);
+        mbedtls_ssl_conf_verify(&ep->conf, count_verify, NULL);
+    }
+    if (endpoint == MBEDTLS_SSL_IS_SERVER) {
+        /* Without a ticket parser the 3.5 TLS 1.3 server takes every
+         * offered identity for a ticket and never consults the PSK. */
+        mbedtls_ssl_conf_session_tickets_cb(&ep->conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse,
+                                            &ticket);
+    }
+    if (mbedtls_ssl_setup(&ep->ssl, &ep->conf) != 0) {
+        return -1;
+    }
+    mbedtls_ssl_set_bio(&ep->ssl, &ep->fd, bench_send, bench_recv, NULL);
+    return 0;
+}
+
+static void endpoint_free(endpoint_t *ep) {
+    mbedtls_ssl_free(&ep->ssl);
+    mbedtls_ssl_config_free(&ep->conf);
+}
+
+/* Handshakes every connection, then reads until the client closes it,
+ * answering one byte for each stream_bytes received. */
+static void *server_thread(void *arg) {
+    server_job_t *job = arg;
+    endpoint_t ep;
+    unsigned char *buf = malloc(BENCH_SERVER_BUF);
+    int one = 1;
+
+    if (buf == NULL || endpoint_init(&ep, job->profile, MBEDTLS_SSL_IS_SERVER) != 0) {
+        job->failures = job->connections;
+        free(buf);
+        return NULL;
+    }
+    for (int i = 0; i < job->connections; i++) {
+        ep.fd = accept(listen_fd, NULL, NULL);
+        if (ep.fd >= 0) {
+            setsockopt(ep.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (ep.fd < 0 || mbedtls_ssl_handshake(&ep.ssl) != 0) {
+            job->failures++;
+        } else {
+            size_t received = 0;
+            int ret;
+            while ((ret = mbedtls_ssl_read(&ep.ssl, buf, BENCH_SERVER_BUF)) > 0) {
+                received += ret;
+                if (received == job->stream_bytes) {
+                    mbedtls_ssl_write(&ep.ssl, buf, 1);
+                    received = 0;
+                }
+            }
+        }
+        if (ep.fd >= 0) {
+            close(ep.fd);
+        }
+        mbedtls_ssl_session_reset(&ep.ssl);
+    }
+    endpoint_free(&ep);
+    free(buf);
+    return NULL;
+}
+
+static int client_connect(endpoint_t *ep) {
+    int one = 1;
+    ep->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ep->fd < 0 || connect(ep->fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) != 0) {
+        return -1;
+    }
+    return setsockopt(ep->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void client_close(endpoint_t *ep, bool notify) {
+    if (notify) {
+        mbedtls_ssl_close_notify(&ep->ssl);
+    }
+    if (ep->fd >= 0) {
+        close(ep->fd);
+        ep->fd = -1;
+    }
+    mbedtls_ssl_session_reset(&ep->ssl);
+}
+
+/* TLS 1.3 reads return WANT_READ after each post-handshake message, even
+ * on a blocking socket. With tickets set, a ticket ends the read instead. */
+static int client_read(endpoint_t *ep, unsigned char *buf, size_t len, bool tickets) {
+    int ret;
+    do {
+        ret = mbedtls_ssl_read(&ep->ssl, buf, len);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+             (!tickets && ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET));
+    return ret;
+}
+
+/* A full handshake whose ticket later ones resume from. TLS 1.3 sends the
+ * ticket after the handshake, so wait for it. */
+static int prime_session(endpoint_t *ep, mbedtls_ssl_session *session) {
+    unsigned char byte;
+    int ret = -1;
+    if (client_connect(ep) == 0 && mbedtls_ssl_handshake(&ep->ssl) == 0 &&
+        (mbedtls_ssl_get_version_number(&ep->ssl) != MBEDTLS_SSL_VERSION_TLS1_3 ||
+         client_read(ep, &byte, 1, true) == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)) {
+        ret = mbedtls_ssl_get_session(&ep->ssl, session);
+    }
+    client_close(ep, ret == 0);
+    return ret;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Connect plus handshake latency for each of count new connections. */
+static int run_handshakes(const profile_t *profile, endpoint_t *ep, const mbedtls_ssl_session *session,
+                          int count, uint32_t *latency_us) {
+    uint64_t cpu_us = 0;
+    int failures = 0;
+
+    uint64_t start = now_us();
+    for (int i = 0; i < count; i++) {
+        uint64_t begin = now_us();
+        unsigned before = verifications;
+        if (client_connect(ep) != 0 || (session != NULL && mbedtls_ssl_set_session(&ep->ssl, session) != 0)) {
+            failures++;
+            client_close(ep, false);
+            continue;
+        }
+        uint64_t cpu = thread_cpu_us();
+        int ret = mbedtls_ssl_handshake(&ep->ssl);
+        cpu_us += thread_cpu_us() - cpu;
+        latency_us[i] = (uint32_t)(now_us() - begin);
+        if (ret != 0 || (session != NULL && verifications != before)) {
+            failures++;
+        }
+        client_close(ep, ret == 0);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    if (failures > 0) {
+        fprintf(stderr, "%s: %d of %d %s handshakes failed\n", profile->name, failures, count,
+                session != NULL ? "resumed" : "full");
+        return -1;
+    }
+    qsort(latency_us, count, sizeof(latency_us[0]), cmp_u32);
+    printf("%-28s %-8s %8.0f %9.2f %9.2f %9.2f %9.0f\n", profile->name, session != NULL ? "resumed" : "full",
+           count / elapsed, latency_us[count / 2] / 1000.0, latency_us[count * 9 / 10] / 1000.0,
+           latency_us[count * 99 / 100] / 1000.0, (double)cpu_us / count);
+    return 0;
+}
+
+/* Writes total bytes in records of each size and waits for the server to
+ * acknowledge the last one. */
+static int run_records(endpoint_t *ep, size_t total, double *mbps) {
+    static unsigned char payload[4096];
+    unsigned char ack;
+    int ret = 0;
+
+    if (client_connect(ep) != 0 || mbedtls_ssl_handshake(&ep->ssl) != 0) {
+        client_close(ep, false);
+        return -1;
+    }
+    for (size_t i = 0; i < BENCH_RECORD_SIZES && ret == 0; i++) {
+        size_t sent = 0;
+        uint64_t start = now_us();
+        while (sent < total && ret == 0) {
+            size_t len = total - sent < record_sizes[i] ? total - sent : record_sizes[i];
+            int n = mbedtls_ssl_write(&ep->ssl, payload, len);
+            if (n < 0) {
+                ret = -1;
+            } else {
+                sent += n;
+            }
+        }
+        if (ret == 0 && client_read(ep, &ack, 1, false) != 1) {
+            ret = -1;
+        }
+        mbps[i] = total / ((now_us() - start) / 1e6) / 1e6;
+    }
+    client_close(ep, ret == 0);
+    return ret;
+}
+
+static int run(const profile_t *profile, int handshakes, size_t stream_bytes, double *mbps) {
+    bool resumes = profile->auth == AUTH_CERT;
+    server_job_t job = { .profile = profile, .stream_bytes = stream_bytes,
+                         .connections = handshakes + (resumes ? 1 + handshakes : 0) + 1 };
+    uint32_t *latency_us = malloc(handshakes * sizeof(uint32_t));
+    mbedtls_ssl_session session;
+    pthread_t server;
+    endpoint_t ep;
+    int ret = 0;
+
+    mbedtls_ssl_session_init(&session);
+    if (latency_us == NULL || endpoint_init(&ep, profile, MBEDTLS_SSL_IS_CLIENT) != 0 ||
+        mbedtls_ssl_set_hostname(&ep.ssl, "localhost") != 0 ||
+        pthread_create(&server, NULL, server_thread, &job) != 0) {
+        fprintf(stderr, "%s: setup failed\n", profile->name);
+        free(latency_us);
+        return -1;
+    }
+
+    /* Every step takes its connections from the server whatever happened
+     * to the one before, so the server thread always finishes. */
+    if (run_handshakes(profile, &ep, NULL, handshakes, latency_us) != 0) {
+        ret = -1;
+    }
+    if (resumes) {
+        if (prime_session(&ep, &session) != 0) {
+            fprintf(stderr, "%s: no session to resume\n", profile->name);
+            ret = -1;
+            /* Hand the server its remaining connections. */
+            for (int i = 0; i < handshakes; i++) {
+                client_connect(&ep);
+                client_close(&ep, false);
+            }
+        } else if (run_handshakes(profile, &ep, &session, handshakes, latency_us) != 0) {
+            ret = -1;
+        }
+    }
+    if (run_records(&ep, stream_bytes, mbps) != 0) {
+        fprintf(stderr, "%s: record stream failed\n", profile->name);
+        ret = -1;
+    }
+
+    pthread_join(server, NULL);
+    mbedtls_ssl_session_free(&session);
+    endpoint_free(&ep);
+    free(latency_us);
+    if (job.failures > 0) {
+        fprintf(stderr, "%s: %d server handshakes failed\n", profile->name, job.failures);
+        ret = -1;
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int handshakes = argc > 1 ? atoi(argv[1]) : 100;
+    double megabytes = argc > 2 ? atof(argv[2]) : 4.0;
+    const char *filter = argc > 3 ? argv[3] : NULL;
+    size_t stream_bytes = (size_t)(megabytes * 1e6);
+    double mbps[BENCH_PROFILES][BENCH_RECORD_SIZES];
+    bool ran[BENCH_PROFILES] = { false };
+    socklen_t addr_len = sizeof(listen_addr);
+    int status = 0;
+
+    if (handshakes < 1 || stream_bytes < 1) {
+        fprintf(stderr, "usage: bench_tls [handshakes] [megabytes] [profile filter]\n");
+        return 1;
+    }
+    mbedtls_x509_crt_init(&srv_cert);
+    mbedtls_pk_init(&srv_key);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_ssl_ticket_init(&ticket);
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (psa_crypto_init() != PSA_SUCCESS ||
+        mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0) != 0 ||
+        mbedtls_ssl_ticket_setup(&ticket, bench_random, &ctr_drbg, MBEDTLS_CIPHER_AES_128_GCM, 86400) != 0 ||
+        mbedtls_x509_crt_parse(&srv_cert, (const unsigned char *)bench_cert, sizeof(bench_cert)) != 0 ||
+        mbedtls_pk_parse_key(&srv_key, (const unsigned char *)bench_key, sizeof(bench_key), NULL, 0,
+                             mbedtls_ctr_drbg_random, &ctr_drbg) != 0 ||
+        listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) != 0 ||
+        listen(listen_fd, 16) != 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&listen_addr, &addr_len) != 0) {
+        fprintf(stderr, "server stand-in setup failed\n");
+        return 1;
+    }
+
+    printf("%d handshakes of each kind per profile, client side latency and CPU\n", handshakes);
+    printf("%-28s %-8s %8s %9s %9s %9s %9s\n", "profile", "session", "hs/s", "p50 ms", "p90 ms", "p99 ms",
+           "CPU us");
+    for (size_t i = 0; i < BENCH_PROFILES; i++) {
+        if (filter != NULL && strstr(profiles[i].name, filter) == NULL) {
+            continue;
+        }
+        if (run(&profiles[i], handshakes, stream_bytes, mbps[i]) != 0) {
+            status = 1;
+        } else {
+            ran[i] = true;
+        }
+    }
+
+    printf("\n%.1f MB streamed per record size, MB/s\n", megabytes);
+    printf("%-28s", "profile");
+    for (size_t j = 0; j < BENCH_RECORD_SIZES; j++) {
+        printf(" %7zu B", record_sizes[j]);
+    }
+    printf("\n");
+    for (size_t i = 0; i < BENCH_PROFILES; i++) {
+        if (!ran[i]) {
+            continue;
+        }
+        printf("%-28s", profiles[i].name);
+        for (size_t j = 0; j < BENCH_RECORD_SIZES; j++) {
+            printf(" %9.1f", mbps[i][j]);
+        }
+        printf("\n");
+    }
+
+    close(listen_fd);
+    mbedtls_ssl_ticket_free(&ticket);
+    mbedtls_pk_free(&srv_key);
+    mbedtls_x509_crt_free(&srv_cert);
+    mbedtls_ctr_drbg_free(&ctr_drbg);
+    mbedtls_entropy_free(&entropy);
+    mbedtls_psa_crypto_free();
+    return status;
+}
@@ -0,0 +1,25 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/* Minimal harness shared by the unit tests: CHECK() counts and reports
+ * each failed condition, check_report() prints the totals and gives the
+ * exit status for ctest. */
+static int failures;
+static int checks;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { \
+        failures++; \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+static inline int check_report(void) {
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#include "dns_cache.h"
+#include "check.h"
+
+/* Built with DNS_CACHE_RETRY_SEC at 1, so the retry schedule plays out in
+ * real time. */
+static unsigned int resolve_attempts;
+
+uint64_t get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* The stub resolver logs every address it rejects, once per attempt. */
+void net_log(const char *format, ...) {
+    if (strncmp(format, "DNS Ignoring invalid stub address", 33) == 0) {
+        __atomic_add_fetch(&resolve_attempts, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static unsigned int attempts(void) {
+    return __atomic_load_n(&resolve_attempts, __ATOMIC_SEQ_CST);
+}
+
+/* Polls the way a resolving lane does, every millisecond, until ms after
+ * the start of the test. */
+static int poll_until(uint64_t start_us, int ms) {
+    dns_addr_t addrs[DNS_CACHE_MAX_ADDRS];
+    int count = 0;
+    while (get_time_us() < start_us + ms * 1000ULL) {
+        count = dns_cache_get(addrs, DNS_CACHE_MAX_ADDRS, 0);
+        usleep(1000);
+    }
+    return count;
+}
+
+static void test_failing_name_retry(void) {
+    setenv(DNS_STUB_ENV, "not-an-address", 1);
+    uint64_t start_us = get_time_us();
+    CHECK(dns_cache_init("broker.invalid", 8883) == 0);
+
+    CHECK(poll_until(start_us, 500) == 0);
+    CHECK(attempts() == 1);
+
+    /* One retry per DNS_CACHE_RETRY_SEC however often the cache is asked */
+    CHECK(poll_until(start_us, 1500) == 0);
+    CHECK(attempts() == 2);
+    CHECK(poll_until(start_us, 2500) == 0);
+    CHECK(attempts() == 3);
+
+    dns_cache_shutdown();
+}
+
+int main(void) {
+    test_failing_name_retry();
+
+    return check_report();
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "ktls.h"
+#include "psa/crypto.h"
+#include "check.h"
+
+void net_log(const char *format, ...) {
+    (void)format;
+}
+
+static size_t from_hex(const char *hex, unsigned char *out) {
+    size_t len = 0;
+    for (; hex[0] != '\0' && hex[1] != '\0'; hex += 2) {
+        unsigned int byte;
+        sscanf(hex, "%2x", &byte);
+        out[len++] = (unsigned char)byte;
+    }
+    return len;
+}
+
+static bool matches(const unsigned char *bytes, const char *hex) {
+    unsigned char expected[64];
+    size_t len = from_hex(hex, expected);
+    return memcmp(bytes, expected, len) == 0;
+}
+
+/* RFC 8448 section 3, simple 1-RTT handshake: client application traffic
+ * secret to the client's TLS_AES_128_GCM_SHA256 write key and IV. */
+static void test_tls13_rfc8448(void) {
+    ktls_secrets_t secrets;
+    unsigned char key[32];
+    unsigned char iv[12];
+
+    memset(&secrets, 0, sizeof(secrets));
+    secrets.secret_len = from_hex("9e40646ce79a7f9dc05af8889bce6552875afa0b06df0087f792ebb7c17504a5",
+                                  secrets.secret);
+    CHECK(ktls_derive_client_keys(&secrets, true, 16, 12, key, iv) == 0);
+    CHECK(matches(key, "17422dda596ed5d9acd890e3c63f5051"));
+    CHECK(matches(iv, "5b78923dee08579033e523d9"));
+}
+
+/* A 48-byte secret selects SHA-384, as TLS_AES_256_GCM_SHA384 uses. */
+static void test_tls13_sha384(void) {
+    ktls_secrets_t secrets;
+    unsigned char key[32];
+    unsigned char iv[12];
+
+    memset(&secrets, 0, sizeof(secrets));
+    for (int i = 0; i < 48; i++) {
+        secrets.secret[i] = (unsigned char)i;
+    }
+    secrets.secret_len = 48;
+    CHECK(ktls_derive_client_keys(&secrets, true, 32, 12, key, iv) == 0);
+    CHECK(matches(key, "6877d022f1c61d24ebb7487c16752d9a4798e40431c75b39320e537c90e23225"));
+    CHECK(matches(iv, "42822531a0fe88648fc09e9f"));
+}
+
+/* The key block is PRF(master, "key expansion", server_random +
+ * client_random); the client write key comes first and the client IV
+ * follows both keys. Expected values come from an independent P_hash
+ * that reproduces the published TLS 1.2 PRF test vector. */
+static void test_tls12_key_block(void) {
+    ktls_secrets_t secrets;
+    unsigned char key[32];
+    unsigned char iv[12];
+
+    memset(&secrets, 0, sizeof(secrets));
+    for (int i = 0; i < 48; i++) {
+        secrets.secret[i] = (unsigned char)i;
+    }
+    for (int i = 0; i < 64; i++) {
+        secrets.randoms[i] = (unsigned char)(0x40 + i);
+    }
+    secrets.secret_len = 48;
+
+    secrets.prf = MBEDTLS_SSL_TLS_PRF_SHA256;
+    CHECK(ktls_derive_client_keys(&secrets, false, 16, 4, key, iv) == 0);
+    CHECK(matches(key, "25b8932c0824c8f2962638ec1c6ec99e"));
+    CHECK(matches(iv, "17053567"));
+
+    secrets.prf = MBEDTLS_SSL_TLS_PRF_SHA384;
+    CHECK(ktls_derive_client_keys(&secrets, false, 32, 4, key, iv) == 0);
+    CHECK(matches(key, "3288e85d38fe09d3dcbb30ef211d546e81c947e4be7963709d27eb6d5f082fcb"));
+    CHECK(matches(iv, "b1a66b28"));
+}
+
+int main(void) {
+    if (psa_crypto_init() != PSA_SUCCESS) {
+        printf("PSA crypto init failed\n");
+        return 1;
+    }
+    test_tls13_rfc8448();
+    test_tls13_sha384();
+    test_tls12_key_block();
+
+    return check_report();
+}
@@ -0,0 +1,617 @@
+#include <stdio.h>
+#include <string.h>
+#include "mqtt.h"
+#include "check.h"
+
+#define STR(s) ((mqtt_str_t){ (const uint8_t *)(s), (uint16_t)(sizeof(s) - 1) })
+
+static int str_eq(const mqtt_str_t *str, const char *expected) {
+    return str->len == strlen(expected) && memcmp(str->data, expected, str->len) == 0;
+}
+
+static void test_remaining_length(void) {
+    static const struct {
+        uint32_t value;
+        uint8_t bytes[4];
+        int len;
+    } cases[] = {
+        { 0, { 0x00 }, 1 },
+        { 127, { 0x7F }, 1 },
+        { 128, { 0x80, 0x01 }, 2 },
+        { 16383, { 0xFF, 0x7F }, 2 },
+        { 16384, { 0x80, 0x80, 0x01 }, 3 },
+        { 2097151, { 0xFF, 0xFF, 0x7F }, 3 },
+        { 2097152, { 0x80, 0x80, 0x80, 0x01 }, 4 },
+        { MQTT_MAX_REMAINING_LEN, { 0xFF, 0xFF, 0xFF, 0x7F }, 4 },
+    };
+    uint8_t buf[4];
+    uint32_t decoded;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        CHECK(mqtt_encode_length(buf, sizeof(buf), cases[i].value) == cases[i].len);
+        CHECK(memcmp(buf, cases[i].bytes, cases[i].len) == 0);
+        CHECK(mqtt_decode_length(buf, cases[i].len, &decoded) == cases[i].len);
+        CHECK(decoded == cases[i].value);
+        CHECK(mqtt_decode_length(buf, cases[i].len - 1, &decoded) == 0);
+    }
+    CHECK(mqtt_encode_length(buf, sizeof(buf), MQTT_MAX_REMAINING_LEN + 1) == -1);
+    CHECK(mqtt_encode_length(buf, 1, 128) == -1);
+
+    static const uint8_t overlong[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+    CHECK(mqtt_decode_length(overlong, sizeof(overlong), &decoded) == -1);
+}
+
+static void test_connect_roundtrip(void) {
+    uint8_t buf[128];
+    mqtt_connect_t in, out;
+    mqtt_packet_view_t view;
+
+    memset(&in, 0, sizeof(in));
+    in.client_id = STR("gateway");
+    in.clean_session = true;
+    in.keepalive_sec = 60;
+    in.has_will = true;
+    in.will_topic = STR("status");
+    in.will_payload = STR("offline");
+    in.will_qos = MQTT_QOS1;
+    in.will_retain = true;
+    in.has_username = true;
+    in.username = STR("user");
+    in.has_password = true;
+    in.password = STR("secret");
+
+    int len = mqtt_encode_connect(buf, sizeof(buf), &in);
+    CHECK(len == 2 + 10 + 9 + 8 + 9 + 6 + 8);
+    CHECK(buf[0] == MQTT_CONNECT);
+    CHECK(buf[9] == 0xEE);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_connect(&view, &out) == 0);
+    CHECK(str_eq(&out.client_id, "gateway"));
+    CHECK(str_eq(&out.will_topic, "status"));
+    CHECK(str_eq(&out.will_payload, "offline"));
+    CHECK(str_eq(&out.username, "user"));
+    CHECK(str_eq(&out.password, "secret"));
+    CHECK(out.keepalive_sec == 60 && out.clean_session && out.will_retain);
+    CHECK(out.will_qos == MQTT_QOS1);
+
+    for (int size = 0; size < len; size++) {
+        CHECK(mqtt_encode_connect(buf, size, &in) == -1);
+    }
+
+    in.has_username = false;
+    CHECK(mqtt_encode_connect(buf, sizeof(buf), &in) == -1);
+}
+
+static void test_connect_minimal(void) {
+    static const uint8_t expected[] = {
+        0x10, 0x0F, 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 0x3C,
+        0x00, 0x03, 'a', 'b', 'c'
+    };
+    uint8_t buf[64];
+    mqtt_connect_t in;
+
+    memset(&in, 0, sizeof(in));
+    in.client_id = STR("abc");
+    in.clean_session = true;
+    in.keepalive_sec = 60;
+    CHECK(mqtt_encode_connect(buf, sizeof(buf), &in) == (int)sizeof(expected));
+    CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+}
+
+static void test_connack(void) {
+    uint8_t buf[4];
+    mqtt_packet_view_t view;
+    bool session_present;
+    uint8_t code;
+
+    CHECK(mqtt_encode_connack(buf, sizeof(buf), true, 0x05) == 4);
+    CHECK(mqtt_decode_packet(buf, 4, &view) == 4);
+    CHECK(mqtt_decode_connack(&view, &session_present, &code) == 0);
+    CHECK(session_present && code == 0x05);
+    CHECK(mqtt_encode_connack(buf, 3, false, 0) == -1);
+
+    buf[2] = 0x02;
+    CHECK(mqtt_decode_connack(&view, &session_present, &code) == -1);
+}
+
+static void test_publish(void) {
+    static const uint8_t payload[] = "{\"value\":21.50}";
+    uint8_t buf[128];
+    uint8_t header[64];
+    mqtt_iovec_t iov[2];
+    mqtt_packet_view_t view;
+    mqtt_publish_t out;
+    mqtt_publish_t in = {
+        .topic = STR("iot/gateway/temperature/sensor_0"),
+        .payload = payload,
+        .payload_len = sizeof(payload) - 1,
+        .qos = MQTT_QOS1,
+        .retain = true,
+        .dup = true,
+        .packet_id = 0x1234
+    };
+
+    int len = mqtt_encode_publish(buf, sizeof(buf), &in);
+    CHECK(len == 2 + 2 + 32 + 2 + 15);
+    CHECK(buf[0] == (MQTT_PUBLISH | MQTT_PUBLISH_DUP | (MQTT_QOS1 << 1) | MQTT_PUBLISH_RETAIN));
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_publish(&view, &out) == 0);
+    CHECK(str_eq(&out.topic, "iot/gateway/temperature/sensor_0"));
+    CHECK(out.packet_id == 0x1234 && out.qos == MQTT_QOS1 && out.dup && out.retain);
+    CHECK(out.payload_len == in.payload_len && memcmp(out.payload, payload, out.payload_len) == 0);
+
+    int hdr = mqtt_encode_publish_header(header, sizeof(header), &in);
+    CHECK(hdr == len - (int)in.payload_len);
+    CHECK(memcmp(header, buf, hdr) == 0);
+
+    CHECK(mqtt_publish_iov(header, sizeof(header), &in, iov) == 2);
+    CHECK(iov[0].base == header && iov[0].len == (size_t)hdr);
+    CHECK(iov[1].base == payload && iov[1].len == in.payload_len);
+
+    for (int size = 0; size < len; size++) {
+        CHECK(mqtt_encode_publish(buf, size, &in) == -1);
+    }
+    CHECK(mqtt_encode_publish_header(header, hdr - 1, &in) == -1);
+
+    in.qos = MQTT_QOS0;
+    CHECK(mqtt_encode_publish(buf, sizeof(buf), &in) == -1);
+    in.dup = false;
+    len = mqtt_encode_publish(buf, sizeof(buf), &in);
+    CHECK(len == 2 + 2 + 32 + 15);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_publish(&view, &out) == 0);
+    CHECK(out.packet_id == 0 && out.qos == MQTT_QOS0);
+
+    in.qos = 3;
+    CHECK(mqtt_encode_publish(buf, sizeof(buf), &in) == -1);
+    in.qos = MQTT_QOS1;
+    in.packet_id = 0;
+    CHECK(mqtt_encode_publish(buf, sizeof(buf), &in) == -1);
+}
+
+static void test_publish_large_payload(void) {
+    static uint8_t payload[20000];
+    uint8_t header[64];
+    mqtt_iovec_t iov[2];
+    mqtt_publish_t in = {
+        .topic = STR("batch"),
+        .payload = payload,
+        .payload_len = sizeof(payload),
+        .qos = MQTT_QOS0
+    };
+
+    CHECK(mqtt_publish_iov(header, sizeof(header), &in, iov) == 2);
+    CHECK(iov[0].len == 1 + 3 + 2 + 5);
+    CHECK(header[1] == 0xA7 && header[2] == 0x9C && header[3] == 0x01);
+}
+
+static void test_acks(void) {
+    static const uint8_t types[] = { MQTT_PUBACK, MQTT_PUBREC, MQTT_PUBREL, MQTT_PUBCOMP, MQTT_UNSUBACK };
+    uint8_t buf[4];
+    mqtt_packet_view_t view;
+    uint16_t packet_id;
+
+    for (size_t i = 0; i < sizeof(types); i++) {
+        CHECK(mqtt_encode_ack(buf, sizeof(buf), types[i], 0xBEEF) == 4);
+        CHECK(buf[0] == (types[i] | (types[i] == MQTT_PUBREL ? 0x02 : 0x00)));
+        CHECK(mqtt_decode_packet(buf, 4, &view) == 4);
+        CHECK(mqtt_decode_ack(&view, &packet_id) == 0 && packet_id == 0xBEEF);
+    }
+    CHECK(mqtt_encode_ack(buf, sizeof(buf), MQTT_CONNACK, 1) == -1);
+    CHECK(mqtt_encode_ack(buf, 3, MQTT_PUBACK, 1) == -1);
+
+    static const uint8_t bad_pubrel[] = { MQTT_PUBREL, 0x02, 0x00, 0x01 };
+    CHECK(mqtt_decode_packet(bad_pubrel, sizeof(bad_pubrel), &view) == 4);
+    CHECK(mqtt_decode_ack(&view, &packet_id) == -1);
+    static const uint8_t short_puback[] = { MQTT_PUBACK, 0x01, 0x00 };
+    CHECK(mqtt_decode_packet(short_puback, sizeof(short_puback), &view) == 3);
+    CHECK(mqtt_decode_ack(&view, &packet_id) == -1);
+}
+
+static void test_subscribe(void) {
+    uint8_t buf[64];
+    mqtt_packet_view_t view;
+    mqtt_subscription_t subs[] = {
+        { STR("gateway/+/cmd"), MQTT_QOS1 },
+        { STR("gateway/#"), MQTT_QOS0 }
+    };
+    mqtt_subscription_t out[2];
+    uint16_t packet_id;
+    size_t count;
+
+    int len = mqtt_encode_subscribe(buf, sizeof(buf), 7, subs, 2);
+    CHECK(len == 2 + 2 + 16 + 12);
+    CHECK(buf[0] == (MQTT_SUBSCRIBE | 0x02));
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_subscribe(&view, &packet_id, out, 2, &count) == 0);
+    CHECK(packet_id == 7 && count == 2);
+    CHECK(str_eq(&out[0].filter, "gateway/+/cmd") && out[0].qos == MQTT_QOS1);
+    CHECK(str_eq(&out[1].filter, "gateway/#") && out[1].qos == MQTT_QOS0);
+    CHECK(mqtt_decode_subscribe(&view, &packet_id, out, 1, &count) == -1);
+    CHECK(mqtt_encode_subscribe(buf, len - 1, 7, subs, 2) == -1);
+    CHECK(mqtt_encode_subscribe(buf, sizeof(buf), 0, subs, 2) == -1);
+
+    static const uint8_t codes[] = { 0x01, MQTT_SUBACK_FAILURE };
+    const uint8_t *out_codes;
+    len = mqtt_encode_suback(buf, sizeof(buf), 7, codes, 2);
+    CHECK(len == 6);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_suback(&view, &packet_id, &out_codes, &count) == 0);
+    CHECK(packet_id == 7 && count == 2 && out_codes[1] == MQTT_SUBACK_FAILURE);
+    buf[4] = 0x03;
+    CHECK(mqtt_decode_suback(&view, &packet_id, &out_codes, &count) == -1);
+
+    mqtt_str_t filters[] = { STR("a/b"), STR("c") };
+    mqtt_str_t out_filters[2];
+    len = mqtt_encode_unsubscribe(buf, sizeof(buf), 9, filters, 2);
+    CHECK(len == 2 + 2 + 5 + 3);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_unsubscribe(&view, &packet_id, out_filters, 2, &count) == 0);
+    CHECK(packet_id == 9 && count == 2 && str_eq(&out_filters[1], "c"));
+}
+
+static void test_empty_packets(void) {
+    uint8_t buf[2];
+    CHECK(mqtt_encode_empty(buf, 2, MQTT_PINGREQ) == 2 && buf[0] == MQTT_PINGREQ && buf[1] == 0);
+    CHECK(mqtt_encode_empty(buf, 2, MQTT_DISCONNECT) == 2 && buf[0] == MQTT_DISCONNECT);
+    CHECK(mqtt_encode_empty(buf, 1, MQTT_PINGRESP) == -1);
+    CHECK(mqtt_encode_empty(buf, 2, MQTT_PUBLISH) == -1);
+}
+
+static void test_truncated_bodies(void) {
+    static const uint8_t publish[] = { MQTT_PUBLISH | 0x02, 0x05, 0x00, 0x09, 'a', 'b', 'c' };
+    static const uint8_t connect[] = { MQTT_CONNECT, 0x06, 0x00, 0x04, 'M', 'Q', 'T', 'T' };
+    mqtt_packet_view_t view;
+    mqtt_publish_t pub;
+    mqtt_connect_t conn;
+
+    CHECK(mqtt_decode_packet(publish, sizeof(publish), &view) == (int)sizeof(publish));
+    CHECK(mqtt_decode_publish(&view, &pub) == -1);
+    CHECK(mqtt_decode_packet(connect, sizeof(connect), &view) == (int)sizeof(connect));
+    CHECK(mqtt_decode_connect(&view, &conn) == -1);
+    CHECK(mqtt_decode_packet(publish, sizeof(publish) - 1, &view) == 0);
+}
+
+static void test_rx_ring_wrap(void) {
+    static mqtt_rx_ring_t ring;
+    uint8_t packet[600];
+    mqtt_packet_view_t view;
+    mqtt_publish_t pub;
+    mqtt_publish_t in = {
+        .topic = STR("t"),
+        .payload = packet + 300,
+        .payload_len = 250,
+        .qos = MQTT_QOS1,
+        .packet_id = 1
+    };
+    int decoded = 0;
+
+    mqtt_rx_init(&ring);
+    for (int round = 0; round < 20; round++) {
+        uint8_t encoded[300];
+        int len = mqtt_encode_publish(encoded, sizeof(encoded), &in);
+        size_t off = 0;
+        while (off < (size_t)len) {
+            size_t avail;
+            uint8_t *dst = mqtt_rx_write_ptr(&ring, &avail);
+            size_t n = (size_t)len - off < avail ? (size_t)len - off : avail;
+            memcpy(dst, encoded + off, n);
+            mqtt_rx_commit(&ring, n);
+            off += n;
+        }
+        while (mqtt_rx_next(&ring, &view) > 0) {
+            CHECK(mqtt_decode_publish(&view, &pub) == 0);
+            CHECK(pub.packet_id == in.packet_id && pub.payload_len == 250);
+            decoded++;
+        }
+        in.packet_id++;
+    }
+    CHECK(decoded == 20);
+}
+
+/* A packet larger than the ring is skipped whole, however it is split
+ * across reads, and the packets around it still come through. */
+static void test_rx_ring_oversized(void) {
+    static mqtt_rx_ring_t ring;
+    static uint8_t payload[3 * MQTT_RX_RING_SIZE];
+    static uint8_t stream[4 * MQTT_RX_RING_SIZE];
+    mqtt_packet_view_t view;
+    mqtt_publish_t pub;
+    mqtt_publish_t in = {
+        .topic = STR("cmd/a"),
+        .payload = payload,
+        .qos = MQTT_QOS1,
+        .packet_id = 1
+    };
+    size_t len = 0;
+    int decoded = 0;
+
+    in.payload_len = 10;
+    len += mqtt_encode_publish(stream + len, sizeof(stream) - len, &in);
+    in.payload_len = sizeof(payload);
+    in.packet_id = 2;
+    len += mqtt_encode_publish(stream + len, sizeof(stream) - len, &in);
+    in.payload_len = 20;
+    in.packet_id = 3;
+    len += mqtt_encode_publish(stream + len, sizeof(stream) - len, &in);
+
+    mqtt_rx_init(&ring);
+    for (size_t off = 0; off < len;) {
+        size_t avail;
+        uint8_t *dst = mqtt_rx_write_ptr(&ring, &avail);
+        size_t n = len - off < avail ? len - off : avail;
+        n = n > 700 ? 700 : n;
+        memcpy(dst, stream + off, n);
+        mqtt_rx_commit(&ring, n);
+        off += n;
+        int ret;
+        while ((ret = mqtt_rx_next(&ring, &view)) > 0) {
+            CHECK(mqtt_decode_publish(&view, &pub) == 0);
+            CHECK(pub.packet_id == (decoded == 0 ? 1 : 3));
+            decoded++;
+        }
+        CHECK(ret == 0);
+    }
+    CHECK(decoded == 2);
+    CHECK(ring.oversized == 1 && ring.discard == 0);
+}
+
+static void test_v5_connect(void) {
+    static const uint8_t expected[] = {
+        0x10, 0x13, 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x05, 0x02, 0x00, 0x3C,
+        0x03, MQTT_PROP_RECEIVE_MAXIMUM, 0x00, 0x10, 0x00, 0x03, 'a', 'b', 'c'
+    };
+    uint8_t buf[64];
+    mqtt_properties_t props;
+    mqtt_connect_t in, out;
+    mqtt_packet_view_t view;
+
+    memset(&props, 0, sizeof(props));
+    props.present = MQTT_HAS_RECEIVE_MAXIMUM;
+    props.receive_maximum = 16;
+    memset(&in, 0, sizeof(in));
+    in.protocol_level = MQTT_PROTOCOL_LEVEL_5;
+    in.properties = &props;
+    in.client_id = STR("abc");
+    in.clean_session = true;
+    in.keepalive_sec = 60;
+
+    int len = mqtt_encode_connect(buf, sizeof(buf), &in);
+    CHECK(len == (int)sizeof(expected));
+    CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_connect(&view, &out) == 0);
+    CHECK(out.protocol_level == MQTT_PROTOCOL_LEVEL_5 && str_eq(&out.client_id, "abc"));
+
+    in.has_will = true;
+    in.will_topic = STR("w");
+    in.will_payload = STR("x");
+    len = mqtt_encode_connect(buf, sizeof(buf), &in);
+    CHECK(len == (int)sizeof(expected) + 1 + 3 + 3);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_connect(&view, &out) == 0);
+    CHECK(str_eq(&out.will_topic, "w") && str_eq(&out.will_payload, "x"));
+
+    in.protocol_level = 3;
+    CHECK(mqtt_encode_connect(buf, sizeof(buf), &in) == -1);
+}
+
+static void test_v5_connack(void) {
+    uint8_t buf[64];
+    mqtt_properties_t in, out;
+    mqtt_packet_view_t view;
+    bool session_present;
+    uint8_t reason;
+
+    memset(&in, 0, sizeof(in));
+    in.present = MQTT_HAS_RECEIVE_MAXIMUM | MQTT_HAS_TOPIC_ALIAS_MAXIMUM |
+                 MQTT_HAS_MAXIMUM_QOS | MQTT_HAS_MAXIMUM_PACKET_SIZE | MQTT_HAS_ASSIGNED_CLIENT_ID;
+    in.receive_maximum = 20;
+    in.topic_alias_maximum = 10;
+    in.maximum_qos = 1;
+    in.maximum_packet_size = 65536;
+    in.assigned_client_id = STR("auto-1");
+
+    int len = mqtt_encode_connack_v5(buf, sizeof(buf), false, MQTT_RC_SUCCESS, &in);
+    CHECK(len == 2 + 2 + 1 + 3 + 3 + 2 + 5 + 9);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_connack_v5(&view, &session_present, &reason, &out) == 0);
+    CHECK(!session_present && reason == MQTT_RC_SUCCESS);
+    CHECK(out.present == in.present);
+    CHECK(out.receive_maximum == 20 && out.topic_alias_maximum == 10);
+    CHECK(out.maximum_qos == 1 && out.maximum_packet_size == 65536);
+    CHECK(str_eq(&out.assigned_client_id, "auto-1"));
+
+    /* A 3.1.1 broker refusing the protocol level. */
+    static const uint8_t v3_reject[] = { MQTT_CONNACK, 0x02, 0x00, 0x01 };
+    CHECK(mqtt_decode_packet(v3_reject, sizeof(v3_reject), &view) == 4);
+    CHECK(mqtt_decode_connack_v5(&view, &session_present, &reason, &out) == 0);
+    CHECK(reason == 0x01 && out.present == 0);
+}
+
+static void test_v5_publish_alias(void) {
+    static const uint8_t payload[] = "21.5";
+    uint8_t buf[128];
+    mqtt_properties_t props, out_props;
+    mqtt_packet_view_t view;
+    mqtt_publish_t out;
+
+    memset(&props, 0, sizeof(props));
+    props.present = MQTT_HAS_MESSAGE_EXPIRY | MQTT_HAS_TOPIC_ALIAS;
+    props.message_expiry = 300;
+    props.topic_alias = 3;
+    mqtt_publish_t in = {
+        .topic = STR("iot/gateway/temperature/sensor_0"),
+        .properties = &props,
+        .payload = payload,
+        .payload_len = 4,
+        .qos = MQTT_QOS1,
+        .packet_id = 42
+    };
+
+    int full = mqtt_encode_publish(buf, sizeof(buf), &in);
+    CHECK(full == 2 + 2 + 32 + 2 + 1 + 5 + 3 + 4);
+    CHECK(mqtt_decode_packet(buf, full, &view) == full);
+    CHECK(mqtt_decode_publish_v5(&view, &out, &out_props) == 0);
+    CHECK(str_eq(&out.topic, "iot/gateway/temperature/sensor_0") && out.packet_id == 42);
+    CHECK(out_props.message_expiry == 300 && out_props.topic_alias == 3);
+    CHECK(out.payload_len == 4 && memcmp(out.payload, payload, 4) == 0);
+
+    in.topic.len = 0;
+    int aliased = mqtt_encode_publish(buf, sizeof(buf), &in);
+    CHECK(aliased == full - 32);
+    CHECK(mqtt_decode_packet(buf, aliased, &view) == aliased);
+    CHECK(mqtt_decode_publish_v5(&view, &out, &out_props) == 0);
+    CHECK(out.topic.len == 0 && out_props.topic_alias == 3);
+    CHECK(mqtt_decode_publish(&view, &out) == -1);
+
+    static const uint8_t no_alias[] = { MQTT_PUBLISH, 0x07, 0x00, 0x00, 0x00, 0x01, 0x00, 'a', 'b' };
+    CHECK(mqtt_decode_packet(no_alias, sizeof(no_alias), &view) == (int)sizeof(no_alias));
+    CHECK(mqtt_decode_publish_v5(&view, &out, &out_props) == -1);
+    props.present = MQTT_HAS_MESSAGE_EXPIRY;
+    CHECK(mqtt_encode_publish(buf, sizeof(buf), &in) == -1);
+    in.properties = NULL;
+    CHECK(mqtt_encode_publish(buf, sizeof(buf), &in) == -1);
+}
+
+static void test_v5_acks(void) {
+    uint8_t buf[32];
+    mqtt_packet_view_t view;
+    mqtt_properties_t props;
+    uint16_t packet_id;
+    uint8_t reason;
+
+    CHECK(mqtt_encode_ack_v5(buf, sizeof(buf), MQTT_PUBACK, 7, MQTT_RC_SUCCESS) == 4);
+    CHECK(mqtt_decode_packet(buf, 4, &view) == 4);
+    CHECK(mqtt_decode_ack_v5(&view, &packet_id, &reason, &props) == 0);
+    CHECK(packet_id == 7 && reason == MQTT_RC_SUCCESS);
+
+    CHECK(mqtt_encode_ack_v5(buf, sizeof(buf), MQTT_PUBACK, 8, MQTT_RC_QUOTA_EXCEEDED) == 5);
+    CHECK(mqtt_decode_packet(buf, 5, &view) == 5);
+    CHECK(mqtt_decode_ack_v5(&view, &packet_id, &reason, &props) == 0);
+    CHECK(packet_id == 8 && reason == MQTT_RC_QUOTA_EXCEEDED);
+    CHECK(mqtt_decode_ack(&view, &packet_id) == -1);
+
+    static const uint8_t with_reason[] = {
+        MQTT_PUBACK, 0x0B, 0x00, 0x09, 0x97, 0x07, MQTT_PROP_REASON_STRING, 0x00, 0x04, 'f', 'u', 'l', 'l'
+    };
+    CHECK(mqtt_decode_packet(with_reason, sizeof(with_reason), &view) == (int)sizeof(with_reason));
+    CHECK(mqtt_decode_ack_v5(&view, &packet_id, &reason, &props) == 0);
+    CHECK(packet_id == 9 && reason == 0x97 && str_eq(&props.reason_string, "full"));
+
+    CHECK(mqtt_encode_disconnect_v5(buf, sizeof(buf), MQTT_RC_SUCCESS) == 2);
+    CHECK(mqtt_encode_disconnect_v5(buf, sizeof(buf), MQTT_RC_UNSPECIFIED_ERROR) == 3 && buf[2] == 0x80);
+    CHECK(mqtt_encode_disconnect_v5(buf, 2, MQTT_RC_UNSPECIFIED_ERROR) == -1);
+}
+
+static void test_v5_subscribe(void) {
+    uint8_t buf[64];
+    mqtt_packet_view_t view;
+    mqtt_properties_t props;
+    mqtt_subscription_t subs[] = {
+        { STR("iot/gateway/cmd/#"), MQTT_QOS1 }
+    };
+    const uint8_t *codes;
+    size_t count;
+    uint16_t packet_id;
+
+    int len = mqtt_encode_subscribe_v5(buf, sizeof(buf), 3, subs, 1, NULL);
+    CHECK(len == 2 + 2 + 1 + 2 + 17 + 1);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(view.type == MQTT_SUBSCRIBE && view.flags == 0x02);
+    CHECK(view.body[2] == 0x00 && view.body[view.body_len - 1] == MQTT_QOS1);
+    CHECK(mqtt_encode_subscribe_v5(buf, len - 1, 3, subs, 1, NULL) == -1);
+
+    static const uint8_t suback[] = { MQTT_SUBACK, 0x05, 0x00, 0x03, 0x00, 0x01, 0x87 };
+    CHECK(mqtt_decode_packet(suback, sizeof(suback), &view) == (int)sizeof(suback));
+    CHECK(mqtt_decode_suback_v5(&view, &packet_id, &codes, &count, &props) == 0);
+    CHECK(packet_id == 3 && count == 2 && codes[0] == MQTT_QOS1 && codes[1] == 0x87);
+    CHECK(mqtt_decode_suback(&view, &packet_id, &codes, &count) == -1);
+
+    static const uint8_t bad_code[] = { MQTT_SUBACK, 0x04, 0x00, 0x03, 0x00, 0x05 };
+    CHECK(mqtt_decode_packet(bad_code, sizeof(bad_code), &view) == (int)sizeof(bad_code));
+    CHECK(mqtt_decode_suback_v5(&view, &packet_id, &codes, &count, &props) == -1);
+
+    static const uint8_t no_codes[] = { MQTT_SUBACK, 0x03, 0x00, 0x03, 0x00 };
+    CHECK(mqtt_decode_packet(no_codes, sizeof(no_codes), &view) == (int)sizeof(no_codes));
+    CHECK(mqtt_decode_suback_v5(&view, &packet_id, &codes, &count, &props) == -1);
+}
+
+static void test_v5_properties(void) {
+    uint8_t buf[128];
+    mqtt_packet_view_t view;
+    mqtt_properties_t props, out;
+    mqtt_publish_t pub;
+    mqtt_user_property_t users[] = {
+        { STR("site"), STR("lab") },
+        { STR("batch"), STR("10") }
+    };
+    static const uint8_t payload[] = "[]";
+
+    memset(&props, 0, sizeof(props));
+    props.present = MQTT_HAS_CONTENT_TYPE | MQTT_HAS_PAYLOAD_FORMAT;
+    props.content_type = STR("application/json");
+    props.payload_format = 1;
+    props.user_properties = users;
+    props.user_property_count = 2;
+    mqtt_publish_t in = {
+        .topic = STR("b"),
+        .properties = &props,
+        .payload = payload,
+        .payload_len = 2
+    };
+
+    int len = mqtt_encode_publish(buf, sizeof(buf), &in);
+    CHECK(len == 2 + 3 + 1 + 19 + 2 + 12 + 12 + 2);
+    CHECK(mqtt_decode_packet(buf, len, &view) == len);
+    CHECK(mqtt_decode_publish_v5(&view, &pub, &out) == 0);
+    CHECK(str_eq(&out.content_type, "application/json") && out.payload_format == 1);
+    CHECK(out.user_property_count == 2 && out.user_properties == NULL);
+    CHECK(pub.payload_len == 2 && pub.properties == &out);
+
+    static const uint8_t duplicate[] = {
+        MQTT_PUBLISH, 0x0A, 0x00, 0x01, 'b', 0x06,
+        MQTT_PROP_TOPIC_ALIAS, 0x00, 0x01, MQTT_PROP_TOPIC_ALIAS, 0x00, 0x02
+    };
+    CHECK(mqtt_decode_packet(duplicate, sizeof(duplicate), &view) == (int)sizeof(duplicate));
+    CHECK(mqtt_decode_publish_v5(&view, &pub, &out) == -1);
+
+    static const uint8_t unknown[] = { MQTT_PUBLISH, 0x06, 0x00, 0x01, 'b', 0x02, 0x7F, 0x00 };
+    CHECK(mqtt_decode_packet(unknown, sizeof(unknown), &view) == (int)sizeof(unknown));
+    CHECK(mqtt_decode_publish_v5(&view, &pub, &out) == -1);
+
+    static const uint8_t overrun[] = { MQTT_PUBLISH, 0x06, 0x00, 0x01, 'b', 0x05, 0x02, 0x00 };
+    CHECK(mqtt_decode_packet(overrun, sizeof(overrun), &view) == (int)sizeof(overrun));
+    CHECK(mqtt_decode_publish_v5(&view, &pub, &out) == -1);
+
+    static const uint8_t skipped[] = {
+        MQTT_PUBLISH, 0x0A, 0x00, 0x01, 'b', 0x05, MQTT_PROP_SUBSCRIPTION_ID, 0x81, 0x01,
+        MQTT_PROP_REQUEST_PROBLEM_INFO, 0x01, 'p'
+    };
+    CHECK(mqtt_decode_packet(skipped, sizeof(skipped), &view) == (int)sizeof(skipped));
+    CHECK(mqtt_decode_publish_v5(&view, &pub, &out) == 0);
+    CHECK(out.present == 0 && pub.payload_len == 1 && pub.payload[0] == 'p');
+}
+
+int main(void) {
+    test_remaining_length();
+    test_connect_roundtrip();
+    test_connect_minimal();
+    test_connack();
+    test_publish();
+    test_publish_large_payload();
+    test_acks();
+    test_subscribe();
+    test_empty_packets();
+    test_truncated_bodies();
+    test_rx_ring_wrap();
+    test_rx_ring_oversized();
+    test_v5_connect();
+    test_v5_connack();
+    test_v5_publish_alias();
+    test_v5_acks();
+    test_v5_subscribe();
+    test_v5_properties();
+
+    return check_report();
+}
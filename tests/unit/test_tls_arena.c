@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "tls_arena.h"
+#include "check.h"
+
+static uint8_t buffer[4096 + 8];
+static tls_arena_t arena;
+
+static bool is_zero(const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_alloc_free(void) {
+    tls_arena_stats_t stats;
+
+    tls_arena_init(&arena, buffer + 1, 4096);
+    tls_arena_stats(&arena, &stats);
+    CHECK(stats.size > 4000 && stats.size <= 4096);
+    CHECK(stats.used == 0);
+    CHECK(stats.largest_free == stats.size);
+    CHECK(stats.free_blocks == 1);
+
+    uint8_t *a = tls_arena_calloc(&arena, 10, 10);
+    uint8_t *b = tls_arena_calloc(&arena, 1, 1);
+    uint8_t *c = tls_arena_calloc(&arena, 0, 8);
+    CHECK(a != NULL && b != NULL && c != NULL);
+    CHECK(a != b && b != c && a != c);
+    CHECK(((uintptr_t)a & 15) == 0 && ((uintptr_t)b & 15) == 0);
+    CHECK(is_zero(a, 100));
+    memset(a, 0xaa, 100);
+    memset(b, 0xbb, 1);
+    CHECK(b[0] == 0xbb && a[99] == 0xaa);
+
+    tls_arena_stats(&arena, &stats);
+    CHECK(stats.blocks == 3);
+    CHECK(stats.allocs == 3);
+    CHECK(stats.used > 100 && stats.used == stats.peak);
+
+    tls_arena_free(&arena, a);
+    tls_arena_free(&arena, NULL);
+    uint8_t *d = tls_arena_calloc(&arena, 1, 64);
+    CHECK(d == a);
+    CHECK(is_zero(d, 64));
+
+    tls_arena_free(&arena, b);
+    tls_arena_free(&arena, d);
+    tls_arena_free(&arena, c);
+    tls_arena_stats(&arena, &stats);
+    CHECK(stats.used == 0);
+    CHECK(stats.blocks == 0);
+    CHECK(stats.free_blocks == 1);
+    CHECK(stats.largest_free == stats.size);
+    CHECK(stats.peak > 100);
+}
+
+static void test_exhaustion(void) {
+    tls_arena_stats_t stats;
+
+    tls_arena_init(&arena, buffer, 4096);
+    tls_arena_stats(&arena, &stats);
+    CHECK(tls_arena_calloc(&arena, 1, 4096) == NULL);
+    CHECK(tls_arena_calloc(&arena, SIZE_MAX / 2, 4) == NULL);
+    /* Block headers are 16 bytes. */
+    uint8_t *all = tls_arena_calloc(&arena, 1, stats.largest_free - 16);
+    CHECK(all != NULL);
+    CHECK(tls_arena_calloc(&arena, 1, 1) == NULL);
+    tls_arena_stats(&arena, &stats);
+    CHECK(stats.failures == 3);
+    CHECK(stats.free_blocks == 0 && stats.largest_free == 0);
+    tls_arena_free(&arena, all);
+    CHECK(tls_arena_calloc(&arena, 1, 4000) != NULL);
+
+    tls_arena_init(&arena, buffer, 16);
+    CHECK(tls_arena_calloc(&arena, 1, 1) == NULL);
+}
+
+/* Freeing every other block leaves holes no bigger than one block; freeing
+ * the rest in any order must merge them back into one. */
+static void test_fragmentation(void) {
+    tls_arena_stats_t stats;
+    uint8_t *blocks[32];
+
+    tls_arena_init(&arena, buffer, 4096);
+    for (int i = 0; i < 32; i++) {
+        blocks[i] = tls_arena_calloc(&arena, 1, 64);
+        CHECK(blocks[i] != NULL);
+    }
+    for (int i = 0; i < 32; i += 2) {
+        tls_arena_free(&arena, blocks[i]);
+    }
+    tls_arena_stats(&arena, &stats);
+    CHECK(stats.free_blocks == 17);
+    CHECK(stats.largest_free < stats.size - stats.used);
+    CHECK(tls_arena_calloc(&arena, 1, 2048) == NULL);
+
+    for (int i = 31; i > 0; i -= 2) {
+        tls_arena_free(&arena, blocks[i]);
+    }
+    tls_arena_stats(&arena, &stats);
+    CHECK(stats.used == 0);
+    CHECK(stats.free_blocks == 1);
+    CHECK(stats.largest_free == stats.size);
+}
+
+static void test_owner(void) {
+    size_t first = 0;
+    size_t second = 0;
+
+    tls_arena_init(&arena, buffer, 4096);
+    uint8_t *shared = tls_arena_calloc(&arena, 1, 100);
+    arena.owner = &first;
+    uint8_t *a = tls_arena_calloc(&arena, 1, 100);
+    uint8_t *b = tls_arena_calloc(&arena, 1, 200);
+    CHECK(first >= 300 && first < arena.used);
+    arena.owner = &second;
+    uint8_t *c = tls_arena_calloc(&arena, 1, 50);
+    size_t charged = first;
+    CHECK(second > 50 && second < charged);
+
+    /* Frees credit the block's owner, not the one set now. */
+    tls_arena_free(&arena, a);
+    CHECK(first < charged && second > 50);
+    arena.owner = NULL;
+    tls_arena_free(&arena, b);
+    tls_arena_free(&arena, c);
+    CHECK(first == 0 && second == 0);
+    tls_arena_free(&arena, shared);
+    CHECK(arena.used == 0);
+}
+
+int main(void) {
+    test_alloc_free();
+    test_exhaustion();
+    test_fragmentation();
+    test_owner();
+
+    return check_report();
+}
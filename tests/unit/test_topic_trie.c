@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <string.h>
+#include "topic_trie.h"
+#include "check.h"
+
+static topic_trie_t trie;
+
+static int add(const char *filter) {
+    return topic_trie_add(&trie, filter, strlen(filter));
+}
+
+static uint32_t match(const char *topic) {
+    return topic_trie_match(&trie, topic, strlen(topic));
+}
+
+static void test_filter_validation(void) {
+    static const char *valid[] = { "a", "a/b", "+", "#", "a/+/c", "a/#", "+/+", "/", "a//b", "+/#" };
+    static const char *invalid[] = { "", "a+", "a/b+", "+a/b", "a/#/b", "a#", "##", "a/b#" };
+
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        CHECK(topic_filter_valid(valid[i], strlen(valid[i])));
+    }
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        CHECK(!topic_filter_valid(invalid[i], strlen(invalid[i])));
+    }
+}
+
+static void test_literal(void) {
+    topic_trie_init(&trie);
+    CHECK(add("iot/gateway/cmd/reboot") == 0);
+    CHECK(add("iot/gateway/cmd") == 1);
+    CHECK(match("iot/gateway/cmd/reboot") == 0x1);
+    CHECK(match("iot/gateway/cmd") == 0x2);
+    CHECK(match("iot/gateway") == 0);
+    CHECK(match("iot/gateway/cmd/reboot/now") == 0);
+    CHECK(match("iot/gateway/cmd/rebooT") == 0);
+    CHECK(match("") == 0);
+}
+
+static void test_wildcards(void) {
+    topic_trie_init(&trie);
+    CHECK(add("sport/tennis/+") == 0);
+    CHECK(add("sport/#") == 1);
+    CHECK(add("+/tennis/#") == 2);
+    CHECK(add("#") == 3);
+    CHECK(add("sport/+/player1") == 4);
+
+    CHECK(match("sport/tennis/player1") == 0x1F);
+    CHECK(match("sport/tennis") == 0xE);
+    CHECK(match("sport") == 0xA);
+    CHECK(match("sport/tennis/player1/ranking") == 0xE);
+    CHECK(match("news/tennis") == 0xC);
+    CHECK(match("sport/golf/player1") == 0x1A);
+    CHECK(match("news") == 0x8);
+}
+
+static void test_empty_levels(void) {
+    topic_trie_init(&trie);
+    CHECK(add("+/+") == 0);
+    CHECK(add("/+") == 1);
+    CHECK(add("a//b") == 2);
+    CHECK(match("/finance") == 0x3);
+    CHECK(match("a//b") == 0x4);
+    CHECK(match("a/b") == 0x1);
+}
+
+static void test_dollar_topics(void) {
+    topic_trie_init(&trie);
+    CHECK(add("#") == 0);
+    CHECK(add("+/monitor/Clients") == 1);
+    CHECK(add("$SYS/#") == 2);
+    CHECK(add("$SYS/monitor/+") == 3);
+    CHECK(match("$SYS/monitor/Clients") == 0xC);
+    CHECK(match("$SYS") == 0x4);
+    CHECK(match("x/monitor/Clients") == 0x3);
+}
+
+static void test_shared_prefixes(void) {
+    topic_trie_init(&trie);
+    CHECK(add("a/b") == 0);
+    CHECK(add("a/b") == 1);
+    CHECK(add("a/+") == 2);
+    uint16_t nodes = trie.node_count;
+    CHECK(add("a/b/#") == 3);
+    CHECK(trie.node_count == nodes);
+    CHECK(match("a/b") == 0xF);
+    CHECK(match("a/c") == 0x4);
+}
+
+static void test_limits(void) {
+    char filter[64];
+    topic_trie_init(&trie);
+    for (int i = 0; i < TOPIC_TRIE_MAX_FILTERS; i++) {
+        snprintf(filter, sizeof(filter), "f/%d", i);
+        CHECK(add(filter) == i);
+    }
+    CHECK(add("f/extra") == -1);
+    CHECK(match("f/31") == 1u << 31);
+    CHECK(add("a/#/b") == -1);
+
+    topic_trie_init(&trie);
+    CHECK(add("1/2/3/4/5/6/7/8/9/10/11/12/13/14/15/16") == 0);
+    CHECK(add("1/2/3/4/5/6/7/8/9/10/11/12/13/14/15/16/17") == -1);
+    CHECK(match("1/2/3/4/5/6/7/8/9/10/11/12/13/14/15/16") == 0x1);
+    CHECK(match("1/2/3/4/5/6/7/8/9/10/11/12/13/14/15/16/17") == 0);
+}
+
+int main(void) {
+    test_filter_validation();
+    test_literal();
+    test_wildcards();
+    test_empty_levels();
+    test_dollar_topics();
+    test_shared_prefixes();
+    test_limits();
+
+    return check_report();
+}